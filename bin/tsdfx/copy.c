@@ -31,11 +31,13 @@
 # include "config.h"
 #endif
 
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
-#include <pwd.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -48,6 +50,7 @@
 #endif
 
 #include <tsd/assert.h>
+#include <tsd/hash.h>
 #include <tsd/log.h>
 #include <tsd/sha1.h>
 #include <tsd/strutil.h>
@@ -74,41 +77,168 @@ struct tsdfx_copy_task_data {
 	char src[PATH_MAX];
 	char dst[PATH_MAX];
 	const char *maxsize;
+	off_t size;
+
+	/*
+	 * Waiting for the parent directory to be created, either by the
+	 * task on whose list we are or, if there is none, by a task which
+	 * has since completed.  Tasks held on us are on our list.
+	 */
+	int held;
+	struct tsdfx_copy_task_data *holder;
+	struct tsdfx_copy_task_data *hprev, *hnext;
+	struct tsdfx_copy_task_data *hfirst;
+
+	/* when it was last added to a queue */
+	time_t queued;
+
+	struct tsd_task *task;
+
+	/* batch copier this task has been handed to, if any */
+	struct tsdfx_copy_batch *batch;
+	struct tsdfx_copy_task_data *bnext;
+};
+
+/*
+ * A batch copier copies several files with the same credentials in a
+ * single process.  Each file is written to its stdin as a record, and
+ * it reports on each in turn on its stdout.  While in a batch, a copy
+ * task remains idle and is not in any queue; the batch copier takes up
+ * a slot in the queue the tasks came from.
+ *
+ * With a keepalive, a batch copier which runs out of work waits in a
+ * pool for more files with the same credentials, until it has been idle
+ * for too long or has copied enough files.  It keeps its slot while it
+ * waits, so a size class never has more copiers, busy or idle, than it
+ * has slots; when a class needs a slot for someone else, the copier in
+ * it which has been idle the longest is retired.
+ */
+struct tsdfx_copy_batch {
+	struct tsd_task *task;
+	struct tsdfx_copy_batch *prev, *next;
+
+	/* queue it runs in, and its size class unless it is a purger */
+	struct tsd_tqueue *tq;
+	struct tsdfx_copy_queueinfo *qi;
+
+	/*
+	 * While idle, it is on its class's list of idle copiers, least
+	 * recently used first, and in the pool under a hash of its queue
+	 * and credentials.
+	 */
+	struct tsdfx_copy_batch *pprev, *pnext;
+	struct tsdfx_copy_batch *hprev, *hnext;
+	uint64_t h;
+	time_t idle;
+	unsigned int njobs;
+	int retiring;
+
+	/* files handed to this batch, in order */
+	struct tsdfx_copy_task_data *first, *last;
+	unsigned int nfiles;
+
+	/* records not yet written, and whether there will be more */
+	char *out;
+	size_t outlen, outsize;
+	int eof;
+
+	/* results not yet processed, and whether there will be more */
+	char in[PATH_MAX + 32];
+	size_t inlen;
+	int done;
 };
 
+/* max files per batch copier, or 0 to start one copier per file */
+unsigned int tsdfx_copy_batch_size;
+
+static struct tsdfx_copy_batch *tsdfx_copy_batches;
+static unsigned int tsdfx_copy_nbatches;
+static unsigned int tsdfx_copy_batchno;
+
+/* how long idle copiers are kept, or 0 to stop them right away */
+time_t tsdfx_copy_keepalive;
+
+/*
+ * Purge tasks have a queue of their own with a single slot.  They are
+ * handed in batches of up to TSDFX_COPY_PURGE_BATCH files with the
+ * same owner to a purge worker, and we start at most one worker every
+ * TSDFX_COPY_PURGE_INTERVAL seconds.
+ */
+#define TSDFX_COPY_PURGE_BATCH 1024
+#define TSDFX_COPY_PURGE_INTERVAL 1
+static struct tsd_tqueue *tsdfx_copy_purgeq;
+static time_t tsdfx_copy_purge_due;
+
+/* files a copier may be handed before it is retired, or 0 for default */
+#define TSDFX_COPY_MAXJOBS 1024
+unsigned int tsdfx_copy_maxjobs;
+
+/* idle copiers by queue and credentials, and how many are retiring */
+#define TSDFX_COPY_POOLHASH 64
+static struct tsdfx_copy_batch *tsdfx_copy_pool[TSDFX_COPY_POOLHASH];
+static unsigned int tsdfx_copy_npool;
+static unsigned int tsdfx_copy_nretiring;
+
 /*
  * Task set for copy tasks
  */
 static struct tsd_tset *tsdfx_copy_tasks;
 
 /*
- * Size-differentiated task queues for copy tasks
+ * Size-differentiated task queues for copy tasks.  Each size class has
+ * a limit on the number of copiers it may run, and a weight which
+ * determines its share of the copiers when the total is limited.  The
+ * classes are described by a comma-separated list of size:slots or
+ * size:slots:weight, in increasing order of size; the size of the last
+ * class may be left out.  The weight defaults to the number of slots.
+ */
+#define TSDFX_COPY_MAXQUEUES 16
+#define TSDFX_COPY_CLASSES "1M:8,:4"
+#define TSDFX_COPY_STRIDE (1 << 20)
+
+/*
+ * A class whose oldest idle task has waited this many seconds gets
+ * ahead of the others by one stride for each such period, so that no
+ * class can be starved, however low its weight.
  */
-#define TSDFX_COPY_NQUEUES 2
+#define TSDFX_COPY_AGING 60
 static struct tsdfx_copy_queueinfo {
 	size_t		 max_size;
 	unsigned int	 max_tasks;
+	unsigned int	 weight;
+	unsigned long long pass;
 	char		 max_size_str[sizeof(size_t) * 4]; /* ~log10(SIZE_MAX) */
-} tsdfx_queueinfo[TSDFX_COPY_NQUEUES] = {
-	{
-		.max_size = 1024*1024,
-		.max_tasks = 8,
-	},
-	{
-		.max_size = SIZE_MAX,
-		.max_tasks = 4,
-	},
-};
-static struct tsd_tqueue *tsdfx_copy_queues[TSDFX_COPY_NQUEUES];
+	struct tsdfx_copy_batch *pool, *pool_last;	/* idle copiers */
+	unsigned int	 npool;
+	unsigned int	 nretiring;
+} tsdfx_queueinfo[TSDFX_COPY_MAXQUEUES];
+static struct tsd_tqueue *tsdfx_copy_queues[TSDFX_COPY_MAXQUEUES];
+static unsigned int tsdfx_copy_nqueues;
+
+/* size classes, and max concurrent copy tasks or 0 for no limit */
+const char *tsdfx_copy_classes;
+unsigned int tsdfx_copy_max_tasks;
+
+/* pass of the last class we dispatched from */
+static unsigned long long tsdfx_copy_pass;
+
+/* number of tasks waiting for their parent directory */
+static unsigned int tsdfx_copy_nheld;
+
+/* held tasks whose parent has completed */
+static struct tsdfx_copy_task_data *tsdfx_copy_released;
 
 /* full path to copier binary */
 const char *tsdfx_copier;
 
 static void tsdfx_copy_name(char *, const char *, const char *);
-static struct tsd_task *tsdfx_copy_find(const char *, const char *);
+static struct tsd_task *tsdfx_copy_find(const char *, const char *,
+    const char *);
 static int tsdfx_copy_poll(struct tsd_task *);
 static void tsdfx_copy_child(void *);
+static void tsdfx_copy_batch_child(void *);
 static void tsdfx_copy_purgesource_child(void *);
+static void tsdfx_copy_purge_child(void *);
 
 static int tsdfx_copy_add(struct tsd_task *);
 static int tsdfx_copy_remove(struct tsd_task *);
@@ -141,16 +271,188 @@ tsdfx_copy_name(char *name, const char *src, const char *dst)
 }
 
 /*
- * Return the first copy task that matches the specified source and / or
- * destination.
+ * Hash the concatenation of a source directory and relative path, and
+ * of a destination directory and the same path unless this is a purge
+ * task (dstdir is NULL).  Copy tasks are indexed in the task set under
+ * this rather than under their name, so that we can check for
+ * duplicates without first building the full paths and the name.
+ */
+static uint64_t
+tsdfx_copy_key(const char *srcdir, const char *dstdir, const char *path)
+{
+	uint64_t h;
+
+	h = tsd_strhash64_update(TSD_STRHASH64_INIT, srcdir);
+	h = tsd_strhash64_update(h, path);
+	if (dstdir != NULL) {
+		h = tsd_strhash64_update(h, "/");
+		h = tsd_strhash64_update(h, dstdir);
+		h = tsd_strhash64_update(h, path);
+	}
+	return (tsd_strhash64_final(h));
+}
+
+/*
+ * Check whether a full path is the concatenation of dir and path.
+ */
+static int
+tsdfx_copy_match(const char *full, const char *dir, const char *path)
+{
+	size_t len;
+
+	len = strlen(dir);
+	return (strncmp(full, dir, len) == 0 && strcmp(full + len, path) == 0);
+}
+
+/*
+ * Check whether a copy task is the one tsdfx_copy_find() is looking for.
+ */
+struct tsdfx_copy_match {
+	const char *srcdir, *dstdir, *path;
+};
+
+static int
+tsdfx_copy_match_task(const struct tsd_task *t, const void *arg)
+{
+	const struct tsdfx_copy_task_data *ctd = t->ud;
+	const struct tsdfx_copy_match *m = arg;
+
+	if (!tsdfx_copy_match(ctd->src, m->srcdir, m->path))
+		return (0);
+	return (m->dstdir == NULL ? *ctd->dst == '\0' :
+	    tsdfx_copy_match(ctd->dst, m->dstdir, m->path));
+}
+
+/*
+ * Return the copy or purge task for the specified path relative to the
+ * source and destination directories, or NULL if there is none.  Full
+ * paths can be looked up by passing an empty relative path.
  */
 static struct tsd_task *
-tsdfx_copy_find(const char *src, const char *dst)
+tsdfx_copy_find(const char *srcdir, const char *dstdir, const char *path)
 {
-	char name[NAME_MAX];
+	struct tsdfx_copy_match m = { srcdir, dstdir, path };
 
-	tsdfx_copy_name(name, src, dst);
-	return (tsd_tset_find(tsdfx_copy_tasks, name));
+	return (tsd_tset_match(tsdfx_copy_tasks,
+	    tsdfx_copy_key(srcdir, dstdir, path), tsdfx_copy_match_task, &m));
+}
+
+/*
+ * Return the pending task, if any, which is copying the directory in
+ * which a copy task will create its destination.  Directories are
+ * named with a trailing slash by the scanner.
+ */
+static struct tsd_task *
+tsdfx_copy_parent(const struct tsdfx_copy_task_data *ctd)
+{
+	char src[PATH_MAX], dst[PATH_MAX];
+	size_t srclen, dstlen;
+
+	if (*ctd->dst == '\0')
+		return (NULL);
+	srclen = strlcpy(src, ctd->src, sizeof src);
+	dstlen = strlcpy(dst, ctd->dst, sizeof dst);
+	while (srclen > 0 && src[srclen - 1] == '/')
+		--srclen;
+	while (srclen > 0 && src[srclen - 1] != '/')
+		--srclen;
+	while (dstlen > 0 && dst[dstlen - 1] == '/')
+		--dstlen;
+	while (dstlen > 0 && dst[dstlen - 1] != '/')
+		--dstlen;
+	if (srclen == 0 || dstlen == 0)
+		return (NULL);
+	src[srclen] = dst[dstlen] = '\0';
+	return (tsdfx_copy_find(src, dst, ""));
+}
+
+/*
+ * Hold a task until the given task, which is copying its parent
+ * directory, has completed, or if there is none, put it on the list of
+ * tasks to be released.
+ */
+static void
+tsdfx_copy_hold(struct tsdfx_copy_task_data *ctd,
+    struct tsdfx_copy_task_data *holder)
+{
+	struct tsdfx_copy_task_data **head;
+
+	head = holder != NULL ? &holder->hfirst : &tsdfx_copy_released;
+	ctd->holder = holder;
+	ctd->hprev = NULL;
+	if ((ctd->hnext = *head) != NULL)
+		ctd->hnext->hprev = ctd;
+	*head = ctd;
+}
+
+/*
+ * Take a held task off whichever list it is on.
+ */
+static void
+tsdfx_copy_unhold(struct tsdfx_copy_task_data *ctd)
+{
+
+	if (ctd->hprev != NULL)
+		ctd->hprev->hnext = ctd->hnext;
+	else if (ctd->holder != NULL)
+		ctd->holder->hfirst = ctd->hnext;
+	else
+		tsdfx_copy_released = ctd->hnext;
+	if (ctd->hnext != NULL)
+		ctd->hnext->hprev = ctd->hprev;
+	ctd->holder = ctd->hprev = ctd->hnext = NULL;
+}
+
+/*
+ * Add a task to the queue for its size class.
+ */
+static int
+tsdfx_copy_enqueue(struct tsd_task *t)
+{
+	struct tsdfx_copy_task_data *ctd = t->ud;
+	int i;
+
+	ctd->queued = time(NULL);
+	if (t->func == tsdfx_copy_purgesource_child)
+		return (tsd_tqueue_insert(tsdfx_copy_purgeq, t));
+	for (i = 0; i < (int)tsdfx_copy_nqueues; ++i) {
+		if ((size_t)ctd->size <= tsdfx_queueinfo[i].max_size) {
+			VERBOSE("Assigning %s to copier for files size <= %zu",
+			    ctd->src, tsdfx_queueinfo[i].max_size);
+			ctd->maxsize = tsdfx_queueinfo[i].max_size_str;
+			return (tsd_tqueue_insert(tsdfx_copy_queues[i], t));
+		}
+	}
+	return (0);
+}
+
+/*
+ * A copier gave up on a file because it outgrew its size class.  Move
+ * the task to the queue for the class it now belongs to; the next
+ * copier will resume where this one left off.  Returns -1 if the file
+ * did not in fact outgrow its class, so that we don't loop.
+ */
+static int
+tsdfx_copy_requeue(struct tsd_task *t)
+{
+	struct tsdfx_copy_task_data *ctd = t->ud;
+	struct stat st;
+	size_t max_size;
+
+	max_size = strtoull(ctd->maxsize, NULL, 10);
+	if (lstat(ctd->src, &st) != 0)
+		return (-1);
+	if ((size_t)st.st_size <= max_size) {
+		errno = EFBIG;
+		return (-1);
+	}
+	NOTICE("%s grew to %zu bytes, moving to a larger size class",
+	    ctd->src, (size_t)st.st_size);
+	if (t->queue != NULL)
+		tsd_tqueue_remove(t->queue, t);
+	tsd_task_reset(t);
+	ctd->size = st.st_size;
+	return (tsdfx_copy_enqueue(t));
 }
 
 /*
@@ -195,24 +497,26 @@ tsdfx_copy_remove(struct tsd_task *t)
 /*
  * Prepare a copy or purge task.
  * Purge src if dst is NULL.
+ * Tasks are queued fairly among groups (maps) according to their
+ * weight, and among owners within each group.
  */
 struct tsd_task *
-tsdfx_copy_new(const char *src, const char *dst)
+tsdfx_copy_new(const char *src, const char *dst, unsigned long long group,
+    unsigned int weight)
 {
 	char name[NAME_MAX];
 	struct tsdfx_copy_task_data *ctd = NULL;
-	struct tsd_task *t = NULL;
+	struct tsd_task *t = NULL, *pt;
 	struct stat st;
-	struct passwd *pw;
 	tsd_task_func *task;
-	int i, serrno;
+	int serrno;
 
 	/* check that the source exists */
 	if (lstat(src, &st) != 0)
 		return (NULL);
 
 	/* check for existing task */
-	if (tsdfx_copy_find(src, dst) != NULL) {
+	if (tsdfx_copy_find(src, dst, "") != NULL) {
 		errno = EEXIST;
 		return (NULL);
 	}
@@ -226,6 +530,7 @@ tsdfx_copy_new(const char *src, const char *dst)
 		errno = ENAMETOOLONG;
 		goto fail;
 	}
+	ctd->size = st.st_size;
 
 	/* create task and set credentials */
 	tsdfx_copy_name(name, src, dst);
@@ -235,35 +540,40 @@ tsdfx_copy_new(const char *src, const char *dst)
 		task = tsdfx_copy_purgesource_child;
 	if ((t = tsd_task_create(name, task, ctd)) == NULL)
 		goto fail;
-	if ((pw = getpwuid(st.st_uid)) != NULL) {
-		VERBOSE("setuser(\"%s\") for %s", pw->pw_name, src);
-		if (tsd_task_setuser(t, pw->pw_name) != 0)
-			goto fail;
+	ctd->task = t;
+	t->h = tsdfx_copy_key(src, dst, "");
+	t->qgroup = group;
+	t->qweight = weight;
+	if (tsd_task_setuid(t, st.st_uid) == 0) {
+		VERBOSE("setuid(%lu) (%s) for %s", (unsigned long)st.st_uid,
+		    t->user, src);
 		if (tsd_task_setegid(t, st.st_gid) != 0) {
 			WARNING("%s: owner %lu (%s) is not in group %lu", src,
-			    (unsigned long)st.st_uid, pw->pw_name,
+			    (unsigned long)st.st_uid, t->user,
 			    (unsigned long)st.st_gid);
 		}
 	} else {
-		VERBOSE("getpwuid(%lu) failed; setcred(%lu, %lu) for %s",
-		    (unsigned long)st.st_uid, (unsigned long)st.st_uid,
-		    (unsigned long)st.st_gid, src);
+		VERBOSE("setuid(%lu) failed: %s; setcred(%lu, %lu) for %s",
+		    (unsigned long)st.st_uid, strerror(errno),
+		    (unsigned long)st.st_uid, (unsigned long)st.st_gid, src);
 		if (tsd_task_setcred(t, st.st_uid, &st.st_gid, 1) != 0)
 			goto fail;
 	}
 	if (tsdfx_copy_add(t) != 0)
 		goto fail;
 
-	/* Select queue based on current size */
-	for (i = 0; i < TSDFX_COPY_NQUEUES; ++i) {
-		if ((size_t)st.st_size <= tsdfx_queueinfo[i].max_size) {
-			VERBOSE("Assigning %s to copier for files size <= %zu",
-			    src, tsdfx_queueinfo[i].max_size);
-			ctd->maxsize = tsdfx_queueinfo[i].max_size_str;
-			if (tsd_tqueue_insert(tsdfx_copy_queues[i], t) != 0)
-				goto fail;
-			break;
-		}
+	/*
+	 * If the directory we're copying into is itself still being
+	 * copied, hold off until it is done; otherwise, select a queue
+	 * based on current size.
+	 */
+	if ((pt = tsdfx_copy_parent(ctd)) != NULL) {
+		VERBOSE("holding %s until its parent has been copied", src);
+		ctd->held = 1;
+		tsdfx_copy_nheld++;
+		tsdfx_copy_hold(ctd, pt->ud);
+	} else if (tsdfx_copy_enqueue(t) != 0) {
+		goto fail;
 	}
 
 	return (t);
@@ -283,7 +593,7 @@ fail:
 static void
 tsdfx_copy_delete(struct tsd_task *t)
 {
-	struct tsdfx_copy_task_data *ctd;
+	struct tsdfx_copy_task_data *ctd, *c;
 
 	if (t == NULL)
 		return;
@@ -291,6 +601,15 @@ tsdfx_copy_delete(struct tsd_task *t)
 	ctd = t->ud;
 
 	VERBOSE("stopping %s -> %s", ctd->src, ctd->dst);
+	if (ctd->held) {
+		tsdfx_copy_unhold(ctd);
+		tsdfx_copy_nheld--;
+	}
+	/* whatever was waiting for us can now go ahead */
+	while ((c = ctd->hfirst) != NULL) {
+		tsdfx_copy_unhold(c);
+		tsdfx_copy_hold(c, NULL);
+	}
 	tsdfx_copy_remove(t);
 	tsd_task_destroy(t);
 	free(ctd);
@@ -305,36 +624,21 @@ tsdfx_copy_purgesource_child(void *ud)
 	struct tsdfx_copy_task_data *ctd = ud;
 
 	/*
-	 * At this point, running as the owner of the file.
+	 * At this point, running as the owner of the file.  Our parent
+	 * will log the failure if we exit with a non-zero status.
 	 */
-	if (-1 == remove(ctd->src)) {
-		/*
-		 * FIXME: this message do not make it into the log.
-		 */
-		fprintf(stderr, "failed to purge old source file %s: %s\n",
-			ctd->src, strerror(errno));
-	}
+	_exit(remove(ctd->src) == 0 ? 0 : 1);
 }
 
 /*
- * Copy task child: execute the copier program.
+ * Fill in the copier command line options common to single and batch
+ * copiers, and return their number.
  */
-static void
-tsdfx_copy_child(void *ud)
+static int
+tsdfx_copy_argv(const char **argv)
 {
-	struct tsdfx_copy_task_data *ctd = ud;
-	const char *argv[12];
 	int argc;
 
-	/* check credentials */
-	if (geteuid() == 0 || getegid() == 0)
-		WARNING("copying %s with uid %u gid %u", ctd->src,
-		    (unsigned int)geteuid(), (unsigned int)getegid());
-
-	/* set safe umask */
-	umask(TSDFX_COPY_UMASK);
-
-	/* run the copy task */
 	argc = 0;
 	argv[argc++] = tsdfx_copier;
 	if (tsdfx_dryrun)
@@ -349,6 +653,29 @@ tsdfx_copy_child(void *ud)
 	 */
 	argv[argc++] = "-l";
 	argv[argc++] = ":user=:stderr";
+	return (argc);
+}
+
+/*
+ * Copy task child: execute the copier program.
+ */
+static void
+tsdfx_copy_child(void *ud)
+{
+	struct tsdfx_copy_task_data *ctd = ud;
+	const char *argv[12];
+	int argc;
+
+	/* check credentials */
+	if (geteuid() == 0 || getegid() == 0)
+		WARNING("copying %s with uid %u gid %u", ctd->src,
+		    (unsigned int)geteuid(), (unsigned int)getegid());
+
+	/* set safe umask */
+	umask(TSDFX_COPY_UMASK);
+
+	/* run the copy task */
+	argc = tsdfx_copy_argv(argv);
 	if (ctd->maxsize != NULL) {
 		argv[argc++] = "-m";
 		argv[argc++] = ctd->maxsize;
@@ -378,194 +705,1237 @@ tsdfx_copy_poll(struct tsd_task *t)
 }
 
 /*
- * Given source and destination directories and a list of files to copy,
- * start copy tasks for each file.
+ * Some SFTP clients seem to mangle file permissions so we sometimes end
+ * up with files or directories on the import side with weird
+ * permissions, or even none at all.  Compute a sane minimum set of
+ * permissions.
  */
-int
-tsdfx_copy_wrap(const char *srcdir, const char *dstdir, const char *path)
+static mode_t
+tsdfx_copy_fixmode(mode_t mode)
 {
-	char srcpath[PATH_MAX], dstpath[PATH_MAX];
-	struct stat srcst, dstst;
-	mode_t mode;
-
-	/* create full paths */
-	if (snprintf(srcpath, PATH_MAX, "%s%s", srcdir, path) >= PATH_MAX ||
-	    snprintf(dstpath, PATH_MAX, "%s%s", dstdir, path) >= PATH_MAX) {
-		errno = ENAMETOOLONG;
-		return (-1);
-	}
-
-	/* log and check for duplicate */
-	if (tsdfx_copy_find(srcpath, dstpath) != NULL)
-		return (0);
-	VERBOSE("%s -> %s", srcpath, dstpath);
-
-	/* source must exist */
-	if (lstat(srcpath, &srcst) != 0) {
-		WARNING("%s: %s", srcpath, strerror(errno));
-		return (-1);
-	}
 
-	/*
-	 * Some SFTP clients seem to mangle file permissions so we
-	 * sometimes end up with files or directories on the
-	 * import side with weird permissions, or even none at
-	 * all.  Try to force a sane minimum set of permissions.
-	 */
-	mode = srcst.st_mode;
 	/* writeable for user, readable for group */
 	if ((mode & 0640) != 0640)
 		mode |= 0640;
 	/* directories must also be searchable */
 	if (S_ISDIR(mode) && (mode & 0110) != 0110)
 		mode |= 0110;
-	/* apply changes */
-	if (mode != srcst.st_mode) {
-		NOTICE("%s: changing permissions from %o to %o",
-		    srcpath, srcst.st_mode & 07777, mode & 07777);
-		if (chmod(srcpath, mode & 07777) != 0) {
-			ERROR("%s: %s", srcpath, strerror(errno));
-			return (-1);
+	return (mode);
+}
+
+/*
+ * Decide what to do about a file, given what we know about the source
+ * and the destination, and act on it.  A NULL dstst means that the
+ * destination does not exist.  If the information about the source
+ * came from the scanner, we double-check before making changes to it.
+ */
+static int
+tsdfx_copy_decide(const char *srcpath, const char *dstpath,
+    const struct stat *st, const struct stat *dstst, int hearsay,
+    unsigned long long group, unsigned int weight)
+{
+	struct stat srcst;
+	mode_t mode;
+
+	/* force sane permissions */
+	srcst = *st;
+	if ((mode = tsdfx_copy_fixmode(srcst.st_mode)) != srcst.st_mode) {
+		if (hearsay) {
+			if (lstat(srcpath, &srcst) != 0) {
+				WARNING("%s: %s", srcpath, strerror(errno));
+				return (-1);
+			}
+			mode = tsdfx_copy_fixmode(srcst.st_mode);
+		}
+		if (mode != srcst.st_mode) {
+			NOTICE("%s: changing permissions from %o to %o",
+			    srcpath, srcst.st_mode & 07777, mode & 07777);
+			if (chmod(srcpath, mode & 07777) != 0) {
+				ERROR("%s: %s", srcpath, strerror(errno));
+				return (-1);
+			}
+			srcst.st_mode = mode;
 		}
-		srcst.st_mode = mode;
 	}
 
 	/* check destination */
-	if (lstat(dstpath, &dstst) == 0) {
-		if ((srcst.st_mode & S_IFMT) != (dstst.st_mode & S_IFMT)) {
-			ERROR("%s and %s both exist with different types",
-			    srcpath, dstpath);
-			errno = EEXIST;
-			return (-1);
+	if (dstst == NULL) {
+		tsdfx_copy_new(srcpath, dstpath, group, weight);
+		return (TSDFX_COPY_NEW);
+	}
+	if ((srcst.st_mode & S_IFMT) != (dstst->st_mode & S_IFMT)) {
+		ERROR("%s and %s both exist with different types",
+		    srcpath, dstpath);
+		errno = EEXIST;
+		return (-1);
+	}
+	/*
+	 * Compare source and destination metadata to attempt
+	 * to avoid unnecessarily starting a copier child for
+	 * a file that's already been copied.
+	 * Remove old files and directories when they are
+	 * copied and untouched for the purge period.
+	 */
+	srcst.st_mode &= ~TSDFX_COPY_UMASK;
+	if (S_ISREG(srcst.st_mode) &&
+	    srcst.st_size == dstst->st_size &&
+	    srcst.st_mode == dstst->st_mode &&
+	    srcst.st_mtime == dstst->st_mtime) {
+		if (tsdfx_copy_purgeperiod &&
+		    srcst.st_atime + tsdfx_copy_purgeperiod <= time(0)) {
+			/*
+			 * Request removal.
+			 */
+			NOTICE("purging source file %s", srcpath);
+			tsdfx_copy_new(srcpath, NULL, group, weight);
+			return (TSDFX_COPY_PURGE);
 		}
+		return (TSDFX_COPY_INSYNC);
+	}
+	if (S_ISDIR(srcst.st_mode) &&
+	    srcst.st_mode == dstst->st_mode) {
 		/*
-		 * Compare source and destination metadata to attempt
-		 * to avoid unnecessarily starting a copier child for
-		 * a file that's already been copied.
-		 * Remove old files and directories when they are
-		 * copied and untouched for the purge period.
+		 * Remove old and empty source directories too.
 		 */
-		srcst.st_mode &= ~TSDFX_COPY_UMASK;
-		if (S_ISREG(srcst.st_mode) &&
-		    srcst.st_size == dstst.st_size &&
-		    srcst.st_mode == dstst.st_mode &&
-		    srcst.st_mtime == dstst.st_mtime) {
-			if (tsdfx_copy_purgeperiod &&
-			    srcst.st_atime + tsdfx_copy_purgeperiod <= time(0)) {
-				/*
-				 * Request removal.
-				 */
-				NOTICE("purging source file %s", srcpath);
-				tsdfx_copy_new(srcpath, NULL);
-			}
-			return (0);
-		}
-		if (S_ISDIR(srcst.st_mode) &&
-		    srcst.st_mode == dstst.st_mode) {
-			/*
-			 * Remove old and empty source directories too.
-			 */
-			if (tsdfx_copy_purgeperiod &&
-			    srcst.st_atime + tsdfx_copy_purgeperiod <= time(0)) {
-				NOTICE("purging source directory %s", srcpath);
-				tsdfx_copy_new(srcpath, NULL);
-			}
-			return (0);
+		if (tsdfx_copy_purgeperiod &&
+		    srcst.st_atime + tsdfx_copy_purgeperiod <= time(0)) {
+			NOTICE("purging source directory %s", srcpath);
+			tsdfx_copy_new(srcpath, NULL, group, weight);
+			return (TSDFX_COPY_PURGE);
 		}
-	} else {
-		memset(&dstst, 0, sizeof dstst);
+		return (TSDFX_COPY_INSYNC);
 	}
 
 	/* create task */
-	tsdfx_copy_new(srcpath, dstpath);
-	return (0);
+	tsdfx_copy_new(srcpath, dstpath, group, weight);
+	return (TSDFX_COPY_CHANGED);
 }
 
 /*
- * Monitor running tasks and start any scheduled tasks if possible.
+ * Create full source and destination paths.
  */
-int
-tsdfx_copy_sched(void)
+static int
+tsdfx_copy_paths(const char *srcdir, const char *dstdir, const char *path,
+    char *srcpath, char *dstpath)
 {
-	struct tsdfx_copy_task_data *ctd;
-	struct tsd_task *t, *tn;
 
-	t = tsd_tset_first(tsdfx_copy_tasks);
-	while (t != NULL) {
-		/* look ahead so we can safely delete dead tasks */
-		tn = tsd_tset_next(t->set, t);
-		ctd = t->ud;
-		switch (t->state) {
-		case TASK_IDLE: {
-			VERBOSE("%s -> %s (%d jobs, %d running)",
-				ctd->src, ctd->dst,
-				t->queue->ntasks, t->queue->nrunning);
-			tsd_tqueue_sched(t->queue);
-			break;
-		}
-		case TASK_RUNNING:
-			tsdfx_copy_poll(t);
-			break;
-		case TASK_FINISHED:
-			/* completed successfully */
-			tsdfx_copy_delete(t);
-			break;
-		case TASK_DEAD:
-		case TASK_FAILED:
-		case TASK_INVALID:
-			/* failed to start or died */
-			WARNING("copy task failed for %s", ctd->src);
-			tsdfx_copy_delete(t);
-			break;
-		case TASK_STOPPED:
-			/* shouldn't happen */
-			ERROR("copy task in TASK_STOPPED state");
-			tsdfx_copy_delete(t);
-			break;
-		default:
-			/* unreachable */
-			break;
-		}
-		t = tn;
+	if (snprintf(srcpath, PATH_MAX, "%s%s", srcdir, path) >= PATH_MAX ||
+	    snprintf(dstpath, PATH_MAX, "%s%s", dstdir, path) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return (-1);
 	}
-	return (tsdfx_copy_tasks->nrunning);
+	return (0);
 }
 
 /*
- * Initialize the copier subsystem
+ * Given source and destination directories and a list of files to copy,
+ * start copy tasks for each file.  If the scanner told us what the
+ * source looks like, we take its word for it, unless we have to make
+ * changes to it.  Returns what was decided, or -1 on error.
  */
 int
-tsdfx_copy_init(void)
+tsdfx_copy_wrap(const char *srcdir, const char *dstdir, const char *path,
+    const struct stat *st, unsigned int weight)
 {
-	char str[64];
-	int i;
+	char srcpath[PATH_MAX], dstpath[PATH_MAX];
+	struct stat srcst, dstst;
+	unsigned long long group;
 
-	if (tsdfx_copier == NULL &&
-	    (tsdfx_copier = getenv("TSDFX_COPIER")) == NULL &&
-	    access(tsdfx_copier = "/usr/libexec/tsdfx-copier", R_OK|X_OK) != 0 &&
-	    access(tsdfx_copier = "/usr/local/libexec/tsdfx-copier", R_OK|X_OK) != 0 &&
-	    access(tsdfx_copier = "/opt/tsd/libexec/tsdfx-copier", R_OK|X_OK) != 0) {
-		ERROR("failed to locate copier child");
+	/* check for duplicate */
+	if (tsdfx_copy_find(srcdir, dstdir, path) != NULL)
+		return (TSDFX_COPY_QUEUED);
+
+	/* create full paths and log */
+	if (tsdfx_copy_paths(srcdir, dstdir, path, srcpath, dstpath) != 0)
 		return (-1);
-	}
-	if ((tsdfx_copy_tasks = tsd_tset_create("tsdfx copier")) == NULL)
+	VERBOSE("%s -> %s", srcpath, dstpath);
+
+	/* source must exist */
+	if (st != NULL) {
+		srcst = *st;
+	} else if (lstat(srcpath, &srcst) != 0) {
+		WARNING("%s: %s", srcpath, strerror(errno));
 		return (-1);
+	}
 
-	/* create size-differentiated queues */
-	for (i = 0; i < TSDFX_COPY_NQUEUES; ++i) {
-		if (*tsdfx_queueinfo[i].max_size_str == '\0')
-			snprintf(tsdfx_queueinfo[i].max_size_str,
-			    sizeof tsdfx_queueinfo[i].max_size_str,
-			    "%zu", tsdfx_queueinfo[i].max_size);
-		snprintf(str, sizeof str, "tsdfx copier (size <= %zu)",
-		    tsdfx_queueinfo[i].max_size);
-		tsdfx_copy_queues[i] = tsd_tqueue_create(str,
-		    tsdfx_queueinfo[i].max_tasks);
-		if (tsdfx_copy_queues[i] == NULL) {
+	/* check destination */
+	group = tsdfx_copy_key(srcdir, dstdir, "");
+	if (lstat(dstpath, &dstst) != 0)
+		return (tsdfx_copy_decide(srcpath, dstpath, &srcst, NULL,
+		    st != NULL, group, weight));
+	return (tsdfx_copy_decide(srcpath, dstpath, &srcst, &dstst,
+	    st != NULL, group, weight));
+}
+
+/*
+ * Same as tsdfx_copy_wrap(), but we already know what both the source
+ * and the destination look like.  A NULL dstst means the destination
+ * does not exist.
+ */
+int
+tsdfx_copy_sync(const char *srcdir, const char *dstdir, const char *path,
+    const struct stat *srcst, const struct stat *dstst, unsigned int weight)
+{
+	char srcpath[PATH_MAX], dstpath[PATH_MAX];
+
+	/* check for duplicate */
+	if (tsdfx_copy_find(srcdir, dstdir, path) != NULL)
+		return (TSDFX_COPY_QUEUED);
+
+	/* create full paths and log */
+	if (tsdfx_copy_paths(srcdir, dstdir, path, srcpath, dstpath) != 0)
+		return (-1);
+	VERBOSE("%s -> %s", srcpath, dstpath);
+
+	return (tsdfx_copy_decide(srcpath, dstpath, srcst, dstst, 1,
+	    tsdfx_copy_key(srcdir, dstdir, ""), weight));
+}
+
+/*
+ * Batch copier child: execute the copier program in batch mode.
+ */
+static void
+tsdfx_copy_batch_child(void *ud)
+{
+	const char *argv[12];
+	int argc;
+
+	(void)ud;
+	if (geteuid() == 0 || getegid() == 0)
+		WARNING("batch copying with uid %u gid %u",
+		    (unsigned int)geteuid(), (unsigned int)getegid());
+	umask(TSDFX_COPY_UMASK);
+	argc = tsdfx_copy_argv(argv);
+	argv[argc++] = "-b";
+	argv[argc] = NULL;
+	ASSERTF((size_t)argc < sizeof argv / sizeof argv[0],
+	    "argv overflowed: %d > %z", argc, sizeof argv / sizeof argv[0]);
+	execv(tsdfx_copier, (char *const *)(uintptr_t)argv);
+	ERROR("failed to execute copier process");
+	_exit(1);
+}
+
+/*
+ * Check whether an idle task of the given kind can go into the same
+ * batch as another task, i.e. whether they have the same credentials.
+ */
+static int
+tsdfx_copy_batchable(const struct tsd_task *t, const struct tsd_task *t2,
+    tsd_task_func *func)
+{
+
+	return (t2->func == func && t2->state == TASK_IDLE &&
+	    t2->uid == t->uid && t2->ngids == t->ngids &&
+	    memcmp(t2->gids, t->gids, t->ngids * sizeof *t->gids) == 0);
+}
+
+/*
+ * Take a task off its queue and hand it to a batch copier.
+ */
+static int
+tsdfx_copy_batch_add(struct tsdfx_copy_batch *b, struct tsd_task *t)
+{
+	struct tsdfx_copy_task_data *ctd = t->ud;
+	const char *maxsize;
+	size_t len, size;
+	char *out;
+
+	/* purge workers already have the list when they start */
+	if (b->task->func != tsdfx_copy_purge_child) {
+		maxsize = ctd->maxsize != NULL ? ctd->maxsize : "0";
+		len = strlen(ctd->src) + strlen(ctd->dst) +
+		    strlen(maxsize) + 3;
+		if (b->outlen + len > b->outsize) {
+			for (size = b->outsize ? b->outsize : 4096;
+			     size < b->outlen + len; size *= 2)
+				/* nothing */ ;
+			if ((out = realloc(b->out, size)) == NULL)
+				return (-1);
+			b->out = out;
+			b->outsize = size;
+		}
+		snprintf(b->out + b->outlen, len + 1, "%s\t%s\t%s\n",
+		    ctd->src, ctd->dst, maxsize);
+		b->outlen += len;
+	}
+	if (t->queue != NULL)
+		tsd_tqueue_remove(t->queue, t);
+	ctd->batch = b;
+	ctd->bnext = NULL;
+	if (b->last != NULL)
+		b->last->bnext = ctd;
+	else
+		b->first = ctd;
+	b->last = ctd;
+	b->nfiles++;
+	b->njobs++;
+	VERBOSE("%s -> %s (%s)", ctd->src, ctd->dst, b->task->name);
+	return (0);
+}
+
+/*
+ * Write as many pending records as the copier will take, and let it
+ * know when there won't be any more.
+ */
+static int
+tsdfx_copy_batch_flush(struct tsdfx_copy_batch *b)
+{
+	struct tsd_task *t = b->task;
+	ssize_t wlen;
+
+	if (t->pin < 0)
+		return (0);
+	if (b->outlen > 0) {
+		if ((wlen = write(t->pin, b->out, b->outlen)) < 0)
+			return (errno == EAGAIN ? 0 : -1);
+		memmove(b->out, b->out + wlen, b->outlen - wlen);
+		b->outlen -= wlen;
+	}
+	if (b->outlen == 0 && b->eof) {
+		close(t->pin);
+		t->pin = -1;
+	}
+	return (0);
+}
+
+/*
+ * Hand a batch copier or purge worker the next task in a queue and as
+ * many other tasks of the same kind from the same flow with the same
+ * credentials as we can find nearby, up to a maximum.
+ */
+static void
+tsdfx_copy_batch_fill(struct tsdfx_copy_batch *b, struct tsd_tqueue *tq,
+    tsd_task_func *func, unsigned int max)
+{
+	struct tsd_task *t, *tn;
+	unsigned int nscan;
+
+	t = tsd_tqueue_next(tq);
+	for (nscan = 0; t != NULL && nscan <= max * 4 && b->nfiles < max;
+	     t = tn, ++nscan) {
+		tn = t->fnext;
+		if (tsdfx_copy_batchable(b->task, t, func) &&
+		    tsdfx_copy_batch_add(b, t) != 0)
+			break;
+	}
+}
+
+/*
+ * The number of files to hand a batch copier at a time.
+ */
+static unsigned int
+tsdfx_copy_batch_max(void)
+{
+
+	return (tsdfx_copy_batch_size > 1 ? tsdfx_copy_batch_size : 1);
+}
+
+/*
+ * Hash a queue and a set of credentials.  Idle copiers are kept in the
+ * pool under the hash of their queue and credentials, and looked up
+ * under that of their queue and a task's credentials.
+ */
+static uint64_t
+tsdfx_copy_pool_hash(const struct tsd_tqueue *tq, const struct tsd_task *t)
+{
+	uint64_t h;
+	int i;
+
+	h = (uint64_t)(uintptr_t)tq;
+	h = h * 0x100000001b3ULL + t->uid;
+	for (i = 0; i < t->ngids; ++i)
+		h = h * 0x100000001b3ULL + t->gids[i];
+	return (tsd_strhash64_final(h));
+}
+
+/*
+ * Take a copier out of the pool.
+ */
+static void
+tsdfx_copy_pool_unlink(struct tsdfx_copy_batch *b)
+{
+	struct tsdfx_copy_queueinfo *qi = b->qi;
+
+	if (b->pprev != NULL)
+		b->pprev->pnext = b->pnext;
+	else
+		qi->pool = b->pnext;
+	if (b->pnext != NULL)
+		b->pnext->pprev = b->pprev;
+	else
+		qi->pool_last = b->pprev;
+	if (b->hprev != NULL)
+		b->hprev->hnext = b->hnext;
+	else
+		tsdfx_copy_pool[b->h % TSDFX_COPY_POOLHASH] = b->hnext;
+	if (b->hnext != NULL)
+		b->hnext->hprev = b->hprev;
+	b->pprev = b->pnext = b->hprev = b->hnext = NULL;
+	b->idle = 0;
+	qi->npool--;
+	tsdfx_copy_npool--;
+}
+
+/*
+ * Return the copier which has been idle the longest, if any.
+ */
+static struct tsdfx_copy_batch *
+tsdfx_copy_pool_oldest(void)
+{
+	struct tsdfx_copy_batch *b, *oldest;
+	unsigned int i;
+
+	oldest = NULL;
+	for (i = 0; i < tsdfx_copy_nqueues; ++i)
+		if ((b = tsdfx_queueinfo[i].pool) != NULL &&
+		    (oldest == NULL || b->idle < oldest->idle))
+			oldest = b;
+	return (oldest);
+}
+
+/*
+ * Tell a copier there won't be any more files.  It will exit once it
+ * is done with the ones it has, and give up its slot.
+ */
+static void
+tsdfx_copy_pool_retire(struct tsdfx_copy_batch *b)
+{
+
+	if (b->idle != 0)
+		tsdfx_copy_pool_unlink(b);
+	if (!b->retiring && b->qi != NULL) {
+		b->retiring = 1;
+		b->qi->nretiring++;
+		tsdfx_copy_nretiring++;
+	}
+	VERBOSE("%s: retiring after %u files", b->task->name, b->njobs);
+	b->eof = 1;
+	tsdfx_copy_batch_flush(b);
+}
+
+/*
+ * Put a copier which has run out of work in the pool, or retire it if
+ * it has done enough.  It stays in its queue either way.
+ */
+static void
+tsdfx_copy_pool_put(struct tsdfx_copy_batch *b)
+{
+	struct tsdfx_copy_queueinfo *qi = b->qi;
+	struct tsdfx_copy_batch **head;
+
+	if (b->njobs >= tsdfx_copy_maxjobs) {
+		tsdfx_copy_pool_retire(b);
+		return;
+	}
+	b->idle = time(NULL);
+	if ((b->pprev = qi->pool_last) != NULL)
+		b->pprev->pnext = b;
+	else
+		qi->pool = b;
+	qi->pool_last = b;
+	head = &tsdfx_copy_pool[b->h % TSDFX_COPY_POOLHASH];
+	if ((b->hnext = *head) != NULL)
+		b->hnext->hprev = b;
+	*head = b;
+	qi->npool++;
+	tsdfx_copy_npool++;
+}
+
+/*
+ * Find the idle copier which most recently ran out of work among those
+ * in the given queue with the same credentials as the given task.
+ */
+static struct tsdfx_copy_batch *
+tsdfx_copy_pool_find(const struct tsd_tqueue *tq, const struct tsd_task *t)
+{
+	struct tsdfx_copy_batch *b;
+	uint64_t h;
+
+	h = tsdfx_copy_pool_hash(tq, t);
+	for (b = tsdfx_copy_pool[h % TSDFX_COPY_POOLHASH]; b != NULL;
+	     b = b->hnext)
+		if (b->h == h && b->tq == tq &&
+		    tsdfx_copy_batchable(b->task, t, tsdfx_copy_child))
+			return (b);
+	return (NULL);
+}
+
+/*
+ * Put an idle copier back to work on the next task in its queue.
+ */
+static int
+tsdfx_copy_pool_get(struct tsdfx_copy_batch *b)
+{
+
+	tsdfx_copy_pool_unlink(b);
+	tsdfx_copy_batch_fill(b, b->tq, tsdfx_copy_child,
+	    tsdfx_copy_batch_max());
+	VERBOSE("%s: reused for %u files", b->task->name, b->nfiles);
+	tsdfx_copy_batch_flush(b);
+	return (0);
+}
+
+/*
+ * Start the next idle task in a queue as a single copier, and wake up
+ * the main loop when it exits.
+ */
+static int
+tsdfx_copy_qstart(struct tsd_tqueue *tq)
+{
+	struct tsd_task *t;
+
+	t = tsd_tqueue_next(tq);
+	if (tsd_tqueue_start(tq) != 0)
+		return (-1);
+	if (tsdfx_listen_task(t) != 0)
+		WARNING("%s: %s", t->name, strerror(errno));
+	return (0);
+}
+
+/*
+ * Start a batch copier for the next task in a queue and as many other
+ * tasks with the same credentials as we can find nearby, or a single
+ * copier if there are none.  With a keepalive, we always start a batch
+ * copier, since it may be reused later.
+ */
+static int
+tsdfx_copy_batch_start(struct tsdfx_copy_queueinfo *qi, struct tsd_tqueue *tq)
+{
+	struct tsdfx_copy_batch *b;
+	struct tsd_task *t, *ft;
+	char name[64];
+	unsigned int limit, nscan;
+	int serrno;
+
+	ft = tsd_tqueue_next(tq);
+	if (tsdfx_copy_keepalive == 0) {
+		/* don't look too far */
+		limit = tsdfx_copy_batch_size * 4;
+		for (t = ft->fnext, nscan = 0; t != NULL && nscan < limit;
+		     t = t->fnext, ++nscan)
+			if (tsdfx_copy_batchable(ft, t, tsdfx_copy_child))
+				break;
+		if (t == NULL || nscan == limit)
+			return (tsdfx_copy_qstart(tq));
+	}
+
+	/* start the copier */
+	if ((b = calloc(1, sizeof *b)) == NULL)
+		goto fail;
+	snprintf(name, sizeof name, "tsdfx copier batch %u",
+	    ++tsdfx_copy_batchno);
+	if ((b->task = tsd_task_create(name, tsdfx_copy_batch_child,
+	    b)) == NULL)
+		goto fail;
+	b->task->flags = TASK_STDIN_PIPE | TASK_STDOUT_PIPE;
+	if (tsd_task_setcred(b->task, ft->uid, ft->gids, ft->ngids) != 0)
+		goto fail;
+	strlcpy(b->task->user, ft->user, sizeof b->task->user);
+	if (tsd_task_start(b->task) != 0 ||
+	    tsd_tqueue_insert(tq, b->task) != 0 ||
+	    fcntl(b->task->pin, F_SETFL, O_NONBLOCK) != 0 ||
+	    fcntl(b->task->pout, F_SETFL, O_NONBLOCK) != 0 ||
+	    tsdfx_listen(b->task->pout) != 0 ||
+	    tsdfx_listen_task(b->task) != 0)
+		goto fail;
+	b->tq = tq;
+	b->qi = qi;
+	b->h = tsdfx_copy_pool_hash(tq, b->task);
+
+	/* hand it the first task and others like it */
+	tsdfx_copy_batch_fill(b, tq, tsdfx_copy_child,
+	    tsdfx_copy_batch_max());
+	b->eof = (tsdfx_copy_keepalive == 0);
+	if ((b->next = tsdfx_copy_batches) != NULL)
+		b->next->prev = b;
+	tsdfx_copy_batches = b;
+	tsdfx_copy_nbatches++;
+	VERBOSE("%s: %u files as %s", name, b->nfiles, b->task->user);
+	tsdfx_copy_batch_flush(b);
+	return (0);
+fail:
+	serrno = errno;
+	WARNING("failed to start batch copier: %s", strerror(serrno));
+	if (b != NULL) {
+		if (b->task != NULL) {
+			tsdfx_unlisten(b->task->pout);
+			tsd_task_destroy(b->task);
+		}
+		free(b);
+	}
+	return (tsdfx_copy_qstart(tq));
+}
+
+/*
+ * Compare directory paths by decreasing length, so that subdirectories
+ * come before their parents.
+ */
+static int
+tsdfx_copy_purge_cmp(const void *a, const void *b)
+{
+	size_t alen = strlen(*(const char * const *)a);
+	size_t blen = strlen(*(const char * const *)b);
+
+	return (alen > blen ? -1 : alen < blen ? 1 : 0);
+}
+
+/*
+ * Remove a file or, if its name ends in a slash, a directory, relative
+ * to a descriptor for its parent directory, which is reopened only if
+ * it differs from the previous one.  Returns 0 or an errno value.
+ */
+static int
+tsdfx_copy_purge_one(const char *path, int *dd, char *dir)
+{
+	char buf[PATH_MAX], *name;
+	size_t len;
+	int flags;
+
+	len = strlcpy(buf, path, sizeof buf);
+	flags = 0;
+	while (len > 1 && buf[len - 1] == '/') {
+		buf[--len] = '\0';
+		flags = AT_REMOVEDIR;
+	}
+	if ((name = strrchr(buf, '/')) == NULL || name == buf)
+		return (EINVAL);
+	*name++ = '\0';
+	if (*dd < 0 || strcmp(buf, dir) != 0) {
+		if (*dd >= 0)
+			close(*dd);
+		*dd = open(buf, O_RDONLY | O_DIRECTORY);
+		strlcpy(dir, buf, PATH_MAX);
+	}
+	if (*dd < 0 || unlinkat(*dd, name, flags) != 0)
+		return (errno);
+	return (0);
+}
+
+/*
+ * Purge worker child: remove each file in the batch, which we inherited
+ * from our parent, and report on each on stdout the way a batch copier
+ * does.  Files go first, then directories, deepest first, so that the
+ * latter are empty by the time we get to them.
+ */
+static void
+tsdfx_copy_purge_child(void *ud)
+{
+	struct tsdfx_copy_batch *b = ud;
+	struct tsdfx_copy_task_data *ctd;
+	const char **dirs;
+	char dir[PATH_MAX];
+	unsigned int i, ndirs;
+	size_t len;
+	int dd;
+
+	(void)setpriority(PRIO_PROCESS, 0, 10);
+	if ((dirs = calloc(b->nfiles, sizeof *dirs)) == NULL)
+		_exit(1);
+	ndirs = 0;
+	dd = -1;
+	for (ctd = b->first; ctd != NULL; ctd = ctd->bnext) {
+		len = strlen(ctd->src);
+		if (len > 0 && ctd->src[len - 1] == '/')
+			dirs[ndirs++] = ctd->src;
+		else
+			printf("%d\t%s\n",
+			    tsdfx_copy_purge_one(ctd->src, &dd, dir), ctd->src);
+	}
+	qsort(dirs, ndirs, sizeof *dirs, tsdfx_copy_purge_cmp);
+	for (i = 0; i < ndirs; ++i)
+		printf("%d\t%s\n", tsdfx_copy_purge_one(dirs[i], &dd, dir),
+		    dirs[i]);
+	_exit(fflush(stdout) == 0 ? 0 : 1);
+}
+
+/*
+ * Start a purge worker for the next task in the purge queue and others
+ * with the same owner, or purge that one task on its own if we fail.
+ */
+static int
+tsdfx_copy_purge_start(struct tsd_tqueue *tq)
+{
+	struct tsdfx_copy_batch *b;
+	struct tsdfx_copy_task_data *ctd;
+	struct tsd_task *ft;
+	char name[64];
+	int serrno;
+
+	ft = tsd_tqueue_next(tq);
+	if ((b = calloc(1, sizeof *b)) == NULL)
+		goto fail;
+	snprintf(name, sizeof name, "tsdfx purger batch %u",
+	    ++tsdfx_copy_batchno);
+	if ((b->task = tsd_task_create(name, tsdfx_copy_purge_child,
+	    b)) == NULL)
+		goto fail;
+	b->task->flags = TASK_STDOUT_PIPE;
+	if (tsd_task_setcred(b->task, ft->uid, ft->gids, ft->ngids) != 0)
+		goto fail;
+	strlcpy(b->task->user, ft->user, sizeof b->task->user);
+	b->tq = tq;
+	b->eof = 1;
+
+	/* the worker must have its list before it starts */
+	tsdfx_copy_batch_fill(b, tq, tsdfx_copy_purgesource_child,
+	    TSDFX_COPY_PURGE_BATCH);
+	if (tsd_task_start(b->task) != 0 ||
+	    tsd_tqueue_insert(tq, b->task) != 0 ||
+	    fcntl(b->task->pout, F_SETFL, O_NONBLOCK) != 0 ||
+	    tsdfx_listen(b->task->pout) != 0 ||
+	    tsdfx_listen_task(b->task) != 0)
+		goto fail;
+	if ((b->next = tsdfx_copy_batches) != NULL)
+		b->next->prev = b;
+	tsdfx_copy_batches = b;
+	tsdfx_copy_nbatches++;
+	VERBOSE("%s: %u files as %s", name, b->nfiles, b->task->user);
+	return (0);
+fail:
+	serrno = errno;
+	WARNING("failed to start purge worker: %s", strerror(serrno));
+	if (b != NULL) {
+		/* put back whatever we took */
+		while ((ctd = b->first) != NULL) {
+			b->first = ctd->bnext;
+			ctd->batch = NULL;
+			ctd->bnext = NULL;
+			if (tsdfx_copy_enqueue(ctd->task) != 0)
+				tsdfx_copy_delete(ctd->task);
+		}
+		if (b->task != NULL) {
+			tsdfx_unlisten(b->task->pout);
+			tsd_task_destroy(b->task);
+		}
+		free(b);
+	}
+	return (tsdfx_copy_qstart(tq));
+}
+
+/*
+ * Delete a batch copier.  Tasks still assigned to it are left alone.
+ */
+static void
+tsdfx_copy_batch_delete(struct tsdfx_copy_batch *b)
+{
+	struct tsdfx_copy_task_data *ctd;
+
+	for (ctd = b->first; ctd != NULL; ctd = ctd->bnext)
+		ctd->batch = NULL;
+	if (b->idle != 0)
+		tsdfx_copy_pool_unlink(b);
+	if (b->retiring) {
+		b->qi->nretiring--;
+		tsdfx_copy_nretiring--;
+	}
+	if (b->prev != NULL)
+		b->prev->next = b->next;
+	else
+		tsdfx_copy_batches = b->next;
+	if (b->next != NULL)
+		b->next->prev = b->prev;
+	tsdfx_copy_nbatches--;
+	tsdfx_unlisten(b->task->pout);
+	tsd_task_destroy(b->task);
+	free(b->out);
+	free(b);
+}
+
+/*
+ * Process a result reported by a batch copier or purge worker.  A
+ * copier reports on the files in the order in which it was given them,
+ * so we usually find the file at the head of the list, but a purge
+ * worker leaves directories until last.
+ */
+static void
+tsdfx_copy_batch_result(struct tsdfx_copy_batch *b, const char *line)
+{
+	struct tsdfx_copy_task_data *ctd, *prev;
+	char *end;
+	long status;
+
+	status = strtol(line, &end, 10);
+	prev = NULL;
+	ctd = b->first;
+	if (end != line && *end == '\t')
+		while (ctd != NULL && strcmp(end + 1, ctd->src) != 0)
+			prev = ctd, ctd = ctd->bnext;
+	if (ctd == NULL || end == line || *end != '\t') {
+		WARNING("unexpected output from %s: %s", b->task->name, line);
+		return;
+	}
+	if (prev != NULL)
+		prev->bnext = ctd->bnext;
+	else
+		b->first = ctd->bnext;
+	if (b->last == ctd)
+		b->last = prev;
+	b->nfiles--;
+	ctd->batch = NULL;
+	ctd->bnext = NULL;
+	if (b->task->func == tsdfx_copy_purge_child) {
+		if (status != 0)
+			WARNING("failed to purge %s: %s", ctd->src,
+			    strerror((int)status));
+		else
+			VERBOSE("purged %s", ctd->src);
+		tsdfx_copy_delete(ctd->task);
+		return;
+	}
+	if (status == EFBIG && tsdfx_copy_requeue(ctd->task) == 0)
+		return;
+	if (status != 0)
+		WARNING("copy task failed for %s: %s", ctd->src,
+		    strerror((int)status));
+	tsdfx_copy_delete(ctd->task);
+}
+
+/*
+ * Feed a batch copier and collect its results.
+ */
+static void
+tsdfx_copy_batch_poll(struct tsdfx_copy_batch *b)
+{
+	struct tsdfx_copy_task_data *ctd;
+	struct tsd_task *t = b->task;
+	char *p, *eol;
+	ssize_t rlen;
+
+	if (tsdfx_copy_batch_flush(b) != 0) {
+		/* it won't be reading any more */
+		b->outlen = 0;
+		b->eof = 1;
+		tsdfx_copy_batch_flush(b);
+	}
+	while (!b->done) {
+		rlen = read(t->pout, b->in + b->inlen,
+		    sizeof b->in - 1 - b->inlen);
+		if (rlen < 0 && errno == EINTR)
+			continue;
+		if (rlen < 0 && errno == EAGAIN)
+			break;
+		if (rlen <= 0) {
+			/* it won't be reporting any more */
+			tsdfx_unlisten(t->pout);
+			b->done = 1;
+			break;
+		}
+		b->inlen += rlen;
+		b->in[b->inlen] = '\0';
+		p = b->in;
+		while ((eol = memchr(p, '\n', b->in + b->inlen - p)) != NULL) {
+			*eol = '\0';
+			tsdfx_copy_batch_result(b, p);
+			p = eol + 1;
+		}
+		b->inlen -= p - b->in;
+		memmove(b->in, p, b->inlen);
+		if (b->inlen == sizeof b->in - 1) {
+			WARNING("overlong output from %s", t->name);
+			b->inlen = 0;
+		}
+	}
+	if (!b->done) {
+		/* keep it around if it has run out of work */
+		if (b->nfiles == 0 && !b->eof && b->idle == 0)
+			tsdfx_copy_pool_put(b);
+		return;
+	}
+
+	/*
+	 * Wait for it to exit, insisting if it takes too long, then fail
+	 * whatever it didn't get to.
+	 */
+	if (t->state == TASK_RUNNING)
+		tsd_task_terminate(t);
+	else if (t->state == TASK_STOPPING)
+		tsd_task_poll(t);
+	if (t->state == TASK_STOPPING)
+		return;
+	while ((ctd = b->first) != NULL) {
+		b->first = ctd->bnext;
+		ctd->batch = NULL;
+		WARNING("copy task failed for %s", ctd->src);
+		tsdfx_copy_delete(ctd->task);
+	}
+	b->last = NULL;
+	b->nfiles = 0;
+	tsdfx_copy_batch_delete(b);
+}
+
+/*
+ * Start the next task in a queue, in a batch if possible, preferably
+ * by reusing an idle copier with the same credentials.  If there is
+ * none and the queue or, if full is set, all queues together already
+ * have as many copiers as they may, retire an idle one to make room,
+ * unless one is already on its way out.
+ */
+static int
+tsdfx_copy_start(struct tsdfx_copy_queueinfo *qi, struct tsd_tqueue *tq,
+    int full)
+{
+	struct tsdfx_copy_batch *b;
+	struct tsd_task *t;
+
+	if ((t = tsd_tqueue_next(tq)) == NULL || t->func != tsdfx_copy_child ||
+	    t->state != TASK_IDLE)
+		return (tsdfx_copy_qstart(tq));
+	if (tsdfx_copy_keepalive == 0) {
+		if (tsdfx_copy_batch_size > 1 && tq->nrunning < tq->max_running)
+			return (tsdfx_copy_batch_start(qi, tq));
+		return (tsdfx_copy_qstart(tq));
+	}
+	if ((b = tsdfx_copy_pool_find(tq, t)) != NULL)
+		return (tsdfx_copy_pool_get(b));
+	if (tq->nrunning >= tq->max_running) {
+		if (qi->nretiring == 0 && qi->pool != NULL)
+			tsdfx_copy_pool_retire(qi->pool);
+	} else if (full) {
+		if (tsdfx_copy_nretiring == 0 &&
+		    (b = tsdfx_copy_pool_oldest()) != NULL)
+			tsdfx_copy_pool_retire(b);
+	} else {
+		return (tsdfx_copy_batch_start(qi, tq));
+	}
+	errno = EAGAIN;
+	return (-1);
+}
+
+/*
+ * Start idle tasks while we have free slots.  Each time, we pick the
+ * class with the lowest pass among those which have idle tasks and
+ * free slots of their own, or idle copiers which could take them, and
+ * advance its pass in inverse proportion to its weight (stride
+ * scheduling).  A class which had nothing to do is not allowed to bank
+ * credit for when it has.  The pass of a class whose oldest idle task
+ * has waited for a long time is discounted according to how long.
+ * Idle copiers count against the limit on the total number of copiers,
+ * but don't stop us from handing them work.
+ */
+static void
+tsdfx_copy_dispatch(void)
+{
+	struct tsdfx_copy_task_data *ctd;
+	struct tsdfx_copy_queueinfo *qi, *best;
+	struct tsd_tqueue *tq;
+	unsigned long long eff, besteff, age;
+	unsigned int i, nrunning, skip;
+	time_t now;
+
+	now = time(NULL);
+	besteff = 0;
+	skip = 0;
+	for (;;) {
+		nrunning = 0;
+		for (i = 0; i < tsdfx_copy_nqueues; ++i)
+			nrunning += tsdfx_copy_queues[i]->nrunning;
+		if (tsdfx_copy_max_tasks > 0 &&
+		    nrunning - tsdfx_copy_npool >= tsdfx_copy_max_tasks)
+			break;
+		best = NULL;
+		tq = NULL;
+		for (i = 0; i < tsdfx_copy_nqueues; ++i) {
+			qi = &tsdfx_queueinfo[i];
+			if (tsdfx_copy_queues[i]->first == NULL ||
+			    (skip & (1U << i)) ||
+			    (tsdfx_copy_queues[i]->nrunning >=
+			    tsdfx_copy_queues[i]->max_running &&
+			    qi->npool == 0))
+				continue;
+			if (qi->pass < tsdfx_copy_pass)
+				qi->pass = tsdfx_copy_pass;
+			ctd = tsdfx_copy_queues[i]->first->ud;
+			age = now > ctd->queued ?
+			    (unsigned long long)(now - ctd->queued) : 0;
+			age = age / TSDFX_COPY_AGING * TSDFX_COPY_STRIDE;
+			eff = age < qi->pass ? qi->pass - age : 0;
+			if (best == NULL || eff < besteff) {
+				best = qi;
+				besteff = eff;
+				tq = tsdfx_copy_queues[i];
+			}
+		}
+		if (best == NULL)
+			break;
+		VERBOSE("%s: %u jobs, %u idle, %u running", tq->name,
+		    tq->ntasks, tq->nidle, tq->nrunning);
+		tsdfx_copy_pass = best->pass;
+		best->pass += TSDFX_COPY_STRIDE / best->weight;
+		/* if it has to wait, let the others have a go */
+		if (tsdfx_copy_start(best, tq, tsdfx_copy_max_tasks > 0 &&
+		    nrunning >= tsdfx_copy_max_tasks) != 0 && errno == EAGAIN)
+			skip |= 1U << (best - tsdfx_queueinfo);
+	}
+
+	/* purges are not urgent and must not hog the disks */
+	tq = tsdfx_copy_purgeq;
+	if (tq->first != NULL && tq->nrunning < tq->max_running &&
+	    now >= tsdfx_copy_purge_due) {
+		tsdfx_copy_purge_due = now + TSDFX_COPY_PURGE_INTERVAL;
+		tsdfx_copy_purge_start(tq);
+	}
+}
+
+/*
+ * Monitor running tasks and start any scheduled tasks if possible.
+ * Only started tasks are visited; idle tasks are left to the queues,
+ * which start as many of them as they have free slots for.
+ */
+int
+tsdfx_copy_sched(void)
+{
+	struct tsdfx_copy_task_data *ctd;
+	struct tsdfx_copy_batch *b, *bn;
+	struct tsd_task *t, *tn;
+	struct tsd_tqueue *tq;
+	time_t now;
+	int i;
+
+	/* retire copiers which have been idle for too long */
+	now = time(NULL);
+	while ((b = tsdfx_copy_pool_oldest()) != NULL &&
+	    b->idle + tsdfx_copy_keepalive <= now)
+		tsdfx_copy_pool_retire(b);
+
+	/* batch copiers, whether busy, idle or retiring */
+	for (b = tsdfx_copy_batches; b != NULL; b = bn) {
+		bn = b->next;
+		tsdfx_copy_batch_poll(b);
+	}
+
+	for (i = 0; i <= (int)tsdfx_copy_nqueues; ++i) {
+		tq = i < (int)tsdfx_copy_nqueues ?
+		    tsdfx_copy_queues[i] : tsdfx_copy_purgeq;
+		for (t = tq->rfirst; t != NULL; t = tn) {
+			/* look ahead so we can safely delete dead tasks */
+			tn = t->qnext;
+			if (t->func == tsdfx_copy_batch_child ||
+			    t->func == tsdfx_copy_purge_child)
+				continue;
+			ctd = t->ud;
+			if (t->state == TASK_RUNNING ||
+			    t->state == TASK_STOPPING)
+				tsdfx_copy_poll(t);
+			switch (t->state) {
+			case TASK_RUNNING:
+			case TASK_STOPPING:
+				break;
+			case TASK_STOPPED:
+			case TASK_FINISHED:
+				/* completed successfully */
+				tsdfx_copy_delete(t);
+				break;
+			case TASK_FAILED:
+				/* outgrew its size class? */
+				if (WIFEXITED(t->status) &&
+				    WEXITSTATUS(t->status) == 2 &&
+				    tsdfx_copy_requeue(t) == 0)
+					break;
+				/* fall through */
+			case TASK_DEAD:
+			case TASK_INVALID:
+				/* failed to start or died */
+				WARNING("copy task failed for %s", ctd->src);
+				tsdfx_copy_delete(t);
+				break;
+			default:
+				/* unreachable */
+				break;
+			}
+		}
+	}
+
+	/*
+	 * Release tasks whose parent directory is now in place, unless
+	 * it has been queued for copying again in the meantime.
+	 */
+	while ((ctd = tsdfx_copy_released) != NULL) {
+		tsdfx_copy_unhold(ctd);
+		if ((t = tsdfx_copy_parent(ctd)) != NULL) {
+			tsdfx_copy_hold(ctd, t->ud);
+			continue;
+		}
+		ctd->held = 0;
+		tsdfx_copy_nheld--;
+		if (tsdfx_copy_enqueue(ctd->task) != 0) {
+			WARNING("failed to queue %s: %s", ctd->src,
+			    strerror(errno));
+			tsdfx_copy_delete(ctd->task);
+		}
+	}
+
+	tsdfx_copy_dispatch();
+	return (tsdfx_copy_tasks->nrunning + tsdfx_copy_nbatches -
+	    tsdfx_copy_npool + tsdfx_copy_purgeq->nidle);
+}
+
+/*
+ * Return the time at which the next idle copier is due to be retired
+ * or the next purge worker is due to start, or 0 if neither.
+ */
+time_t
+tsdfx_copy_next(void)
+{
+	struct tsd_tqueue *tq = tsdfx_copy_purgeq;
+	struct tsdfx_copy_batch *b;
+	time_t due;
+
+	due = 0;
+	if ((b = tsdfx_copy_pool_oldest()) != NULL)
+		due = b->idle + tsdfx_copy_keepalive;
+	if (tq->first != NULL && tq->nrunning < tq->max_running &&
+	    (due == 0 || tsdfx_copy_purge_due < due))
+		due = tsdfx_copy_purge_due > 0 ? tsdfx_copy_purge_due : 1;
+	return (due);
+}
+
+/*
+ * Return the earliest time, in milliseconds on the monotonic clock, at
+ * which a copier which has hung up but not yet exited is due to be
+ * prodded again, or 0 if there is none.
+ */
+long long
+tsdfx_copy_stopat(void)
+{
+	struct tsdfx_copy_batch *b;
+	long long due;
+
+	due = 0;
+	for (b = tsdfx_copy_batches; b != NULL; b = b->next)
+		if (b->task->state == TASK_STOPPING &&
+		    (due == 0 || b->task->stopat < due))
+			due = b->task->stopat;
+	return (due);
+}
+
+/*
+ * Parse a size with an optional binary suffix.
+ */
+static int
+tsdfx_copy_parse_size(const char *str, char **end, size_t *size)
+{
+	unsigned long long num;
+	unsigned int shift;
+
+	errno = 0;
+	num = strtoull(str, end, 10);
+	if (*end == str || errno != 0)
+		return (-1);
+	switch (**end) {
+	case 'k': case 'K': shift = 10; break;
+	case 'm': case 'M': shift = 20; break;
+	case 'g': case 'G': shift = 30; break;
+	case 't': case 'T': shift = 40; break;
+	default: shift = 0; break;
+	}
+	if (shift > 0)
+		++*end;
+	if (num > SIZE_MAX >> shift)
+		return (-1);
+	*size = (size_t)num << shift;
+	return (0);
+}
+
+/*
+ * Parse the size class specification.
+ */
+static int
+tsdfx_copy_parse_classes(const char *spec)
+{
+	struct tsdfx_copy_queueinfo *qi;
+	const char *p;
+	char *end;
+	unsigned long num;
+	unsigned int n;
+
+	memset(tsdfx_queueinfo, 0, sizeof tsdfx_queueinfo);
+	for (n = 0, p = spec; ; ++n, p = end + 1) {
+		if (n == TSDFX_COPY_MAXQUEUES) {
+			ERROR("too many size classes (max %d)",
+			    TSDFX_COPY_MAXQUEUES);
+			return (-1);
+		}
+		qi = &tsdfx_queueinfo[n];
+		if (*p == ':') {
+			qi->max_size = SIZE_MAX;
+			end = strchr(p, ':');
+		} else if (tsdfx_copy_parse_size(p, &end, &qi->max_size) != 0 ||
+		    *end != ':') {
+			goto invalid;
+		}
+		num = strtoul(end + 1, &end, 10);
+		if (num == 0 || num > UINT_MAX)
+			goto invalid;
+		qi->max_tasks = qi->weight = num;
+		if (*end == ':') {
+			num = strtoul(end + 1, &end, 10);
+			if (num == 0 || num > TSDFX_COPY_STRIDE)
+				goto invalid;
+			qi->weight = num;
+		}
+		if (n > 0 && qi->max_size <= qi[-1].max_size)
+			goto invalid;
+		if (*end != ',')
+			break;
+	}
+	if (*end != '\0' || qi->max_size != SIZE_MAX)
+		goto invalid;
+	tsdfx_copy_nqueues = n + 1;
+	return (0);
+invalid:
+	ERROR("invalid size class specification: %s", spec);
+	return (-1);
+}
+
+/*
+ * Initialize the copier subsystem
+ */
+int
+tsdfx_copy_init(void)
+{
+	struct tsdfx_copy_queueinfo *qi;
+	char str[64];
+	unsigned int i;
+
+	if (tsdfx_copier == NULL &&
+	    (tsdfx_copier = getenv("TSDFX_COPIER")) == NULL &&
+	    access(tsdfx_copier = "/usr/libexec/tsdfx-copier", R_OK|X_OK) != 0 &&
+	    access(tsdfx_copier = "/usr/local/libexec/tsdfx-copier", R_OK|X_OK) != 0 &&
+	    access(tsdfx_copier = "/opt/tsd/libexec/tsdfx-copier", R_OK|X_OK) != 0) {
+		ERROR("failed to locate copier child");
+		return (-1);
+	}
+	if (tsdfx_copy_classes == NULL)
+		tsdfx_copy_classes = TSDFX_COPY_CLASSES;
+	if (tsdfx_copy_parse_classes(tsdfx_copy_classes) != 0)
+		return (-1);
+	if (tsdfx_copy_maxjobs == 0)
+		tsdfx_copy_maxjobs = TSDFX_COPY_MAXJOBS;
+	if ((tsdfx_copy_tasks = tsd_tset_create("tsdfx copier")) == NULL)
+		return (-1);
+	if ((tsdfx_copy_purgeq = tsd_tqueue_create("tsdfx purger", 1)) == NULL) {
+		tsd_tset_destroy(tsdfx_copy_tasks);
+		tsdfx_copy_tasks = NULL;
+		return (-1);
+	}
+
+	/* create size-differentiated queues */
+	for (i = 0; i < tsdfx_copy_nqueues; ++i) {
+		qi = &tsdfx_queueinfo[i];
+		snprintf(qi->max_size_str, sizeof qi->max_size_str,
+		    "%zu", qi->max_size);
+		snprintf(str, sizeof str, "tsdfx copier (size <= %zu)",
+		    qi->max_size);
+		VERBOSE("%s: %u slots, weight %u", str, qi->max_tasks,
+		    qi->weight);
+		tsdfx_copy_queues[i] = tsd_tqueue_create(str, qi->max_tasks);
+		if (tsdfx_copy_queues[i] == NULL) {
 			while (i--) {
 				tsd_tqueue_destroy(tsdfx_copy_queues[i]);
 				tsdfx_copy_queues[i] = NULL;
 			}
+			tsd_tqueue_destroy(tsdfx_copy_purgeq);
+			tsdfx_copy_purgeq = NULL;
 			tsd_tset_destroy(tsdfx_copy_tasks);
 			tsdfx_copy_tasks = NULL;
 			return (-1);
@@ -580,13 +1950,21 @@ tsdfx_copy_exit(void)
 	struct tsd_task *t;
 	int i;
 
+	/* stop batch copiers */
+	while (tsdfx_copy_batches != NULL)
+		tsdfx_copy_batch_delete(tsdfx_copy_batches);
+
 	/* destroy queues, which also stops all tasks */
-	for (i = 0; i < TSDFX_COPY_NQUEUES; ++i) {
+	for (i = 0; i < TSDFX_COPY_MAXQUEUES; ++i) {
 		if (tsdfx_copy_queues[i] != NULL) {
 			tsd_tqueue_destroy(tsdfx_copy_queues[i]);
 			tsdfx_copy_queues[i] = NULL;
 		}
 	}
+	if (tsdfx_copy_purgeq != NULL) {
+		tsd_tqueue_destroy(tsdfx_copy_purgeq);
+		tsdfx_copy_purgeq = NULL;
+	}
 	/* destroy tasks and task set */
 	if (tsdfx_copy_tasks != NULL) {
 		while ((t = tsd_tset_first(tsdfx_copy_tasks)) != NULL)
@@ -44,8 +44,10 @@
 #endif
 
 #include "tsd/pidfile.h"
+#include "tsdfx/scanrec.h"
 
 #include "tsdfx.h"
+#include "tsdfx_watch.h"
 
 #ifndef PIDFILENAME
 #define PIDFILENAME "/var/run/tsdfx.pid"
@@ -59,8 +61,8 @@ static void
 usage(void)
 {
 
-	fprintf(stderr, "usage: tsdfx [-1nv] "
-	    "[-l logname] [-C copier] [-d purgetime ] [-M maxfiles] [-p pidfile] [-S scanner] -m mapfile\n");
+	fprintf(stderr, "usage: tsdfx [-1bDnPv] "
+	    "[-l logname] [-B batchsize] [-C copier] [-c classes] [-d purgetime ] [-j threads] [-k keepalive] [-K maxjobs] [-M maxfiles] [-p pidfile] [-S scanner] [-t maxcopiers] [-w interval] [-x indexdir] -m mapfile\n");
 	exit(1);
 }
 
@@ -75,6 +77,7 @@ showversion(void)
 int
 main(int argc, char *argv[])
 {
+	unsigned long n;
 	char *end;
 	const char *logfile, *mapfile, *pidfilename;
 	struct tsd_pidfh *pidfh;
@@ -92,18 +95,35 @@ main(int argc, char *argv[])
 	pidfilename = PIDFILENAME;
 	pidfh = NULL;
 	nodaemon = 0;
-	while ((opt = getopt(argc, argv, "1C:d:fhi:l:m:M:np:S:vV")) != -1)
+	while ((opt = getopt(argc, argv, "1bB:c:C:d:Dfhi:j:k:K:l:m:M:np:PS:t:vVw:x:")) != -1)
 		switch (opt) {
 		case '1':
 			++tsdfx_oneshot;
 			++nodaemon;
 			break;
+		case 'b':
+			++tsdfx_scan_records;
+			break;
+		case 'B':
+			tsdfx_copy_batch_size = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0') {
+				fprintf(stderr, "unable to parse batch size");
+				usage();
+			}
+			break;
+		case 'c':
+			tsdfx_copy_classes = optarg;
+			break;
 		case 'C':
 			tsdfx_copier = optarg;
 			break;
 		case 'd':
 			tsdfx_copy_purgeperiod = atoi(optarg);
 			break;
+		case 'D':
+			++tsdfx_map_diff;
+			++tsdfx_scan_records;
+			break;
 		case 'f':
 			++nodaemon;
 			break;
@@ -113,6 +133,30 @@ main(int argc, char *argv[])
 		case 'I':
 			tsdfx_reset_interval = atoi(optarg);
 			break;
+		case 'j':
+			n = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || n < 1 ||
+			    n > TSDFX_SCAN_MAX_THREADS) {
+				fprintf(stderr, "unable to parse scanner thread count");
+				usage();
+			}
+			tsdfx_scan_threads = n;
+			break;
+		case 'k':
+			tsdfx_copy_keepalive = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0') {
+				fprintf(stderr, "unable to parse copier keepalive");
+				usage();
+			}
+			break;
+		case 'K':
+			tsdfx_copy_maxjobs = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' ||
+			    tsdfx_copy_maxjobs == 0) {
+				fprintf(stderr, "unable to parse copier job limit");
+				usage();
+			}
+			break;
 		case 'l':
 			logfile = optarg;
 			break;
@@ -132,15 +176,36 @@ main(int argc, char *argv[])
 		case 'p':
 			pidfilename = optarg;
 			break;
+		case 'P':
+			++tsdfx_scan_persistent;
+			break;
 		case 'S':
 			tsdfx_scanner = optarg;
 			break;
+		case 't':
+			tsdfx_copy_max_tasks = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0') {
+				fprintf(stderr, "unable to parse copier limit");
+				usage();
+			}
+			break;
 		case 'v':
 			++tsdfx_verbose;
 			break;
 		case 'V':
 			showversion();
 			break;
+		case 'w':
+			tsdfx_watch_interval = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' ||
+			    tsdfx_watch_interval == 0) {
+				fprintf(stderr, "unable to parse full scan interval");
+				usage();
+			}
+			break;
+		case 'x':
+			tsdfx_scan_indexdir = optarg;
+			break;
 		default:
 			usage();
 		}
@@ -202,5 +267,5 @@ main(int argc, char *argv[])
 
 	if (killed > 0)
 		raise(killed);
-	exit(0);
+	exit(killed < 0 ? 1 : 0);
 }
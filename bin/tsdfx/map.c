@@ -59,13 +59,19 @@ struct tsdfx_map {
 	char srcpath[PATH_MAX];
 	char dstpath[PATH_MAX];
 	struct tsd_task *task;
+	struct tsd_task *dsttask;
 	struct tsdfx_recentlog *errlog;
+	int inodeorder;
+	unsigned int weight;
 };
 
 static struct tsdfx_map **tsdfx_map;
 static size_t tsdfx_map_sz;
 static int tsdfx_map_len;
 
+/* compare complete listings of source and destination */
+int tsdfx_map_diff;
+
 /*
  * Validate a path
  */
@@ -85,15 +91,45 @@ verify_path(const char *path, char *buf)
 	return (0);
 }
 
+/*
+ * Parse a map option, which follows the destination path and takes the
+ * form "name=value".
+ */
+static int
+map_option(struct tsdfx_map *m, const char *fn, int n, const char *opt)
+{
+	unsigned long weight;
+	char *end;
+
+	if (strcmp(opt, "statorder=inode") == 0) {
+		m->inodeorder = 1;
+	} else if (strcmp(opt, "statorder=readdir") == 0) {
+		m->inodeorder = 0;
+	} else if (strncmp(opt, "weight=", 7) == 0) {
+		weight = strtoul(opt + 7, &end, 10);
+		if (end == opt + 7 || *end != '\0' || weight < 1 ||
+		    weight > 1000) {
+			ERROR("%s:%d: invalid weight %s", fn, n, opt + 7);
+			return (-1);
+		}
+		m->weight = (unsigned int)weight;
+	} else {
+		ERROR("%s:%d: invalid option %s", fn, n, opt);
+		return (-1);
+	}
+	return (0);
+}
+
 /*
  * Create a new struct tsdfx_map
  */
 static struct tsdfx_map *
-map_new(const char *fn, int n, const char *name, const char *src, const char *dst)
+map_new(const char *fn, int n, const char *name, const char *src, const char *dst,
+    char **opts, int nopts)
 {
 	struct tsdfx_map *m;
 	char logpath[PATH_MAX];
-	int len;
+	int i, len;
 
 	if ((m = calloc(1, sizeof *m)) == NULL) {
 		ERROR("calloc()");
@@ -125,6 +161,13 @@ map_new(const char *fn, int n, const char *name, const char *src, const char *ds
 		free(m);
 		return (NULL);
 	}
+	m->weight = 1;
+	for (i = 0; i < nopts; ++i) {
+		if (map_option(m, fn, n, opts[i]) != 0) {
+			free(m);
+			return (NULL);
+		}
+	}
 	if ((m->errlog = tsdfx_recentlog_new(logpath, 5 * 60)) == NULL) {
 		ERROR("%s: unable to set up log", logpath);
 		free(m);
@@ -141,6 +184,7 @@ map_delete(struct tsdfx_map *m)
 {
 
 	if (m != NULL) {
+		tsdfx_scan_delete(m->dsttask);
 		tsdfx_scan_delete(m->task);
 		tsdfx_recentlog_destroy(m->errlog);
 		m->errlog = NULL;
@@ -148,6 +192,26 @@ map_delete(struct tsdfx_map *m)
 	}
 }
 
+/*
+ * Create the scan tasks for a map: one for the source, and if we are
+ * comparing listings, one for the destination.
+ */
+static int
+map_start(struct tsdfx_map *m)
+{
+	int flags;
+
+	flags = tsdfx_map_diff ? TSDFX_SCAN_COLLECT : 0;
+	if ((m->task = tsdfx_scan_new(m, m->srcpath, flags)) == NULL)
+		return (-1);
+	if (tsdfx_map_diff) {
+		flags |= TSDFX_SCAN_DEST;
+		if ((m->dsttask = tsdfx_scan_new(m, m->dstpath, flags)) == NULL)
+			return (-1);
+	}
+	return (0);
+}
+
 /*
  * Compare two maps
  */
@@ -190,8 +254,8 @@ map_read(const char *fn, struct tsdfx_map ***map, size_t *map_sz, int *map_len)
 	while ((words = tsd_readlinev(f, &lno, &nwords)) != NULL) {
 		if (nwords == 0)
 			continue;
-		/* expecting "name: srcpath => dstpath" */
-		if (nwords != 4 || (p = strchr(words[0], ':')) == NULL ||
+		/* expecting "name: srcpath => dstpath [option ...]" */
+		if (nwords < 4 || (p = strchr(words[0], ':')) == NULL ||
 		    p[1] != '\0' || strcmp(words[2], "=>") != 0) {
 			ERROR("%s:%d: syntax error", fn, lno);
 			goto fail;
@@ -206,7 +270,8 @@ map_read(const char *fn, struct tsdfx_map ***map, size_t *map_sz, int *map_len)
 			m = tm;
 		}
 		/* create new map */
-		if ((m[len] = map_new(fn, lno, words[0], words[1], words[3])) == NULL)
+		if ((m[len] = map_new(fn, lno, words[0], words[1], words[3],
+		    words + 4, nwords - 4)) == NULL)
 			goto fail;
 		++len;
 		/* done, free allocated memory */
@@ -287,9 +352,7 @@ tsdfx_map_reload(const char *fn)
 		} else if (res > 0) {
 			/* new task */
 			VERBOSE("adding %s", newmap[j]->name);
-			newmap[j]->task =
-			    tsdfx_scan_new(newmap[j], newmap[j]->srcpath);
-			if (newmap[j]->task == NULL)
+			if (map_start(newmap[j]) != 0)
 				goto fail;
 			++j;
 		} else {
@@ -302,7 +365,9 @@ tsdfx_map_reload(const char *fn)
 		res = (j < newmap_len) ?
 		    strcmp(tsdfx_map[i]->name, newmap[j]->name) : -1;
 		if (res == 0) {
-			/* unchanged task */
+			/* unchanged task, but options may have changed */
+			tsdfx_map[i]->inodeorder = newmap[j]->inodeorder;
+			tsdfx_map[i]->weight = newmap[j]->weight;
 			map_delete(newmap[j]);
 			newmap[j] = tsdfx_map[i];
 			tsdfx_map[i] = NULL;
@@ -339,29 +404,121 @@ fail:
 }
 
 /*
- * Process a file reported by the scanner.
+ * Process a file reported by the scanner, along with its metadata if
+ * available.
  */
 int
-tsdfx_map_process(struct tsdfx_map *map, const char *path)
+tsdfx_map_process(struct tsdfx_map *map, const char *path,
+    const struct stat *st)
 {
 
-	return (tsdfx_copy_wrap(map->srcpath, map->dstpath, path));
+	return (tsdfx_copy_wrap(map->srcpath, map->dstpath, path, st,
+	    map->weight));
+}
+
+/*
+ * Whether scanners for this map should look up directory entries in
+ * inode order.
+ */
+int
+tsdfx_map_inodeorder(const struct tsdfx_map *map)
+{
+
+	return (map->inodeorder);
+}
+
+/*
+ * Walk the sorted listings of the source and destination side by side
+ * and decide what to do with each entry in the source.  Entries which
+ * only exist in the destination are of no interest.
+ */
+static void
+map_diff(struct tsdfx_map *m)
+{
+	const struct tsdfx_scan_entry *src, *dst;
+	size_t count[TSDFX_COPY_QUEUED + 1];
+	size_t i, j, nsrc, ndst;
+	int cmp, ret;
+
+	nsrc = tsdfx_scan_listing(m->task, &src);
+	ndst = tsdfx_scan_listing(m->dsttask, &dst);
+	memset(count, 0, sizeof count);
+	for (i = j = 0; i < nsrc; ++i) {
+		cmp = -1;
+		while (j < ndst && (cmp = strcmp(src[i].path, dst[j].path)) > 0)
+			++j;
+		if (!src[i].known || (cmp == 0 && !dst[j].known))
+			ret = tsdfx_copy_wrap(m->srcpath, m->dstpath,
+			    src[i].path, src[i].known ? &src[i].st : NULL,
+			    m->weight);
+		else
+			ret = tsdfx_copy_sync(m->srcpath, m->dstpath,
+			    src[i].path, &src[i].st,
+			    cmp == 0 ? &dst[j].st : NULL, m->weight);
+		if (ret >= 0)
+			count[ret]++;
+	}
+	VERBOSE("%s: %zu new, %zu changed, %zu in sync, %zu to purge",
+	    m->name, count[TSDFX_COPY_NEW], count[TSDFX_COPY_CHANGED],
+	    count[TSDFX_COPY_INSYNC], count[TSDFX_COPY_PURGE]);
+}
+
+/*
+ * Fall back to looking at each entry in the source listing separately.
+ */
+static void
+map_nodiff(struct tsdfx_map *m)
+{
+	const struct tsdfx_scan_entry *src;
+	size_t i, nsrc;
+
+	nsrc = tsdfx_scan_listing(m->task, &src);
+	for (i = 0; i < nsrc; ++i)
+		tsdfx_copy_wrap(m->srcpath, m->dstpath, src[i].path,
+		    src[i].known ? &src[i].st : NULL, m->weight);
 }
 
 /*
  * Check all our map entries to see if a scan task recently completed.  If
  * so, set up and kick off compare / copy tasks.  Reschedule the completed
- * scan tasks.
+ * scan tasks.  Returns the number of maps which are waiting for a scan of
+ * the destination to complete.
  */
 int
 tsdfx_map_sched(void)
 {
-	int i;
+	struct tsdfx_map *m;
+	int i, waiting;
 
+	waiting = 0;
 	for (i = 0; i < tsdfx_map_len; ++i) {
-		/* nothing to do */
+		m = tsdfx_map[i];
+		if (m->dsttask == NULL ||
+		    tsdfx_scan_state(m->task) != TASK_FINISHED)
+			continue;
+		switch (tsdfx_scan_state(m->dsttask)) {
+		case TASK_IDLE:
+			/* source scan completed, now scan the destination */
+			tsdfx_scan_rush(m->dsttask);
+			waiting++;
+			break;
+		case TASK_RUNNING:
+		case TASK_STOPPING:
+			waiting++;
+			break;
+		case TASK_FINISHED:
+			map_diff(m);
+			tsdfx_scan_reset(m->dsttask);
+			tsdfx_scan_reset(m->task);
+			break;
+		default:
+			/* destination scan failed, do it the hard way */
+			map_nodiff(m);
+			tsdfx_scan_reset(m->task);
+			break;
+		}
 	}
-	return (tsdfx_map_len);
+	return (waiting);
 }
 
 int
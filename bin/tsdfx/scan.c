@@ -38,8 +38,7 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <poll.h>
-#include <pwd.h>
-#include <regex.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -54,39 +53,86 @@
 #include <tsd/assert.h>
 #include <tsd/ctype.h>
 #include <tsd/log.h>
+#include <tsd/pathcheck.h>
 #include <tsd/sha1.h>
 #include <tsd/strutil.h>
 #include <tsd/task.h>
 
+#include <tsdfx/scanrec.h>
+
 #include "tsdfx.h"
 #include "tsdfx_map.h"
 #include "tsdfx_scan.h"
+#include "tsdfx_watch.h"
 
 #define SCAN_BUFFER_SIZE	16384
+#define SCAN_BUFFER_MAX		(1024*1024)
 
 #define DEFAULT_SCAN_INTERVAL	300
 
 unsigned int tsdfx_scan_interval;
 unsigned int tsdfx_reset_interval;
 
+/*
+ * Buffer for output from a scan task.  Output is parsed in place
+ * between head and tail, and the buffer is only compacted when we run
+ * out of room at the end, at which point whatever is left over is at
+ * most one incomplete line or record.  It grows while the scanner is
+ * producing output faster than we can read it.
+ */
 struct tsdfx_scan_task_databuf {
 	char *buf;
 	size_t bufsz;
-	int buflen;
+	size_t head, tail;
+};
+
+/*
+ * Binary min-heap of scan tasks ordered by when they are next due.
+ */
+struct tsdfx_scan_heap {
+	struct tsdfx_scan_task_data **std;
+	size_t n, size;
 };
 
 /*
  * Private data for a scan task
  */
 struct tsdfx_scan_task_data {
+	struct tsd_task *task;
+
 	/* what to scan */
 	struct tsdfx_map *map;
 	char path[PATH_MAX];
 	struct stat st;
+	int flags;
+
+	/*
+	 * State of the scan, as opposed to that of the child, which in
+	 * persistent mode outlives it.  If the scanner has marked the end
+	 * of the scan, done is the state it reported.
+	 */
+	enum tsd_task_state state;
+	enum tsd_task_state done;
 
-	/* when to scan */
-	time_t lastran, nextrun;
+	/* where the scanner keeps track of what it saw last time */
+	char index[PATH_MAX];
+	int useindex;
+
+	/* when to scan, and when the current scan started */
+	time_t lastran, nextrun, started;
 	int interval;
+	int watched;
+	int rushed;
+
+	/* heap we are on, if any, and where */
+	struct tsdfx_scan_heap *heap;
+	size_t hidx;
+	time_t due;
+
+	/* list of running scans, or of stopping scanners */
+	struct tsdfx_scan_task_data *rprev, *rnext;
+	int stopping;
+	int deleted;
 
 	/* scanned files */
 	struct tsdfx_scan_task_databuf stdin;
@@ -94,6 +140,10 @@ struct tsdfx_scan_task_data {
 	/* error messages */
 	struct tsdfx_scan_task_databuf stderr;
 
+	/* collected results */
+	struct tsdfx_scan_entry *ent;
+	size_t nent, entsz;
+
 	/* counters */
 	int processed;
 	struct timespec timer_start;
@@ -107,33 +157,57 @@ static struct tsd_tset *tsdfx_scan_tasks;
 /* max concurrent scan tasks */
 unsigned int tsdfx_scan_max_tasks = 8;
 
+/* scans currently in progress */
+static unsigned int tsdfx_scan_nrunning;
+static struct tsdfx_scan_task_data *tsdfx_scan_running;
+
+/* scanners we have asked to stop and are waiting for */
+static struct tsdfx_scan_task_data *tsdfx_scan_stopping;
+
+/* idle tasks waiting to start, and failed tasks waiting to be reset */
+static struct tsdfx_scan_heap tsdfx_scan_starts;
+static struct tsdfx_scan_heap tsdfx_scan_resets;
+
+/* keep scanners around between scans */
+int tsdfx_scan_persistent;
+
 /* full path to scanner binary */
 const char *tsdfx_scanner;
 
 /* maximum files to scan, or 0 to use the default in the scanner */
 unsigned long tsdfx_maxfiles = 0;
 
+/* number of threads per scanner, or 0 to use the default in the scanner */
+unsigned int tsdfx_scan_threads = 0;
+
+/* directory in which to keep scan indices, or NULL */
+const char *tsdfx_scan_indexdir;
+
+/* have the scanner report metadata along with the names */
+int tsdfx_scan_records;
+
 static void tsdfx_scan_name(char *, const char *);
+static void tsdfx_scan_forget(struct tsdfx_scan_task_data *);
+static void tsdfx_scan_finished(struct tsd_task *);
+static void tsdfx_scan_watch(struct tsd_task *, const char *);
 static int tsdfx_scan_slurp(struct tsd_task *);
 static void tsdfx_scan_child(void *);
 
 static int tsdfx_scan_add(struct tsd_task *);
 static int tsdfx_scan_remove(struct tsd_task *);
 static int tsdfx_scan_start(struct tsd_task *);
-static int tsdfx_scan_stop(struct tsd_task *);
+static void tsdfx_scan_stop(struct tsd_task *);
+static void tsdfx_scan_end(struct tsd_task *, enum tsd_task_state);
 
 /*
- * Regular expression used to validate the output from the scan task.
- * Each line of output represents a path which must start with a slash,
- * and each slash must be followed by a sequence of one or more characters
- * from the POSIX Portable Filename Character Set, the first of which is
- * not a period.  If the path is a directory, it ends with a slash.
+ * Output from the scan task is validated with tsd_pathcheck().  Each line
+ * of output represents a path which must start with a slash, and each
+ * slash must be followed by a sequence of one or more characters from
+ * the POSIX Portable Filename Character Set, the first of which is not a
+ * period.  If the path is a directory, it ends with a slash.
  *
  * XXX allow spaces as well for now
  */
-#define SCAN_REGEX \
-	"^(/[0-9A-Za-z_-]([ 0-9A-Za-z._-]*[0-9A-Za-z._-])?)+/?$"
-static regex_t scan_regex;
 
 /*
  * Generate a unique name for a scan task.
@@ -162,8 +236,9 @@ tsdfx_scan_name(char *name, const char *path)
 enum tsd_task_state
 tsdfx_scan_state(const struct tsd_task *t)
 {
+	const struct tsdfx_scan_task_data *std = t->ud;
 
-	return (t->state);
+	return (std->state);
 }
 
 /*
@@ -174,9 +249,285 @@ tsdfx_scan_result(const struct tsd_task *t)
 {
 	struct tsdfx_scan_task_data *std = t->ud;
 
-	if (t->state != TASK_FINISHED)
+	if (std->state != TASK_FINISHED)
 		return (NULL);
-	return (std->stdin.buf);
+	return (std->stdin.buf + std->stdin.head);
+}
+
+/*
+ * Allocate an output buffer.  There is always room for a terminating
+ * NUL after the data.
+ */
+static int
+tsdfx_scan_buf_init(struct tsdfx_scan_task_databuf *db)
+{
+
+	if ((db->buf = malloc(SCAN_BUFFER_SIZE + 1)) == NULL)
+		return (-1);
+	db->bufsz = SCAN_BUFFER_SIZE;
+	db->head = db->tail = 0;
+	db->buf[0] = '\0';
+	return (0);
+}
+
+/*
+ * Empty an output buffer, and shrink it back to its original size so
+ * idle tasks don't hold on to memory.
+ */
+static void
+tsdfx_scan_buf_clear(struct tsdfx_scan_task_databuf *db)
+{
+	char *buf;
+
+	if (db->bufsz > SCAN_BUFFER_SIZE &&
+	    (buf = realloc(db->buf, SCAN_BUFFER_SIZE + 1)) != NULL) {
+		db->buf = buf;
+		db->bufsz = SCAN_BUFFER_SIZE;
+	}
+	db->head = db->tail = 0;
+	db->buf[0] = '\0';
+}
+
+/*
+ * Read as much as is available from a pipe, or as much as fits in a
+ * buffer of the maximum size.  Returns the amount read, or -1 on error.
+ */
+static ssize_t
+tsdfx_scan_buf_fill(struct tsdfx_scan_task_databuf *db, int fd)
+{
+	ssize_t len, rlen;
+	size_t size;
+	char *buf;
+
+	for (len = 0; ; len += rlen) {
+		/* make room, preferably without copying anything */
+		if (db->head == db->tail)
+			db->head = db->tail = 0;
+		if (db->tail == db->bufsz && db->head > 0) {
+			memmove(db->buf, db->buf + db->head,
+			    db->tail - db->head);
+			db->tail -= db->head;
+			db->head = 0;
+		}
+		if (db->tail == db->bufsz) {
+			if (db->bufsz >= SCAN_BUFFER_MAX)
+				break;
+			size = db->bufsz * 2;
+			if ((buf = realloc(db->buf, size + 1)) == NULL)
+				return (-1);
+			db->buf = buf;
+			db->bufsz = size;
+		}
+		rlen = read(fd, db->buf + db->tail, db->bufsz - db->tail);
+		if (rlen < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return (-1);
+			break;
+		}
+		if (rlen == 0)
+			break;
+		db->tail += rlen;
+	}
+	db->buf[db->tail] = '\0';
+	return (len);
+}
+
+/*
+ * Make room in a heap for every task we have.  Done when a task is
+ * created so that scheduling it later cannot fail.
+ */
+static int
+tsdfx_scan_heap_reserve(struct tsdfx_scan_heap *heap, size_t n)
+{
+	struct tsdfx_scan_task_data **std;
+	size_t size;
+
+	if (n <= heap->size)
+		return (0);
+	for (size = heap->size ? heap->size : 64; size < n; size *= 2)
+		/* nothing */ ;
+	if ((std = realloc(heap->std, size * sizeof *std)) == NULL)
+		return (-1);
+	heap->std = std;
+	heap->size = size;
+	return (0);
+}
+
+/*
+ * Internal: put a task in the given heap slot.
+ */
+static void
+tsdfx_scan_heap_set(struct tsdfx_scan_heap *heap, size_t i,
+    struct tsdfx_scan_task_data *std)
+{
+
+	heap->std[i] = std;
+	std->hidx = i;
+}
+
+/*
+ * Internal: restore the heap property around a task whose due time
+ * has changed.
+ */
+static void
+tsdfx_scan_heap_fix(struct tsdfx_scan_heap *heap, size_t i)
+{
+	struct tsdfx_scan_task_data *std;
+	size_t j;
+
+	std = heap->std[i];
+	while (i > 0 && std->due < heap->std[(i - 1) / 2]->due) {
+		tsdfx_scan_heap_set(heap, i, heap->std[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	while ((j = i * 2 + 1) < heap->n) {
+		if (j + 1 < heap->n && heap->std[j + 1]->due < heap->std[j]->due)
+			j++;
+		if (heap->std[j]->due >= std->due)
+			break;
+		tsdfx_scan_heap_set(heap, i, heap->std[j]);
+		i = j;
+	}
+	tsdfx_scan_heap_set(heap, i, std);
+}
+
+/*
+ * Remove a task from whichever heap it is on.
+ */
+static void
+tsdfx_scan_heap_remove(struct tsdfx_scan_task_data *std)
+{
+	struct tsdfx_scan_heap *heap;
+	size_t i;
+
+	if ((heap = std->heap) == NULL)
+		return;
+	i = std->hidx;
+	ASSERT(i < heap->n && heap->std[i] == std);
+	std->heap = NULL;
+	if (i < --heap->n) {
+		tsdfx_scan_heap_set(heap, i, heap->std[heap->n]);
+		tsdfx_scan_heap_fix(heap, i);
+	}
+}
+
+/*
+ * Return the task which is due first in a heap, or NULL.
+ */
+static struct tsdfx_scan_task_data *
+tsdfx_scan_heap_first(const struct tsdfx_scan_heap *heap)
+{
+
+	return (heap->n > 0 ? heap->std[0] : NULL);
+}
+
+/*
+ * Place a task on the heap which corresponds to its current state, or
+ * on none if the scheduler has no reason to look at it: idle tasks
+ * wait for their next run, except destination scans, which only run
+ * when rushed, and failed tasks wait to be reset.  Must be called
+ * whenever the state or the relevant times change.
+ */
+static void
+tsdfx_scan_schedule(struct tsdfx_scan_task_data *std)
+{
+	struct tsdfx_scan_heap *heap;
+	time_t due;
+
+	heap = NULL;
+	due = 0;
+	switch (std->state) {
+	case TASK_IDLE:
+		if ((std->flags & TSDFX_SCAN_DEST) && !std->rushed)
+			break;
+		heap = &tsdfx_scan_starts;
+		due = std->nextrun;
+		break;
+	case TASK_DEAD:
+	case TASK_FAILED:
+	case TASK_INVALID:
+		heap = &tsdfx_scan_resets;
+		due = std->lastran + tsdfx_reset_interval;
+		break;
+	default:
+		break;
+	}
+	if (std->heap != heap)
+		tsdfx_scan_heap_remove(std);
+	if (heap == NULL)
+		return;
+	std->due = due;
+	if (std->heap == NULL) {
+		/* room was reserved when the task was created */
+		ASSERT(heap->n < heap->size);
+		std->heap = heap;
+		tsdfx_scan_heap_set(heap, heap->n++, std);
+	}
+	tsdfx_scan_heap_fix(heap, std->hidx);
+}
+
+/*
+ * Keep track of running scans, which are the only ones we need to poll.
+ */
+static void
+tsdfx_scan_running_add(struct tsdfx_scan_task_data *std)
+{
+
+	std->rprev = NULL;
+	if ((std->rnext = tsdfx_scan_running) != NULL)
+		std->rnext->rprev = std;
+	tsdfx_scan_running = std;
+	tsdfx_scan_nrunning++;
+}
+
+static void
+tsdfx_scan_running_remove(struct tsdfx_scan_task_data *std)
+{
+
+	ASSERT(tsdfx_scan_nrunning > 0);
+	if (std->rprev != NULL)
+		std->rprev->rnext = std->rnext;
+	else
+		tsdfx_scan_running = std->rnext;
+	if (std->rnext != NULL)
+		std->rnext->rprev = std->rprev;
+	std->rprev = std->rnext = NULL;
+	tsdfx_scan_nrunning--;
+}
+
+/*
+ * Keep track of scanners which we have asked to stop, so the main loop
+ * can reap them without waiting for them.
+ */
+static void
+tsdfx_scan_stopping_add(struct tsdfx_scan_task_data *std)
+{
+
+	if (std->stopping)
+		return;
+	if (tsdfx_listen_task(std->task) != 0)
+		WARNING("%s: %s", std->task->name, strerror(errno));
+	std->rprev = NULL;
+	if ((std->rnext = tsdfx_scan_stopping) != NULL)
+		std->rnext->rprev = std;
+	tsdfx_scan_stopping = std;
+	std->stopping = 1;
+}
+
+static void
+tsdfx_scan_stopping_remove(struct tsdfx_scan_task_data *std)
+{
+
+	if (!std->stopping)
+		return;
+	if (std->rprev != NULL)
+		std->rprev->rnext = std->rnext;
+	else
+		tsdfx_scan_stopping = std->rnext;
+	if (std->rnext != NULL)
+		std->rnext->rprev = std->rprev;
+	std->rprev = std->rnext = NULL;
+	std->stopping = 0;
 }
 
 /*
@@ -216,10 +567,9 @@ tsdfx_scan_remove(struct tsd_task *t)
  * Prepare a scan task.
  */
 struct tsd_task *
-tsdfx_scan_new(struct tsdfx_map *map, const char *path)
+tsdfx_scan_new(struct tsdfx_map *map, const char *path, int flags)
 {
 	char name[NAME_MAX];
-	struct passwd *pw;
 	struct tsdfx_scan_task_data *std = NULL;
 	struct tsd_task *t = NULL;
 	struct stat st;
@@ -244,46 +594,54 @@ tsdfx_scan_new(struct tsdfx_map *map, const char *path)
 	if ((std = calloc(1, sizeof *std)) == NULL)
 		goto fail;
 	std->map = map;
+	std->flags = flags;
+	std->state = TASK_IDLE;
 	if (strlcpy(std->path, path, sizeof std->path) >= sizeof std->path)
 		goto fail;
-	std->st = st;
-	std->stdin.bufsz = SCAN_BUFFER_SIZE;
-	std->stdin.buflen = 0;
-	if ((std->stdin.buf = malloc(std->stdin.bufsz)) == NULL)
+	if (tsdfx_scan_indexdir != NULL &&
+	    snprintf(std->index, sizeof std->index, "%s/%s.idx/index",
+	    tsdfx_scan_indexdir, name) >= (int)sizeof std->index) {
+		errno = ENAMETOOLONG;
 		goto fail;
-	std->stdin.buf[0] = '\0';
-	std->stderr.bufsz = SCAN_BUFFER_SIZE;
-	std->stderr.buflen = 0;
-	if ((std->stderr.buf = malloc(std->stderr.bufsz)) == NULL)
+	}
+	std->st = st;
+	if (tsdfx_scan_buf_init(&std->stdin) != 0 ||
+	    tsdfx_scan_buf_init(&std->stderr) != 0)
 		goto fail;
-	std->stderr.buf[0] = '\0';
 	std->interval = tsdfx_scan_interval;
 
 	/* create task and set credentials */
 	if ((t = tsd_task_create(name, tsdfx_scan_child, std)) == NULL)
 		goto fail;
 	//t->flags = TASK_STDIN_NULL | TASK_STDOUT_PIPE;
-	t->flags = TASK_STDIN_NULL | TASK_STDOUT_PIPE | TASK_STDERR_PIPE;
+	t->flags = TASK_STDOUT_PIPE | TASK_STDERR_PIPE;
+	t->flags |= tsdfx_scan_persistent ? TASK_STDIN_PIPE : TASK_STDIN_NULL;
 
 	/* Run with user group membership combined with file gid */
-	if ((pw = getpwuid(st.st_uid)) != NULL) {
-		VERBOSE("setuser(\"%s\") for %s", pw->pw_name, path);
-		if (tsd_task_setuser(t, pw->pw_name) != 0)
-			goto fail;
+	if (tsd_task_setuid(t, st.st_uid) == 0) {
+		VERBOSE("setuid(%lu) (%s) for %s", (unsigned long)st.st_uid,
+		    t->user, path);
 		if (tsd_task_setegid(t, st.st_gid) != 0) {
 			WARNING("%s: owner %lu (%s) is not in group %lu", path,
-			    (unsigned long)st.st_uid, pw->pw_name,
+			    (unsigned long)st.st_uid, t->user,
 			    (unsigned long)st.st_gid);
 		}
 	} else {
-		VERBOSE("getpwuid(%lu) failed; setcred(%lu, %lu) for %s",
-		    (unsigned long)st.st_uid, (unsigned long)st.st_uid,
-		    (unsigned long)st.st_gid, path);
+		VERBOSE("setuid(%lu) failed: %s; setcred(%lu, %lu) for %s",
+		    (unsigned long)st.st_uid, strerror(errno),
+		    (unsigned long)st.st_uid, (unsigned long)st.st_gid, path);
 		if (tsd_task_setcred(t, st.st_uid, &st.st_gid, 1) != 0)
 			goto fail;
 	}
+	std->task = t;
+	if (tsdfx_scan_heap_reserve(&tsdfx_scan_starts,
+	    tsdfx_scan_tasks->ntasks + 1) != 0 ||
+	    tsdfx_scan_heap_reserve(&tsdfx_scan_resets,
+	    tsdfx_scan_tasks->ntasks + 1) != 0)
+		goto fail;
 	if (tsdfx_scan_add(t) != 0)
 		goto fail;
+	tsdfx_scan_schedule(std);
 	return (t);
 fail:
 	serrno = errno;
@@ -312,8 +670,9 @@ static void
 tsdfx_scan_child(void *ud)
 {
 	struct tsdfx_scan_task_data *std = ud;
-	const char *argv[10];
+	const char *argv[20];
 	char maxfiles_str[sizeof(long) * 4];/* ~log10(tsdfx_maxfiles) */
+	char threads_str[sizeof(int) * 4];
 	int argc;
 
 	/* check credentials */
@@ -339,6 +698,22 @@ tsdfx_scan_child(void *ud)
 		    "%ld", tsdfx_maxfiles);
 		argv[argc++] = maxfiles_str;
 	}
+	if (tsdfx_scan_threads > 0) {
+		argv[argc++] = "-j";
+		snprintf(threads_str, sizeof threads_str,
+		    "%u", tsdfx_scan_threads);
+		argv[argc++] = threads_str;
+	}
+	if (tsdfx_scan_records)
+		argv[argc++] = "-b";
+	if (tsdfx_map_inodeorder(std->map))
+		argv[argc++] = "-s";
+	if (tsdfx_scan_persistent)
+		argv[argc++] = "-p";
+	if (std->useindex) {
+		argv[argc++] = "-i";
+		argv[argc++] = std->index;
+	}
 	argv[argc++] = "-l";
 	argv[argc++] = tsd_log_getname();
 	/*
@@ -358,43 +733,304 @@ tsdfx_scan_child(void *ud)
 }
 
 /*
- * Start a scan task.
+ * Make sure the directory the index is kept in exists and belongs to
+ * the user the scanner will run as, since the scanner replaces the
+ * index by renaming a new one over it, but can neither create the
+ * directory nor take it over from a previous owner.  If the owner has
+ * changed, the old index is discarded.
+ */
+static int
+tsdfx_scan_prepare_index(struct tsd_task *t)
+{
+	struct tsdfx_scan_task_data *std = t->ud;
+	char dir[PATH_MAX], *fn;
+	struct stat st;
+	int dd, serrno;
+
+	strlcpy(dir, std->index, sizeof dir);
+	fn = strrchr(dir, '/');
+	*fn++ = '\0';
+	if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+		return (-1);
+	if ((dd = open(dir, O_RDONLY|O_DIRECTORY|O_NOFOLLOW)) < 0)
+		return (-1);
+	if (fstat(dd, &st) != 0)
+		goto fail;
+	if (t->uid != (uid_t)-1 &&
+	    (st.st_uid != t->uid || st.st_gid != t->gids[0])) {
+		if ((unlinkat(dd, fn, 0) != 0 && errno != ENOENT) ||
+		    fchown(dd, t->uid, t->gids[0]) != 0 ||
+		    fchmod(dd, 0700) != 0)
+			goto fail;
+	}
+	close(dd);
+	return (0);
+fail:
+	serrno = errno;
+	close(dd);
+	errno = serrno;
+	return (-1);
+}
+
+/*
+ * Return the time at which the next scan task is due to be started or
+ * reset, or 0 if there is nothing to wait for.  Tasks which are due to
+ * start but have to wait for a free slot don't count, since a running
+ * scan will wake us up when it ends.
+ */
+time_t
+tsdfx_scan_next(void)
+{
+	const struct tsdfx_scan_task_data *std;
+	time_t due, when;
+
+	due = 0;
+	if ((std = tsdfx_scan_heap_first(&tsdfx_scan_resets)) != NULL) {
+		when = std->due > 0 ? std->due : 1;
+		if (due == 0 || when < due)
+			due = when;
+	}
+	if (tsdfx_scan_nrunning < tsdfx_scan_max_tasks &&
+	    (std = tsdfx_scan_heap_first(&tsdfx_scan_starts)) != NULL) {
+		when = std->due > 0 ? std->due : 1;
+		if (due == 0 || when < due)
+			due = when;
+	}
+	return (due);
+}
+
+/*
+ * Return the earliest time, in milliseconds on the monotonic clock, at
+ * which a scanner we asked to stop is due to be prodded again, or 0 if
+ * we aren't waiting for any.
+ */
+long long
+tsdfx_scan_stopat(void)
+{
+	const struct tsdfx_scan_task_data *std;
+	long long due;
+	int i;
+
+	due = 0;
+	for (i = 0; i < 2; ++i) {
+		std = i == 0 ? tsdfx_scan_running : tsdfx_scan_stopping;
+		for (; std != NULL; std = std->rnext)
+			if (std->task->state == TASK_STOPPING &&
+			    (due == 0 || std->task->stopat < due))
+				due = std->task->stopat;
+	}
+	return (due);
+}
+
+/*
+ * Wake up the main loop when a running scan produces output, or stop.
+ */
+static int
+tsdfx_scan_listen(struct tsd_task *t)
+{
+
+	if (tsdfx_listen(t->pout) != 0 || tsdfx_listen(t->perr) != 0 ||
+	    tsdfx_listen_task(t) != 0)
+		return (-1);
+	return (0);
+}
+
+static void
+tsdfx_scan_unlisten(struct tsd_task *t)
+{
+
+	tsdfx_unlisten(t->pout);
+	tsdfx_unlisten(t->perr);
+	tsdfx_unlisten(t->pidfd);
+}
+
+/*
+ * Send a command to a persistent scanner.
+ */
+static int
+tsdfx_scan_command(struct tsd_task *t, const char *cmd)
+{
+	size_t len;
+	ssize_t wlen;
+
+	len = strlen(cmd);
+	if ((wlen = write(t->pin, cmd, len)) < 0)
+		return (-1);
+	if ((size_t)wlen != len) {
+		errno = EAGAIN;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Start a scan task.  A persistent scanner which is still around only
+ * needs to be told to scan again; otherwise, start a new one.
  */
 static int
 tsdfx_scan_start(struct tsd_task *t)
 {
 	struct tsdfx_scan_task_data *std = t->ud;
+	int serrno;
 
 	/* set counters */
 	std->processed = 0;
+	std->done = TASK_IDLE;
 	clock_gettime(CLOCK_MONOTONIC, &std->timer_start);
+	time(&std->started);
+
+	/* see if the previous scanner is still with us */
+	if (t->state == TASK_RUNNING)
+		tsd_task_poll(t);
+	if (t->state != TASK_RUNNING && t->state != TASK_IDLE)
+		tsd_task_reset(t);
+
+	/* without a usable index, the scanner will do a full walk */
+	if (t->state == TASK_IDLE) {
+		std->useindex = 0;
+		if (*std->index != '\0') {
+			if (tsdfx_scan_prepare_index(t) == 0)
+				std->useindex = 1;
+			else
+				WARNING("%s: %s", std->index, strerror(errno));
+		}
+	}
+
+	/* any rush up to this point is taken care of */
+	std->rushed = 0;
+
+	/* watch the top directory before the scanner gets to it */
+	if (tsdfx_watch_interval > 0 && !(std->flags & TSDFX_SCAN_DEST)) {
+		std->watched = tsdfx_watch_add(t, std->path, "") >= 0;
+		if (!std->watched)
+			WARNING("unable to watch %s: %s", std->path,
+			    strerror(errno));
+	}
 
 	VERBOSE("%s", std->path);
-	if (t->state != TASK_RUNNING && tsd_task_start(t) != 0)
+	if (t->state != TASK_RUNNING && tsd_task_start(t) != 0) {
+		std->state = TASK_DEAD;
+		tsdfx_scan_schedule(std);
 		return (-1);
+	}
+	if ((tsdfx_scan_persistent && tsdfx_scan_command(t, "rescan\n") != 0) ||
+	    tsdfx_scan_listen(t) != 0) {
+		serrno = errno;
+		tsdfx_scan_stop(t);
+		tsdfx_scan_end(t, TASK_DEAD);
+		errno = serrno;
+		return (-1);
+	}
+	std->state = TASK_RUNNING;
+	tsdfx_scan_schedule(std);
+	tsdfx_scan_running_add(std);
 	VERBOSE("%d jobs, %d running", tsdfx_scan_tasks->ntasks,
-	    tsdfx_scan_tasks->nrunning);
+	    tsdfx_scan_nrunning);
 	return (0);
 }
 
 /*
- * Stop a scan task.
+ * A scan has ended, one way or another.  If we had to ask the scanner
+ * to stop, the main loop will reap it.
  */
-static int
+static void
+tsdfx_scan_end(struct tsd_task *t, enum tsd_task_state state)
+{
+	struct tsdfx_scan_task_data *std = t->ud;
+
+	if (std->state == TASK_RUNNING) {
+		tsdfx_scan_running_remove(std);
+		tsdfx_scan_unlisten(t);
+	}
+	if (t->state == TASK_STOPPING)
+		tsdfx_scan_stopping_add(std);
+	std->state = state;
+	tsdfx_scan_schedule(std);
+	if (state == TASK_FINISHED)
+		tsdfx_scan_finished(t);
+}
+
+/*
+ * Ask a scanner to stop.  We stop listening to its output, but not to
+ * the child itself, which tsd_task_poll() will reap once it is gone.
+ */
+static void
 tsdfx_scan_stop(struct tsd_task *t)
 {
 	struct tsdfx_scan_task_data *std = t->ud;
 
 	VERBOSE("%s", std->path);
-	if (t->state == TASK_RUNNING && tsd_task_stop(t) != 0)
-		return (-1);
+	tsdfx_unlisten(t->pout);
+	tsdfx_unlisten(t->perr);
+	if (t->state == TASK_RUNNING)
+		tsd_task_terminate(t);
 	VERBOSE("%d jobs, %d running", tsdfx_scan_tasks->ntasks,
 	    tsdfx_scan_tasks->nrunning);
+}
+
+/*
+ * Make sure a scanner we no longer need is gone, and reset its task.
+ * If we have to ask it to stop, it is left for the main loop to reap,
+ * and we return -1.
+ */
+static int
+tsdfx_scan_release(struct tsd_task *t)
+{
+
+	if (t->state == TASK_RUNNING)
+		tsdfx_scan_stop(t);
+	if (t->state == TASK_STOPPING) {
+		tsdfx_scan_stopping_add(t->ud);
+		return (-1);
+	}
+	tsd_task_reset(t);
 	return (0);
 }
 
 /*
- * Delete a scan task.
+ * The scanner has hung up.  Once it has also exited, decide how the
+ * scan went.
+ */
+static void
+tsdfx_scan_exited(struct tsd_task *t)
+{
+	struct tsdfx_scan_task_data *std = t->ud;
+
+	if (t->state == TASK_STOPPING)
+		return;
+	if (t->state != TASK_STOPPED) {
+		tsdfx_scan_end(t, TASK_FAILED);
+	} else if (tsdfx_scan_persistent) {
+		WARNING("scanner for %s exited unexpectedly", std->path);
+		tsdfx_scan_end(t, TASK_FAILED);
+	} else if (std->stdin.tail > std->stdin.head) {
+		WARNING("incomplete output from child %ld for %s",
+		    (long)t->pid, std->path);
+		tsdfx_scan_end(t, TASK_FAILED);
+	} else {
+		tsdfx_scan_end(t, TASK_FINISHED);
+	}
+}
+
+/*
+ * Free a scan task which has been deleted.
+ */
+static void
+tsdfx_scan_destroy(struct tsdfx_scan_task_data *std)
+{
+
+	tsdfx_scan_stopping_remove(std);
+	tsd_task_destroy(std->task);
+	tsdfx_scan_forget(std);
+	free(std->ent);
+	free(std->stderr.buf);
+	free(std->stdin.buf);
+	free(std);
+}
+
+/*
+ * Delete a scan task.  If its scanner is still running, it is asked to
+ * stop, and the task is freed once the main loop has reaped it.
  */
 void
 tsdfx_scan_delete(struct tsd_task *t)
@@ -407,13 +1043,17 @@ tsdfx_scan_delete(struct tsd_task *t)
 	std = t->ud;
 
 	VERBOSE("%s", std->path);
+	if (std->state == TASK_RUNNING)
+		tsdfx_scan_running_remove(std);
+	tsdfx_scan_heap_remove(std);
+	tsdfx_scan_unlisten(t);
+	tsdfx_watch_remove(t);
 	tsdfx_scan_remove(t);
-	tsd_task_destroy(t);
-	VERBOSE("%d jobs, %d running", tsdfx_scan_tasks->ntasks,
-	    tsdfx_scan_tasks->nrunning);
-	free(std->stderr.buf);
-	free(std->stdin.buf);
-	free(std);
+	std->state = TASK_INVALID;
+	std->deleted = 1;
+	if (tsdfx_scan_release(t) != 0)
+		return;
+	tsdfx_scan_destroy(std);
 }
 
 /*
@@ -427,17 +1067,31 @@ tsdfx_scan_reset(struct tsd_task *t)
 
 	VERBOSE("%s", std->path);
 
-	/* stop and reset to idle */
-	if (t->state == TASK_IDLE)
+	/*
+	 * Stop and reset to idle.  A persistent scanner which completed
+	 * its scan is left running for next time.  If we have to ask the
+	 * scanner to stop, we come back here once the main loop has
+	 * reaped it.
+	 */
+	if (std->state == TASK_IDLE)
 		return (0);
-	tsd_task_reset(t);
+	if (std->state == TASK_RUNNING) {
+		tsdfx_scan_running_remove(std);
+		tsdfx_scan_unlisten(t);
+	}
+	if ((!tsdfx_scan_persistent || std->state != TASK_FINISHED) &&
+	    tsdfx_scan_release(t) != 0) {
+		std->state = TASK_STOPPING;
+		tsdfx_scan_schedule(std);
+		return (0);
+	}
+	std->state = TASK_IDLE;
 	time(&std->lastran);
 
-	/* clear the buffer */
-	std->stdin.buf[0] = '\0';
-	std->stdin.buflen = 0;
-	std->stderr.buf[0] = '\0';
-	std->stderr.buflen = 0;
+	/* clear the buffer and anything we collected */
+	tsdfx_scan_buf_clear(&std->stdin);
+	tsdfx_scan_buf_clear(&std->stderr);
+	tsdfx_scan_forget(std);
 
 	/* clear counters */
 	std->processed = 0;
@@ -446,14 +1100,18 @@ tsdfx_scan_reset(struct tsd_task *t)
 	/* check that it's still there */
 	if (stat(std->path, &st) != 0) {
 		WARNING("%s has disappeared", std->path);
-		t->state = TASK_INVALID;
+		(void)tsdfx_scan_release(t);
+		std->state = TASK_INVALID;
+		tsdfx_scan_schedule(std);
 		return (-1);
 	}
 
 	/* re-stat and check for suspicious changes */
 	if (!S_ISDIR(st.st_mode)) {
 		WARNING("%s is no longer a directory", std->path);
-		t->state = TASK_INVALID;
+		(void)tsdfx_scan_release(t);
+		std->state = TASK_INVALID;
+		tsdfx_scan_schedule(std);
 		return (-1);
 	}
 	if (st.st_uid != std->st.st_uid)
@@ -464,8 +1122,17 @@ tsdfx_scan_reset(struct tsd_task *t)
 		    (long)std->st.st_gid, (long)st.st_gid);
 	std->st = st;
 
-	/* reschedule */
-	std->nextrun = std->lastran + std->interval;
+	/*
+	 * Reschedule.  Trees we are watching only need the occasional
+	 * full scan, unless something changed while we were scanning.
+	 */
+	if (std->rushed)
+		std->nextrun = std->lastran;
+	else if (std->watched)
+		std->nextrun = std->lastran + tsdfx_watch_interval;
+	else
+		std->nextrun = std->lastran + std->interval;
+	tsdfx_scan_schedule(std);
 
 	return (0);
 }
@@ -480,13 +1147,18 @@ tsdfx_scan_rush(struct tsd_task *t)
 	time_t now;
 
 	VERBOSE("%s", std->path);
-	switch (t->state) {
+	switch (std->state) {
 	case TASK_IDLE:
 		time(&now);
 		if (std->nextrun > now)
 			std->nextrun = now;
-		/* fall through */
+		std->rushed = 1;
+		tsdfx_scan_schedule(std);
+		return (0);
 	case TASK_RUNNING:
+	case TASK_STOPPING:
+		/* scan again as soon as this one is done */
+		std->rushed = 1;
 		return (0);
 	default:
 		return (-1);
@@ -494,125 +1166,340 @@ tsdfx_scan_rush(struct tsd_task *t)
 }
 
 /*
- * Read available data from a single task, validate it and start copiers.
- * Returns < 0 on error, > 0 if any data was read and / or is pending, and
- * 0 otherwise.
+ * Process a file which has been reported as changed since the last scan.
+ * If it passes muster, pass it on just as if the scanner had found it;
+ * otherwise, let the scanner deal with it.
  */
-static int
-tsdfx_scan_slurp(struct tsd_task *t)
+int
+tsdfx_scan_notify(struct tsd_task *t, const char *path)
 {
 	struct tsdfx_scan_task_data *std = t->ud;
-	size_t bufsz, len;
-	ssize_t rlen;
-	char *buf, *end, *p, *q;
 
-	/* read as much as we can in the space we have left */
-	len = 0;
-	do {
-		/* where do we start, and how much room do we have? */
-		buf = std->stdin.buf + std->stdin.buflen;
-		bufsz = std->stdin.bufsz - std->stdin.buflen;
+	if (!tsd_pathcheck(path, strlen(path)))
+		return (tsdfx_scan_rush(t));
+	VERBOSE("%s%s", std->path, path);
+	return (tsdfx_map_process(std->map, path, NULL));
+}
 
-		/* read and update pointers and counters */
-		if ((rlen = read(t->pout, buf, bufsz)) < 0) {
-			if (errno != EAGAIN && errno != EWOULDBLOCK)
-				return (rlen);
-			rlen = 0;
+/*
+ * Watch a directory reported by the scanner.  The scanner may already
+ * have read it before we started watching, so if it is new to us and
+ * has been modified since the scan started, make sure we scan again
+ * once we're done.  Any later change will be caught by the watch.  If
+ * we can't watch it, we fall back to scanning at regular intervals.
+ */
+static void
+tsdfx_scan_watch(struct tsd_task *t, const char *dir)
+{
+	struct tsdfx_scan_task_data *std = t->ud;
+	char path[PATH_MAX];
+	struct stat st;
+	size_t len;
+
+	/* the watch list wants it without the trailing slash */
+	len = strlen(dir) - 1;
+	if (snprintf(path, sizeof path, "%s%.*s", std->path, (int)len, dir) >=
+	    (int)sizeof path)
+		errno = ENAMETOOLONG;
+	else
+		switch (tsdfx_watch_add(t, path, path + strlen(std->path))) {
+		case 1:
+			if (lstat(path, &st) != 0 ||
+			    st.st_mtime >= std->started ||
+			    st.st_ctime >= std->started)
+				std->rushed = 1;
+			/* fall through */
+		case 0:
+			return;
 		}
-		VERBOSE("read %ld characters from child %ld",
-		    (long)rlen, (long)t->pid);
-		std->stdin.buflen += rlen;
-		std->stdin.buf[std->stdin.buflen] = '\0';
-		len += rlen;
-	} while (rlen > 0 && (size_t)len < bufsz);
-	end = std->stdin.buf + std->stdin.buflen;
+	WARNING("unable to watch %s: %s", path, strerror(errno));
+	tsdfx_watch_remove(t);
+	std->watched = 0;
+}
 
-	/* process output line by line */
-	for (p = q = std->stdin.buf; p < end; p = q) {
-		for (q = p; q < end && *q != '\n'; ++q)
-			/* nothing */ ;
-		if (q == end)
+/*
+ * Free everything we collected during the last scan.
+ */
+static void
+tsdfx_scan_forget(struct tsdfx_scan_task_data *std)
+{
+
+	while (std->nent > 0)
+		free(std->ent[--std->nent].path);
+}
+
+/*
+ * Hold on to a file or directory reported by the scanner.
+ */
+static int
+tsdfx_scan_collect(struct tsdfx_scan_task_data *std, const char *path,
+    const struct stat *st)
+{
+	struct tsdfx_scan_entry *ent;
+	size_t size;
+
+	if (std->nent == std->entsz) {
+		size = std->entsz ? std->entsz * 2 : 1024;
+		if ((ent = realloc(std->ent, size * sizeof *ent)) == NULL)
+			return (-1);
+		std->ent = ent;
+		std->entsz = size;
+	}
+	ent = &std->ent[std->nent];
+	if ((ent->path = strdup(path)) == NULL)
+		return (-1);
+	if (st != NULL) {
+		ent->st = *st;
+		ent->known = 1;
+	} else {
+		memset(&ent->st, 0, sizeof ent->st);
+		ent->known = 0;
+	}
+	std->nent++;
+	return (0);
+}
+
+static int
+tsdfx_scan_entry_compare(const void *a, const void *b)
+{
+	const struct tsdfx_scan_entry *ea = a;
+	const struct tsdfx_scan_entry *eb = b;
+
+	return (strcmp(ea->path, eb->path));
+}
+
+/*
+ * Return what a finished scan task collected, sorted by path.
+ */
+size_t
+tsdfx_scan_listing(const struct tsd_task *t,
+    const struct tsdfx_scan_entry **ent)
+{
+	const struct tsdfx_scan_task_data *std = t->ud;
+
+	*ent = std->ent;
+	return (std->state == TASK_FINISHED ? std->nent : 0);
+}
+
+/*
+ * A scan task has completed successfully.
+ */
+static void
+tsdfx_scan_finished(struct tsd_task *t)
+{
+	struct tsdfx_scan_task_data *std = t->ud;
+	struct timespec timer_end;
+
+	/* report scan duration */
+#define ELAPSED(start, end) ((double)(end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec)/(double)1e9))
+	clock_gettime(CLOCK_MONOTONIC, &timer_end);
+	VERBOSE("in %s found %li dir entries, measured time: %.3lf s",
+	       std->path, std->processed,
+	       ELAPSED(std->timer_start, timer_end));
+
+	if (std->nent > 0)
+		qsort(std->ent, std->nent, sizeof *std->ent,
+		    tsdfx_scan_entry_compare);
+}
+
+/*
+ * Pass on a file or directory reported by the scanner, along with its
+ * metadata if the scanner provided it.
+ */
+static int
+tsdfx_scan_found(struct tsd_task *t, const char *path, size_t len,
+    const struct stat *st)
+{
+	struct tsdfx_scan_task_data *std = t->ud;
+
+	VERBOSE("[%s]", path);
+	std->processed++;
+	if (std->flags & TSDFX_SCAN_COLLECT) {
+		if (tsdfx_scan_collect(std, path, st) != 0)
+			return (-1);
+	} else {
+		tsdfx_map_process(std->map, path, st);
+	}
+	if (std->watched && len > 1 && path[len - 1] == '/')
+		tsdfx_scan_watch(t, path);
+	return (0);
+}
+
+/*
+ * Process complete lines of text output.  Returns a pointer to the
+ * first incomplete line.
+ */
+static char *
+tsdfx_scan_parse_lines(struct tsd_task *t, char *buf, char *end)
+{
+	struct tsdfx_scan_task_data *std = t->ud;
+	char *p, *q;
+
+	for (p = buf; p < end; p = q) {
+		if ((q = memchr(p, '\n', end - p)) == NULL)
 			break;
 		*q++ = '\0';
-		if (regexec(&scan_regex, p, 0, NULL, 0) != 0) {
+		if (tsdfx_scan_persistent &&
+		    (strcmp(p, TSDFX_SCAN_DONE) == 0 ||
+		    strcmp(p, TSDFX_SCAN_FAILED) == 0)) {
+			/* end of scan */
+			std->done = *p == *TSDFX_SCAN_DONE ?
+			    TASK_FINISHED : TASK_FAILED;
+			return (q);
+		}
+		if (!tsd_pathcheck(p, q - p - 1)) {
 			WARNING("invalid output from child %ld for %s",
 			    (long)t->pid, std->path);
 			continue;
 		}
-		VERBOSE("[%s]", p);
-		std->processed++;
-		tsdfx_map_process(std->map, p);
+		if (tsdfx_scan_found(t, p, q - p - 1, NULL) != 0)
+			return (NULL);
+	}
+	return (p);
+}
+
+/*
+ * Process complete binary records.  Returns a pointer to the first
+ * incomplete record, or NULL if the output does not make sense.
+ */
+static char *
+tsdfx_scan_parse_records(struct tsd_task *t, char *buf, char *end)
+{
+	struct tsdfx_scan_task_data *std = t->ud;
+	struct tsdfx_scanrec sr;
+	char path[PATH_MAX + 1];
+	struct stat st;
+	size_t len;
+	char *p;
+
+	for (p = buf; (size_t)(end - p) >= sizeof sr; p += sr.len) {
+		memcpy(&sr, p, sizeof sr);
+		if (tsdfx_scan_persistent && sr.len == sizeof sr) {
+			/* end of scan */
+			std->done = sr.mode == 0 ? TASK_FINISHED : TASK_FAILED;
+			return (p + sr.len);
+		}
+		if (sr.len <= sizeof sr || sr.len > sizeof sr + PATH_MAX) {
+			WARNING("invalid record from child %ld for %s",
+			    (long)t->pid, std->path);
+			errno = EINVAL;
+			return (NULL);
+		}
+		if ((size_t)(end - p) < sr.len)
+			break;
+		len = sr.len - sizeof sr;
+		memcpy(path, p + sizeof sr, len);
+		path[len] = '\0';
+		if (!tsd_pathcheck(path, len) ||
+		    !(S_ISREG(sr.mode) || S_ISDIR(sr.mode)) ||
+		    !S_ISDIR(sr.mode) != (path[len - 1] != '/')) {
+			WARNING("invalid output from child %ld for %s",
+			    (long)t->pid, std->path);
+			continue;
+		}
+		memset(&st, 0, sizeof st);
+		st.st_mode = sr.mode;
+		st.st_size = sr.size;
+		st.st_mtim.tv_sec = sr.mtime;
+		st.st_mtim.tv_nsec = sr.mtime_nsec;
+		st.st_atim.tv_sec = sr.atime;
+		st.st_atim.tv_nsec = sr.atime_nsec;
+		st.st_ino = sr.ino;
+		st.st_dev = sr.dev;
+		if (tsdfx_scan_found(t, path, len, &st) != 0)
+			return (NULL);
+	}
+	return (p);
+}
+
+/*
+ * Read available data from a single task, validate it and start copiers.
+ * Returns < 0 on error, > 0 if any data was read and / or is pending, and
+ * 0 otherwise.
+ */
+static int
+tsdfx_scan_slurp(struct tsd_task *t)
+{
+	struct tsdfx_scan_task_data *std = t->ud;
+	struct tsdfx_scan_task_databuf *db = &std->stdin;
+	ssize_t rlen;
+	size_t len;
+	char *end, *p;
+
+	/* read whatever is available */
+	if ((rlen = tsdfx_scan_buf_fill(db, t->pout)) < 0)
+		return (-1);
+	VERBOSE("read %ld characters from child %ld",
+	    (long)rlen, (long)t->pid);
+	end = db->buf + db->tail;
+
+	/* process output line by line or record by record */
+	if (tsdfx_scan_records)
+		p = tsdfx_scan_parse_records(t, db->buf + db->head, end);
+	else
+		p = tsdfx_scan_parse_lines(t, db->buf + db->head, end);
+	if (p == NULL)
+		return (-1);
+	if (std->done != TASK_IDLE && p != end) {
+		WARNING("output after end of scan from child %ld for %s",
+		    (long)t->pid, std->path);
+		errno = EINVAL;
+		return (-1);
 	}
 
 	/*
-	 * After the above loop, p points to the first character of the
-	 * first incomplete line, or the beginning of the buffer if it is
-	 * empty or does not contain at least one line.  If the amount of
-	 * data remaining exceeds the maximum length of a path name (not
-	 * including the newline, which is still missing), something is
-	 * wrong.  Otherwise, move what's left to the start of the buffer.
+	 * After the above, p points to the first character of the first
+	 * incomplete line or record, or the end of the buffer if there is
+	 * none.  If the amount of data remaining exceeds the maximum
+	 * length of a path name (not including the newline, which is
+	 * still missing) or of a record, something is wrong.
 	 */
-	if ((len = end - p) > PATH_MAX) {
+	db->head = p - db->buf;
+	len = db->tail - db->head;
+	if (len > (tsdfx_scan_records ?
+	    sizeof(struct tsdfx_scanrec) + PATH_MAX : PATH_MAX)) {
 		errno = ENAMETOOLONG;
 		return (-1);
 	}
-	if (p > std->stdin.buf) {
-		memmove(std->stdin.buf, p, std->stdin.buflen = len);
-		VERBOSE("left over: [%.*s]", (int)std->stdin.buflen, std->stdin.buf);
-	}
+	if (len > 0)
+		VERBOSE("left over: [%.*s]", (int)len, p);
 
-	return (rlen + std->stdin.buflen);
+	return (rlen + len);
 }
 
 static int
 tsdfx_scan_slurp_stderr(struct tsd_task *t)
 {
 	struct tsdfx_scan_task_data *std = t->ud;
-	size_t bufsz, len;
+	struct tsdfx_scan_task_databuf *db = &std->stderr;
 	ssize_t rlen;
-	char *buf, *end, *p, *q;
-
-	/* read as much as we can in the space we have left */
-	len = 0;
-	do {
-		/* where do we start, and how much room do we have? */
-		buf = std->stderr.buf + std->stderr.buflen;
-		bufsz = std->stderr.bufsz - std->stderr.buflen;
-
-		/* read and update pointers and counters */
-		if ((rlen = read(t->perr, buf, bufsz)) < 0) {
-			if (errno == EAGAIN || errno == EWOULDBLOCK)
-				break;
-			return (rlen);
-		}
-		VERBOSE("read %ld stderr characters from child %ld",
-		    (long)rlen, (long)t->pid);
-		std->stderr.buflen += rlen;
-		std->stderr.buf[std->stderr.buflen] = '\0';
-		len += rlen;
-	} while (rlen > 0 && (size_t)len < bufsz);
-	end = std->stderr.buf + std->stderr.buflen;
+	char *end, *p, *q;
+
+	/* read whatever is available */
+	if ((rlen = tsdfx_scan_buf_fill(db, t->perr)) < 0)
+		return (-1);
+	VERBOSE("read %ld stderr characters from child %ld",
+	    (long)rlen, (long)t->pid);
+	end = db->buf + db->tail;
 
 	/* process output line by line */
-	for (p = q = std->stderr.buf; p < end; p = q) {
-		for (q = p; q < end && *q != '\n'; ++q)
-			/* nothing */ ;
-		if (q == end)
-			break;
+	for (p = db->buf + db->head; p < end; p = q) {
+		if ((q = memchr(p, '\n', end - p)) == NULL) {
+			/* a line this long is not going to end well */
+			if (p > db->buf || db->tail < SCAN_BUFFER_MAX)
+				break;
+			q = end;
+		}
 		*q++ = '\0';
-		tsdfx_map_log(std->map, p);
+		/* the destination is our business, not the user's */
+		if (std->flags & TSDFX_SCAN_DEST)
+			VERBOSE("%s: %s", std->path, p);
+		else
+			tsdfx_map_log(std->map, p);
 	}
+	db->head = (p < end ? p : end) - db->buf;
 
-	/*
-	 * After the above loop, q points to the first character of
-	 * the first incomplete line, or the beginning of the buffer
-	 * if it is empty or does not contain at least one line.  Move
-	 * what's left to the start of the buffer.
-	 */
-	if (q > std->stderr.buf)
-		memmove(std->stderr.buf, q, std->stderr.buflen = len);
-
-	return (len);
+	return (rlen);
 }
 
 /*
@@ -645,7 +1532,14 @@ tsdfx_scan_poll(struct tsd_task *t)
 	pfd[1].fd = t->perr;
 	pfd[1].events = POLLIN;
 	pfd[1].revents = 0;
-	events = poll(pfd, (sizeof(pfd)/sizeof(pfd[0])), 0);
+	if (t->state == TASK_STOPPING) {
+		/* it has hung up, see if it has exited yet */
+		tsd_task_poll(t);
+		tsdfx_scan_exited(t);
+		events = 0;
+	} else {
+		events = poll(pfd, (sizeof(pfd)/sizeof(pfd[0])), 0);
+	}
 	switch (events) {
 	case 1:
 	case 2:
@@ -653,11 +1547,17 @@ tsdfx_scan_poll(struct tsd_task *t)
 			/* yes, let's get it */
 			if ((ret = tsdfx_scan_slurp(t)) < 0) {
 				/* error in slurp(), kill task and bail */
-				if (tsdfx_scan_stop(t) == 0) {
-					WARNING("scan task %ld failed for %s",
-					    (long)t->pid, std->path);
-					t->state = TASK_FAILED;
-				}
+				tsdfx_scan_stop(t);
+				WARNING("scan task %ld failed for %s",
+				    (long)t->pid, std->path);
+				tsdfx_scan_end(t, TASK_FAILED);
+				break;
+			}
+			if (std->done != TASK_IDLE) {
+				/* a persistent scanner is done for now */
+				while (tsdfx_scan_slurp_stderr(t) > 0)
+					/* nothing */ ;
+				tsdfx_scan_end(t, std->done);
 				break;
 			}
 			if (ret > 0)
@@ -667,25 +1567,19 @@ tsdfx_scan_poll(struct tsd_task *t)
 			/* yes, let's get it */
 			if ((ret = tsdfx_scan_slurp_stderr(t)) < 0) {
 				/* error in slurp(), kill task and bail */
-				if (tsdfx_scan_stop(t) == 0) {
-					WARNING("scan task %ld failed for %s",
-					    (long)t->pid, std->path);
-					t->state = TASK_FAILED;
-				}
+				tsdfx_scan_stop(t);
+				WARNING("scan task %ld failed for %s",
+				    (long)t->pid, std->path);
+				tsdfx_scan_end(t, TASK_FAILED);
 				break;
 			}
 			if (ret > 0)
 				break;
 		}
-		if (pfd[0].revents & POLLHUP && tsdfx_scan_stop(t) == 0) {
-			/* we're done */
-			if (std->stdin.buflen > 0) {
-				WARNING("incomplete output from child %ld for %s",
-				    (long)t->pid, std->path);
-				t->state = TASK_FAILED;
-			} else {
-				t->state = TASK_FINISHED;
-			}
+		if (pfd[0].revents & POLLHUP) {
+			/* we're done, one way or another */
+			tsdfx_scan_stop(t);
+			tsdfx_scan_exited(t);
 		}
 		break;
 	case 0:
@@ -698,12 +1592,12 @@ tsdfx_scan_poll(struct tsd_task *t)
 		VERBOSE("did not expect %d from poll() %s: %s",
 			events, std->path, strerror(serrno));
 		errno = serrno;
-		t->state = TASK_FAILED;
+		tsdfx_scan_end(t, TASK_FAILED);
 		break;
 	}
 
 	/* and the verdict */
-	switch (t->state) {
+	switch (std->state) {
 	case TASK_RUNNING:
 		return (1);
 	case TASK_FINISHED:
@@ -714,69 +1608,61 @@ tsdfx_scan_poll(struct tsd_task *t)
 }
 
 /*
- * Start any scheduled tasks
+ * Poll running scans, then reset failed tasks and start idle ones as
+ * they come due.  Tasks which are neither running nor due are not
+ * looked at.
  */
 int
 tsdfx_scan_sched(void)
 {
-	struct tsdfx_scan_task_data *std;
-	struct tsd_task *t, *tn;
-	struct timespec timer_end;
+	struct tsdfx_scan_task_data *std, *stdn;
 	time_t now;
 
 	time(&now);
-	t = tsd_tset_first(tsdfx_scan_tasks);
-	while (t != NULL) {
-		/* look ahead so we can safely delete dead tasks */
-		tn = tsd_tset_next(tsdfx_scan_tasks, t);
-		std = t->ud;
-		switch (t->state) {
-		case TASK_IDLE:
-			/* see if the task is due to start again */
-			if (tsdfx_scan_tasks->nrunning < tsdfx_scan_max_tasks &&
-			    now >= std->nextrun && tsdfx_scan_start(t) != 0) {
-				WARNING("failed to start task: %s",
-				    strerror(errno));
-			}
-			break;
-		case TASK_RUNNING:
-			/* see if there is any output waiting */
-			tsdfx_scan_poll(t);
-			break;
-		case TASK_FINISHED:
-			/* completed successfully */
 
-			/* report scan duration */
-#define ELAPSED(start, end) ((double)(end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec)/(double)1e9))
-			clock_gettime(CLOCK_MONOTONIC, &timer_end);
-			VERBOSE("in %s found %li dir entries, measured time: %.3lf s",
-			       std->path, std->processed,
-			       ELAPSED(std->timer_start, timer_end));
+	/* see if there is any output waiting */
+	for (std = tsdfx_scan_running; std != NULL; std = stdn) {
+		/* look ahead since the scan may end */
+		stdn = std->rnext;
+		if (tsdfx_scan_poll(std->task) > 0)
+			continue;
+		/* completed successfully, unless someone is waiting */
+		if (std->state == TASK_FINISHED &&
+		    !(std->flags & TSDFX_SCAN_COLLECT))
+			tsdfx_scan_reset(std->task);
+	}
 
-			tsdfx_scan_reset(t);
-			break;
-		case TASK_DEAD:
-		case TASK_FAILED:
-		case TASK_INVALID:
-			/* failed to start or died */
-			if (now >= std->lastran + tsdfx_reset_interval) {
-				NOTICE("resetting failed scan task for %s",
-				    std->path);
-				tsdfx_scan_reset(t);
-			}
-			break;
-		case TASK_STOPPED:
-			/* shouldn't happen */
-			ERROR("scan task in TASK_STOPPED state");
-			tsdfx_scan_reset(t);
-			break;
-		default:
-			/* unreachable */
-			break;
+	/* reap scanners we asked to stop, then reset or free them */
+	for (std = tsdfx_scan_stopping; std != NULL; std = stdn) {
+		stdn = std->rnext;
+		tsd_task_poll(std->task);
+		if (std->task->state == TASK_STOPPING)
+			continue;
+		if (std->deleted) {
+			tsdfx_scan_destroy(std);
+			continue;
 		}
-		t = tn;
+		tsdfx_scan_stopping_remove(std);
+		if (std->state == TASK_STOPPING)
+			tsdfx_scan_reset(std->task);
 	}
-	return (tsdfx_scan_tasks->nrunning);
+
+	/* failed to start or died */
+	while ((std = tsdfx_scan_heap_first(&tsdfx_scan_resets)) != NULL &&
+	    std->due <= now) {
+		NOTICE("resetting failed scan task for %s", std->path);
+		tsdfx_scan_reset(std->task);
+	}
+
+	/* start tasks which are due for as long as we have free slots */
+	while (tsdfx_scan_nrunning < tsdfx_scan_max_tasks &&
+	    (std = tsdfx_scan_heap_first(&tsdfx_scan_starts)) != NULL &&
+	    std->due <= now) {
+		if (tsdfx_scan_start(std->task) != 0)
+			WARNING("failed to start task: %s", strerror(errno));
+	}
+
+	return (tsdfx_scan_nrunning);
 }
 
 /*
@@ -785,6 +1671,7 @@ tsdfx_scan_sched(void)
 int
 tsdfx_scan_init(void)
 {
+	struct stat st;
 
 	if (tsdfx_scanner == NULL &&
 	    (tsdfx_scanner = getenv("TSDFX_SCANNER")) == NULL &&
@@ -794,8 +1681,11 @@ tsdfx_scan_init(void)
 		ERROR("failed to locate scanner child");
 		return (-1);
 	}
-	if (regcomp(&scan_regex, SCAN_REGEX, REG_EXTENDED|REG_NOSUB) != 0)
+	if (tsdfx_scan_indexdir != NULL &&
+	    (stat(tsdfx_scan_indexdir, &st) != 0 || !S_ISDIR(st.st_mode))) {
+		ERROR("%s: invalid index directory", tsdfx_scan_indexdir);
 		return (-1);
+	}
 	if ((tsdfx_scan_tasks = tsd_tset_create("tsdfx scanner")) == NULL)
 		return (-1);
 	if (tsdfx_scan_interval == 0)
@@ -815,6 +1705,11 @@ tsdfx_scan_exit(void)
 {
 	struct tsd_task *t, *tn;
 
+	/* ask all scanners to stop first so they can do so in parallel */
+	for (t = tsd_tset_first(tsdfx_scan_tasks); t != NULL;
+	     t = tsd_tset_next(tsdfx_scan_tasks, t))
+		if (t->state == TASK_RUNNING)
+			tsd_task_terminate(t);
 	t = tsd_tset_first(tsdfx_scan_tasks);
 	while (t != NULL) {
 		/* look ahead so we can safely delete dead tasks */
@@ -822,8 +1717,14 @@ tsdfx_scan_exit(void)
 		tsdfx_scan_delete(t);
 		t = tn;
 	}
+	/* this time, wait for them */
+	while (tsdfx_scan_stopping != NULL)
+		tsdfx_scan_destroy(tsdfx_scan_stopping);
 	tsd_tset_destroy(tsdfx_scan_tasks);
 	tsdfx_scan_tasks = NULL;
-	regfree(&scan_regex);
+	free(tsdfx_scan_starts.std);
+	free(tsdfx_scan_resets.std);
+	memset(&tsdfx_scan_starts, 0, sizeof tsdfx_scan_starts);
+	memset(&tsdfx_scan_resets, 0, sizeof tsdfx_scan_resets);
 	return (0);
 }
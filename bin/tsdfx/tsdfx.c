@@ -31,14 +31,28 @@
 # include "config.h"
 #endif
 
+#if HAVE_SYS_EPOLL_H && HAVE_SYS_SIGNALFD_H && HAVE_SYS_TIMERFD_H
+#define TSDFX_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#endif
+
+#include <errno.h>
 #include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <tsd/cred.h>
 #include <tsd/log.h>
+#include <tsd/task.h>
 
 #include "tsdfx_map.h"
 #include "tsdfx_scan.h"
 #include "tsdfx_copy.h"
+#include "tsdfx_watch.h"
 #include "tsdfx.h"
 
 int tsdfx_oneshot;
@@ -56,7 +70,6 @@ static struct {
 	{ .sig = SIGHUP },
 	{ .sig = SIGINT },
 	{ .sig = SIGQUIT },
-	{ .sig = SIGPIPE },
 	{ .sig = SIGALRM },
 	{ .sig = SIGTERM },
 	{ .sig = SIGUSR1 },
@@ -77,7 +90,6 @@ signal_handler(int sig)
 		break;
 	case SIGINT:
 	case SIGQUIT:
-	case SIGPIPE:
 	case SIGTERM:
 		killed = sig;
 		break;
@@ -86,6 +98,223 @@ signal_handler(int sig)
 	}
 }
 
+#if TSDFX_EPOLL
+
+/*
+ * Everything the main loop waits for: signals, the timer which fires
+ * when the next scan is due, and whatever file descriptors the
+ * subsystems ask us to listen to.
+ */
+static int tsdfx_epoll_fd = -1;
+static int tsdfx_signal_fd = -1;
+static int tsdfx_timer_fd = -1;
+static sigset_t tsdfx_sigset;
+
+static int
+tsdfx_epoll_add(int fd, uint32_t events)
+{
+	struct epoll_event ev;
+
+	if (tsdfx_epoll_fd < 0)
+		return (0);
+	memset(&ev, 0, sizeof ev);
+	ev.events = events;
+	ev.data.fd = fd;
+	if (epoll_ctl(tsdfx_epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0 &&
+	    errno != EEXIST)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Wake up the main loop when a file descriptor becomes readable or is
+ * closed at the other end.
+ */
+int
+tsdfx_listen(int fd)
+{
+
+	return (tsdfx_epoll_add(fd, EPOLLIN));
+}
+
+/*
+ * Wake up the main loop when a task's child terminates.  We only need
+ * to hear about that once, and the pidfd may outlive the child for a
+ * while in children we have forked but which have yet to exec, so it
+ * is registered for a single event.  Where we can't get a pidfd, fall
+ * back to SIGCHLD, which we have kept blocked so that it is still
+ * pending if the child is already gone.
+ */
+int
+tsdfx_listen_task(const struct tsd_task *t)
+{
+
+	if (t->pidfd >= 0)
+		return (tsdfx_epoll_add(t->pidfd, EPOLLIN|EPOLLONESHOT));
+	if (tsdfx_signal_fd < 0 || sigismember(&tsdfx_sigset, SIGCHLD))
+		return (0);
+	sigaddset(&tsdfx_sigset, SIGCHLD);
+	if (signalfd(tsdfx_signal_fd, &tsdfx_sigset, 0) < 0) {
+		sigdelset(&tsdfx_sigset, SIGCHLD);
+		return (-1);
+	}
+	VERBOSE("no pidfd, listening for SIGCHLD instead");
+	return (0);
+}
+
+/*
+ * Stop listening to a file descriptor.  Closing it has the same effect,
+ * unless a child we just forked still has a copy.
+ */
+void
+tsdfx_unlisten(int fd)
+{
+
+	if (tsdfx_epoll_fd >= 0 && fd >= 0)
+		epoll_ctl(tsdfx_epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/*
+ * Set up the epoll set and the timer.
+ */
+static int
+tsdfx_event_init(void)
+{
+
+	if ((tsdfx_epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+	    (tsdfx_timer_fd = timerfd_create(CLOCK_REALTIME,
+	    TFD_NONBLOCK|TFD_CLOEXEC)) < 0 ||
+	    tsdfx_listen(tsdfx_timer_fd) != 0) {
+		ERROR("failed to set up event loop: %s", strerror(errno));
+		return (-1);
+	}
+	return (0);
+}
+
+static void
+tsdfx_event_exit(void)
+{
+
+	if (tsdfx_timer_fd >= 0)
+		close(tsdfx_timer_fd);
+	if (tsdfx_epoll_fd >= 0)
+		close(tsdfx_epoll_fd);
+	tsdfx_timer_fd = tsdfx_epoll_fd = -1;
+}
+
+/*
+ * Block the signals we care about and have them delivered through a
+ * signalfd instead.  SIGCHLD is blocked as well, but only read if
+ * tsdfx_listen_task() finds that it needs it.  This must be done after
+ * daemonizing, since a signalfd only wakes up epoll for signals sent to
+ * the process which registered it.
+ */
+static int
+tsdfx_event_signals(sigset_t *oldset)
+{
+	sigset_t sigset;
+	unsigned int i;
+
+	sigemptyset(&tsdfx_sigset);
+	for (i = 0; signals[i].sig != 0; ++i)
+		sigaddset(&tsdfx_sigset, signals[i].sig);
+	sigset = tsdfx_sigset;
+	sigaddset(&sigset, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &sigset, oldset) != 0)
+		return (-1);
+	if ((tsdfx_signal_fd = signalfd(-1, &tsdfx_sigset,
+	    SFD_NONBLOCK|SFD_CLOEXEC)) < 0 ||
+	    tsdfx_listen(tsdfx_signal_fd) != 0) {
+		ERROR("failed to set up signal handling: %s", strerror(errno));
+		if (tsdfx_signal_fd >= 0)
+			close(tsdfx_signal_fd);
+		tsdfx_signal_fd = -1;
+		sigprocmask(SIG_SETMASK, oldset, NULL);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Wait until something happens, the next scan is due, an idle copier
+ * is due to be retired, or it is time to insist that a child we asked
+ * to stop does so.
+ */
+static void
+tsdfx_event_wait(void)
+{
+	struct epoll_event ev[16];
+	struct signalfd_siginfo ssi;
+	struct itimerspec its;
+	struct timespec now;
+	uint64_t expired;
+	long long stopat, ms;
+	time_t when;
+	int i, n, timeout;
+
+	memset(&its, 0, sizeof its);
+	its.it_value.tv_sec = tsdfx_scan_next();
+	if ((when = tsdfx_copy_next()) > 0 &&
+	    (its.it_value.tv_sec == 0 || when < its.it_value.tv_sec))
+		its.it_value.tv_sec = when;
+	if (timerfd_settime(tsdfx_timer_fd, TFD_TIMER_ABSTIME, &its, NULL) != 0)
+		WARNING("timerfd_settime(): %s", strerror(errno));
+	timeout = -1;
+	stopat = tsdfx_scan_stopat();
+	if ((ms = tsdfx_copy_stopat()) > 0 && (stopat == 0 || ms < stopat))
+		stopat = ms;
+	if (stopat > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ms = stopat - ((long long)now.tv_sec * 1000 +
+		    now.tv_nsec / 1000000);
+		timeout = ms > 0 ? (int)ms : 0;
+	}
+	if ((n = epoll_wait(tsdfx_epoll_fd, ev, 16, timeout)) < 0) {
+		if (errno != EINTR) {
+			WARNING("epoll_wait(): %s", strerror(errno));
+			usleep(100 * 1000);
+		}
+		return;
+	}
+	for (i = 0; i < n; ++i) {
+		if (ev[i].data.fd == tsdfx_signal_fd) {
+			while (read(tsdfx_signal_fd, &ssi, sizeof ssi) ==
+			    (ssize_t)sizeof ssi)
+				signal_handler((int)ssi.ssi_signo);
+		} else if (ev[i].data.fd == tsdfx_timer_fd) {
+			(void)read(tsdfx_timer_fd, &expired, sizeof expired);
+		}
+		/* anything else is for the next pass to deal with */
+	}
+}
+
+#else
+
+int
+tsdfx_listen(int fd)
+{
+
+	(void)fd;
+	return (0);
+}
+
+int
+tsdfx_listen_task(const struct tsd_task *t)
+{
+
+	(void)t;
+	return (0);
+}
+
+void
+tsdfx_unlisten(int fd)
+{
+
+	(void)fd;
+}
+
+#endif
+
 /*
  * Initialization
  */
@@ -94,10 +323,16 @@ tsdfx_init(const char *mapfile)
 {
 
 	NOTICE("tsdfx starting");
+#if TSDFX_EPOLL
+	if (tsdfx_event_init() != 0)
+		return (-1);
+#endif
 	if (tsdfx_copy_init() != 0)
 		return (-1);
 	if (tsdfx_scan_init() != 0)
 		return (-1);
+	if (tsdfx_watch_init() != 0)
+		return (-1);
 	if (tsdfx_map_init() != 0)
 		return (-1);
 	if (tsdfx_map_reload(mapfile) != 0)
@@ -111,9 +346,18 @@ tsdfx_init(const char *mapfile)
 int
 tsdfx_exit(void)
 {
+	unsigned long hits, misses;
+
 	tsdfx_map_exit();
 	tsdfx_scan_exit();
+	tsdfx_watch_exit();
 	tsdfx_copy_exit();
+#if TSDFX_EPOLL
+	tsdfx_event_exit();
+#endif
+	tsd_cred_stats(&hits, &misses);
+	VERBOSE("credential cache: %lu hits, %lu misses", hits, misses);
+	tsd_cred_flush();
 	NOTICE("tsdfx stopping");
 	return (0);
 }
@@ -121,40 +365,75 @@ tsdfx_exit(void)
 int
 tsdfx_run(const char *mapfile)
 {
-	int scan_running, copy_running;
+	void (*sigpipe)(int);
+	int scan_running, map_waiting, copy_running;
+#if TSDFX_EPOLL
+	sigset_t oldset;
+#else
 	unsigned int i;
+#endif
 
 	killed = 0;
+	/*
+	 * If a child dies, we want to find out from write() rather than
+	 * be killed when we next try to feed it.
+	 */
+	sigpipe = signal(SIGPIPE, SIG_IGN);
+#if TSDFX_EPOLL
+	if (tsdfx_event_signals(&oldset) != 0) {
+		signal(SIGPIPE, sigpipe);
+		return (-1);
+	}
+#else
 	for (i = 0; signals[i].sig != 0; ++i)
 		signals[i].old = signal(signals[i].sig, signal_handler);
+#endif
 	while (!killed) {
 		/* check for sighup */
 		if (sighup) {
 			sighup = 0;
 			if (tsdfx_map_reload(mapfile) != 0)
 				WARNING("failed to reload map file");
+			/* pick up changes to users and groups as well */
+			tsd_cred_flush();
 		}
 
+		/* rush scan tasks for trees which have changed */
+		tsdfx_watch_sched();
+
 		/* start and run scan tasks */
 		scan_running = tsdfx_scan_sched();
 
 		/* check scan tasks and create copy tasks as needed */
-		tsdfx_map_sched();
+		map_waiting = tsdfx_map_sched();
 
 		/* start and run copy tasks */
 		copy_running = tsdfx_copy_sched();
 
 		/* in oneshot mode, are we done? */
-		if (tsdfx_oneshot && scan_running == 0 && copy_running == 0)
+		if (tsdfx_oneshot && scan_running == 0 && map_waiting == 0 &&
+		    copy_running == 0)
 			break;
 
+		/* wait for something to do */
+#if TSDFX_EPOLL
+		tsdfx_event_wait();
+#else
 		usleep(100 * 1000);
+#endif
 	}
 	if (killed)
 		VERBOSE("received signal %d", (int)killed);
 	else
 		VERBOSE("all work completed in one-shot mode");
+#if TSDFX_EPOLL
+	close(tsdfx_signal_fd);
+	tsdfx_signal_fd = -1;
+	sigprocmask(SIG_SETMASK, &oldset, NULL);
+#else
 	for (i = 0; signals[i].sig != 0; ++i)
 		signal(signals[i].sig, signals[i].old);
+#endif
+	signal(SIGPIPE, sigpipe);
 	return (killed);
 }
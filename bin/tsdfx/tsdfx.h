@@ -30,14 +30,21 @@
 #ifndef TSDFX_H_INCLUDED
 #define TSDFX_H_INCLUDED
 
+#include <sys/types.h>
+
 #include <time.h>
 
 #include <tsd/log.h>
 #define tsdfx_verbose tsd_log_verbose
 
+struct tsd_task;
+
 int tsdfx_init(const char *);
 int tsdfx_run(const char *);
 int tsdfx_exit(void);
+int tsdfx_listen(int);
+int tsdfx_listen_task(const struct tsd_task *);
+void tsdfx_unlisten(int);
 
 extern int tsdfx_dryrun;
 extern int tsdfx_oneshot;
@@ -49,7 +56,17 @@ extern unsigned int tsdfx_scan_interval;
 extern unsigned int tsdfx_reset_interval;
 
 extern time_t tsdfx_copy_purgeperiod;
+extern const char *tsdfx_copy_classes;
+extern unsigned int tsdfx_copy_max_tasks;
+extern unsigned int tsdfx_copy_batch_size;
+extern time_t tsdfx_copy_keepalive;
+extern unsigned int tsdfx_copy_maxjobs;
 
 extern unsigned long tsdfx_maxfiles;
+extern unsigned int tsdfx_scan_threads;
+extern const char *tsdfx_scan_indexdir;
+extern int tsdfx_scan_records;
+extern int tsdfx_scan_persistent;
+extern int tsdfx_map_diff;
 
 #endif
@@ -30,14 +30,28 @@
 #ifndef TSDFX_COPY_H_INCLUDED
 #define TSDFX_COPY_H_INCLUDED
 
+struct stat;
 struct tsd_task;
 
-struct tsd_task *tsdfx_copy_new(const char *, const char *);
+struct tsd_task *tsdfx_copy_new(const char *, const char *,
+    unsigned long long, unsigned int);
 
 int tsdfx_copy_sched(void);
+time_t tsdfx_copy_next(void);
+long long tsdfx_copy_stopat(void);
 int tsdfx_copy_init(void);
 int tsdfx_copy_exit(void);
 
-int tsdfx_copy_wrap(const char *, const char *, const char *);
+/* what tsdfx_copy_wrap() and tsdfx_copy_sync() decided to do */
+#define TSDFX_COPY_INSYNC	0	/* nothing */
+#define TSDFX_COPY_NEW		1	/* copy, destination does not exist */
+#define TSDFX_COPY_CHANGED	2	/* copy, destination is out of date */
+#define TSDFX_COPY_PURGE	3	/* purge source */
+#define TSDFX_COPY_QUEUED	4	/* nothing, already queued */
+
+int tsdfx_copy_wrap(const char *, const char *, const char *,
+    const struct stat *, unsigned int);
+int tsdfx_copy_sync(const char *, const char *, const char *,
+    const struct stat *, const struct stat *, unsigned int);
 
 #endif
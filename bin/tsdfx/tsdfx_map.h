@@ -30,10 +30,12 @@
 #ifndef TSDFX_MAP_H_INCLUDED
 #define TSDFX_MAP_H_INCLUDED
 
+struct stat;
 struct tsdfx_map;
 
 int tsdfx_map_reload(const char *);
-int tsdfx_map_process(struct tsdfx_map *, const char *);
+int tsdfx_map_process(struct tsdfx_map *, const char *, const struct stat *);
+int tsdfx_map_inodeorder(const struct tsdfx_map *);
 int tsdfx_map_sched(void);
 int tsdfx_map_init(void);
 int tsdfx_map_exit(void);
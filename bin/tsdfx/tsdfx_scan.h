@@ -30,18 +30,37 @@
 #ifndef TSDFX_SCAN_H_INCLUDED
 #define TSDFX_SCAN_H_INCLUDED
 
+#include <sys/stat.h>
+
 struct tsd_task;
 
-struct tsd_task *tsdfx_scan_new(struct tsdfx_map *, const char *);
+/* keep the results for tsdfx_scan_listing() instead of processing them */
+#define TSDFX_SCAN_COLLECT	0x01
+/* scanning a destination: only when rushed, and keep errors to ourselves */
+#define TSDFX_SCAN_DEST		0x02
+
+/* an entry in the listing produced by a collecting scan task */
+struct tsdfx_scan_entry {
+	char *path;
+	struct stat st;
+	int known;		/* st is valid */
+};
+
+struct tsd_task *tsdfx_scan_new(struct tsdfx_map *, const char *, int);
 void tsdfx_scan_delete(struct tsd_task *);
 int tsdfx_scan_reset(struct tsd_task *);
 int tsdfx_scan_rush(struct tsd_task *);
+int tsdfx_scan_notify(struct tsd_task *, const char *);
 
 int tsdfx_scan_sched(void);
+time_t tsdfx_scan_next(void);
+long long tsdfx_scan_stopat(void);
 int tsdfx_scan_init(void);
 int tsdfx_scan_exit(void);
 
 enum tsd_task_state tsdfx_scan_state(const struct tsd_task *);
 const char *tsdfx_scan_result(const struct tsd_task *);
+size_t tsdfx_scan_listing(const struct tsd_task *,
+    const struct tsdfx_scan_entry **);
 
 #endif
@@ -0,0 +1,352 @@
+/*-
+ * Copyright (c) 2026 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+
+#if HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <tsd/log.h>
+#include <tsd/task.h>
+
+#include "tsdfx.h"
+#include "tsdfx_map.h"
+#include "tsdfx_scan.h"
+#include "tsdfx_watch.h"
+
+/*
+ * Interval between full scans of watched trees, or 0 if watching is
+ * disabled.
+ */
+unsigned int tsdfx_watch_interval;
+
+#if HAVE_SYS_INOTIFY_H
+
+/*
+ * Events which indicate that something needs to be copied.  Removals
+ * are not interesting, and a file which is being written to will
+ * trigger IN_CLOSE_WRITE once the writer is done, so we only care about
+ * IN_CREATE for directories.
+ */
+#define WATCH_EVENTS \
+	(IN_CREATE|IN_MOVED_TO|IN_CLOSE_WRITE|IN_ATTRIB|IN_DONT_FOLLOW|IN_ONLYDIR)
+
+/*
+ * Map from watch descriptor to scan task and directory relative to the
+ * root of the tree, sorted by watch descriptor.
+ */
+struct tsdfx_watch {
+	int wd;
+	struct tsd_task *task;
+	char *dir;
+};
+
+static int tsdfx_watch_fd = -1;
+static struct tsdfx_watch *tsdfx_watches;
+static size_t tsdfx_nwatches, tsdfx_watches_size;
+
+/*
+ * Look up a watch descriptor.  Returns the index of the matching entry,
+ * or the index at which it should be inserted.
+ */
+static size_t
+tsdfx_watch_find(int wd)
+{
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = tsdfx_nwatches;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (tsdfx_watches[mid].wd < wd)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+/*
+ * Start watching a directory on behalf of a scan task.  The directory's
+ * full path is given first, followed by its path relative to the root
+ * of the tree, without a trailing slash.  Watching a directory which is
+ * already being watched is harmless, so the scan task can simply call
+ * this for every directory it comes across.  Returns 1 if the directory
+ * was not already being watched, 0 if it was, and -1 on error.
+ *
+ * Only the last component of the path is checked for symbolic links.
+ * The worst that can happen if someone replaces an intermediate
+ * directory with a link is that we rescan when we don't need to.
+ */
+int
+tsdfx_watch_add(struct tsd_task *t, const char *path, const char *dir)
+{
+	struct tsdfx_watch *tw;
+	size_t i, size;
+	char *p;
+	int wd;
+
+	if (tsdfx_watch_fd < 0) {
+		errno = ENOSYS;
+		return (-1);
+	}
+	if ((wd = inotify_add_watch(tsdfx_watch_fd, path, WATCH_EVENTS)) < 0)
+		return (-1);
+	i = tsdfx_watch_find(wd);
+	if (i < tsdfx_nwatches && tsdfx_watches[i].wd == wd) {
+		/* already watching, but it may have been renamed */
+		tw = &tsdfx_watches[i];
+		tw->task = t;
+		if (strcmp(tw->dir, dir) != 0) {
+			if ((p = strdup(dir)) == NULL)
+				return (-1);
+			free(tw->dir);
+			tw->dir = p;
+		}
+		return (0);
+	}
+	if ((p = strdup(dir)) == NULL)
+		goto fail;
+	if (tsdfx_nwatches == tsdfx_watches_size) {
+		size = tsdfx_watches_size ? tsdfx_watches_size * 2 : 256;
+		if ((tw = realloc(tsdfx_watches, size * sizeof *tw)) == NULL)
+			goto fail;
+		tsdfx_watches = tw;
+		tsdfx_watches_size = size;
+	}
+	memmove(tsdfx_watches + i + 1, tsdfx_watches + i,
+	    (tsdfx_nwatches - i) * sizeof *tsdfx_watches);
+	tsdfx_watches[i].wd = wd;
+	tsdfx_watches[i].task = t;
+	tsdfx_watches[i].dir = p;
+	tsdfx_nwatches++;
+	return (1);
+fail:
+	free(p);
+	inotify_rm_watch(tsdfx_watch_fd, wd);
+	return (-1);
+}
+
+/*
+ * Stop watching all directories watched on behalf of a scan task.
+ */
+void
+tsdfx_watch_remove(struct tsd_task *t)
+{
+	size_t i, j;
+
+	for (i = j = 0; i < tsdfx_nwatches; ++i) {
+		if (tsdfx_watches[i].task == t) {
+			inotify_rm_watch(tsdfx_watch_fd, tsdfx_watches[i].wd);
+			free(tsdfx_watches[i].dir);
+		} else {
+			tsdfx_watches[j++] = tsdfx_watches[i];
+		}
+	}
+	tsdfx_nwatches = j;
+}
+
+/*
+ * Forget a watch which the kernel has already removed.
+ */
+static void
+tsdfx_watch_forget(int wd)
+{
+	size_t i;
+
+	i = tsdfx_watch_find(wd);
+	if (i < tsdfx_nwatches && tsdfx_watches[i].wd == wd) {
+		free(tsdfx_watches[i].dir);
+		memmove(tsdfx_watches + i, tsdfx_watches + i + 1,
+		    (tsdfx_nwatches - i - 1) * sizeof *tsdfx_watches);
+		tsdfx_nwatches--;
+	}
+}
+
+/*
+ * Process a single event.  Files are handed straight to the scan task,
+ * while changes to directories require a rescan.
+ */
+static void
+tsdfx_watch_event(const struct inotify_event *ev)
+{
+	const struct tsdfx_watch *tw;
+	char path[PATH_MAX];
+	size_t i;
+
+	i = tsdfx_watch_find(ev->wd);
+	if (i == tsdfx_nwatches || tsdfx_watches[i].wd != ev->wd)
+		return;
+	tw = &tsdfx_watches[i];
+	if (ev->len == 0 || (ev->mask & IN_ISDIR)) {
+		tsdfx_scan_rush(tw->task);
+	} else if (ev->mask & (IN_CLOSE_WRITE|IN_MOVED_TO|IN_ATTRIB)) {
+		if (snprintf(path, sizeof path, "%s/%s", tw->dir, ev->name) >=
+		    (int)sizeof path)
+			tsdfx_scan_rush(tw->task);
+		else
+			tsdfx_scan_notify(tw->task, path);
+	}
+}
+
+/*
+ * Read and process pending events.  If the kernel's event queue
+ * overflowed, we have no idea what changed, so rush every task we are
+ * watching for.
+ */
+int
+tsdfx_watch_sched(void)
+{
+	union {
+		struct inotify_event ev;
+		char buf[16384];
+	} u;
+	const struct inotify_event *ev;
+	ssize_t len;
+	size_t i;
+	int overflow;
+	char *p;
+
+	if (tsdfx_watch_fd < 0)
+		return (0);
+	overflow = 0;
+	while ((len = read(tsdfx_watch_fd, u.buf, sizeof u.buf)) > 0) {
+		for (p = u.buf; p < u.buf + len; p += sizeof *ev + ev->len) {
+			ev = (const struct inotify_event *)(void *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				overflow = 1;
+			} else if (ev->mask & IN_IGNORED) {
+				tsdfx_watch_forget(ev->wd);
+			} else {
+				tsdfx_watch_event(ev);
+			}
+		}
+	}
+	if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+		ERROR("inotify: %s", strerror(errno));
+		return (-1);
+	}
+	if (overflow) {
+		WARNING("inotify event queue overflow");
+		for (i = 0; i < tsdfx_nwatches; ++i)
+			tsdfx_scan_rush(tsdfx_watches[i].task);
+	}
+	return (0);
+}
+
+/*
+ * Initialize the watching subsystem.
+ */
+int
+tsdfx_watch_init(void)
+{
+
+	if (tsdfx_watch_interval == 0)
+		return (0);
+	if ((tsdfx_watch_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) < 0 ||
+	    tsdfx_listen(tsdfx_watch_fd) != 0) {
+		ERROR("inotify: %s", strerror(errno));
+		return (-1);
+	}
+	return (0);
+}
+
+int
+tsdfx_watch_exit(void)
+{
+
+	tsdfx_unlisten(tsdfx_watch_fd);
+	if (tsdfx_watch_fd >= 0)
+		close(tsdfx_watch_fd);
+	tsdfx_watch_fd = -1;
+	while (tsdfx_nwatches > 0)
+		free(tsdfx_watches[--tsdfx_nwatches].dir);
+	free(tsdfx_watches);
+	tsdfx_watches = NULL;
+	tsdfx_nwatches = tsdfx_watches_size = 0;
+	return (0);
+}
+
+#else
+
+int
+tsdfx_watch_add(struct tsd_task *t, const char *path, const char *dir)
+{
+
+	(void)t;
+	(void)path;
+	(void)dir;
+	errno = ENOSYS;
+	return (-1);
+}
+
+void
+tsdfx_watch_remove(struct tsd_task *t)
+{
+
+	(void)t;
+}
+
+int
+tsdfx_watch_sched(void)
+{
+
+	return (0);
+}
+
+int
+tsdfx_watch_init(void)
+{
+
+	if (tsdfx_watch_interval == 0)
+		return (0);
+	ERROR("change notification is not supported on this platform");
+	return (-1);
+}
+
+int
+tsdfx_watch_exit(void)
+{
+
+	return (0);
+}
+
+#endif
@@ -32,5 +32,10 @@
 
 uint8_t tsd_hash(const void *, size_t);
 uint8_t tsd_strhash(const char *);
+uint64_t tsd_strhash64(const char *);
+
+#define TSD_STRHASH64_INIT	0xcbf29ce484222325ULL
+uint64_t tsd_strhash64_update(uint64_t, const char *);
+uint64_t tsd_strhash64_final(uint64_t);
 
 #endif
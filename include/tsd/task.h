@@ -30,6 +30,8 @@
 #ifndef TSD_TASK_H_INCLUDED
 #define TSD_TASK_H_INCLUDED
 
+#include <stdint.h>
+
 enum tsd_task_state {
 	TASK_INVALID	 = -1,	/* really screwed */
 	TASK_IDLE	 =  0,	/* idle */
@@ -58,9 +60,9 @@ enum tsd_task_state {
 typedef void (tsd_task_func)(void *);
 
 struct tsd_task {
-	/* unique name */
+	/* unique name, and the hash under which the task is indexed */
 	char			 name[64];
-	unsigned int		 h;
+	uint64_t		 h;
 
 	/* state */
 	enum tsd_task_state	 state;
@@ -75,16 +77,27 @@ struct tsd_task {
 	/* child process */
 	tsd_task_func		*func;
 	pid_t			 pid;
+	int			 pidfd;
 	int			 status;
+	int			 stopstep;
+	long long		 stopat;
 	int			 pin;
 	int			 pout;
 	int			 perr;
 
 	/* task set and queue */
 	struct tsd_tset		*set;
-	struct tsd_task		*snext;
+	unsigned int		 sidx;
+	struct tsd_task		*sprev, *snext;
 	struct tsd_tqueue	*queue;
 	struct tsd_task		*qprev, *qnext;
+	int			 qidle;
+
+	/* fair queuing: group, its weight, and the owner's flow */
+	unsigned long long	 qgroup;
+	unsigned int		 qweight;
+	struct tsd_tflow	*qflow;
+	struct tsd_task		*fprev, *fnext;
 
 	/* user data */
 	void			*ud;
@@ -92,26 +105,54 @@ struct tsd_task {
 
 struct tsd_tset {
 	char			 name[64];
-	struct tsd_task		*tasks[256];
+	struct tsd_task		**tasks;
+	struct tsd_task		*first, *last;
+	unsigned int		 size;
+	unsigned int		 nused;
 	unsigned int		 ntasks;
 	unsigned int		 nrunning;
 };
 
+/*
+ * Idle tasks in a queue are grouped first by qgroup, then by owner.
+ * Active flows at each level form a ring, served in deficit round-robin
+ * order starting with the current flow.  All active flows are also
+ * indexed by group and owner in a hash table in the queue.
+ */
+struct tsd_tflow {
+	unsigned long long	 key;
+	uint64_t		 h;
+	unsigned int		 weight;
+	int			 deficit;
+	struct tsd_tflow	*parent;
+	struct tsd_tflow	*prev, *next;		/* peers */
+	struct tsd_tflow	*cur;			/* children */
+	struct tsd_task		*first, *last;		/* idle tasks */
+};
+
 struct tsd_tqueue {
 	char			 name[64];
 	unsigned int		 max_running;
-	struct tsd_task		*first, *last;
+	struct tsd_task		*first, *last;		/* idle */
+	struct tsd_task		*rfirst, *rlast;	/* started */
+	struct tsd_tflow	*cur, *lastflow;	/* idle, by flow */
+	struct tsd_tflow	**flows;		/* flow index */
+	unsigned int		 fsize;
+	unsigned int		 nflows;
 	unsigned int		 ntasks;
+	unsigned int		 nidle;
 	unsigned int		 nrunning;
 };
 
 struct tsd_task *tsd_task_create(const char *, tsd_task_func *, void *);
 int tsd_task_setuser(struct tsd_task *, const char *);
+int tsd_task_setuid(struct tsd_task *, uid_t);
 int tsd_task_setcred(struct tsd_task *, uid_t, gid_t *, int);
 int tsd_task_setegid(struct tsd_task *, gid_t);
 void tsd_task_destroy(struct tsd_task *);
 int tsd_task_start(struct tsd_task *);
 int tsd_task_stop(struct tsd_task *);
+int tsd_task_terminate(struct tsd_task *);
 int tsd_task_signal(const struct tsd_task *, int);
 int tsd_task_reset(struct tsd_task *);
 int tsd_task_poll(struct tsd_task *);
@@ -121,6 +162,8 @@ void tsd_tset_destroy(struct tsd_tset *);
 int tsd_tset_insert(struct tsd_tset *, struct tsd_task *);
 int tsd_tset_remove(struct tsd_tset *, struct tsd_task *);
 struct tsd_task *tsd_tset_find(const struct tsd_tset *, const char *);
+struct tsd_task *tsd_tset_match(const struct tsd_tset *, uint64_t,
+    int (*)(const struct tsd_task *, const void *), const void *);
 struct tsd_task *tsd_tset_first(const struct tsd_tset *);
 struct tsd_task *tsd_tset_next(const struct tsd_tset *, const struct tsd_task *);
 int tsd_tset_signal(const struct tsd_tset *, int);
@@ -129,6 +172,8 @@ struct tsd_tqueue *tsd_tqueue_create(const char *, unsigned int);
 void tsd_tqueue_destroy(struct tsd_tqueue *);
 int tsd_tqueue_insert(struct tsd_tqueue *, struct tsd_task *);
 int tsd_tqueue_remove(struct tsd_tqueue *, struct tsd_task *);
+struct tsd_task *tsd_tqueue_next(struct tsd_tqueue *);
+int tsd_tqueue_start(struct tsd_tqueue *);
 unsigned int tsd_tqueue_sched(struct tsd_tqueue *);
 void tsd_tqueue_drain(struct tsd_tqueue *);
 
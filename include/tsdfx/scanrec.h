@@ -0,0 +1,66 @@
+/*-
+ * Copyright (c) 2026 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef TSDFX_SCANREC_H_INCLUDED
+#define TSDFX_SCANREC_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+ * Record emitted by the scanner for each file or directory it finds
+ * when asked to report metadata along with the name.  The scanner and
+ * the master always run on the same host, so all fields are in host
+ * byte order.  The header is immediately followed by the path, in the
+ * same form as in the scanner's text output, without a terminating NUL.
+ */
+struct tsdfx_scanrec {
+	uint32_t	 len;		/* header plus path */
+	uint32_t	 mode;		/* type and permissions */
+	uint64_t	 size;
+	int64_t		 mtime;
+	int64_t		 atime;
+	uint32_t	 mtime_nsec;
+	uint32_t	 atime_nsec;
+	uint64_t	 ino;
+	uint64_t	 dev;
+};
+
+/*
+ * A persistent scanner marks the end of each scan with a record which
+ * has no path and a mode of zero if the scan succeeded or non-zero if
+ * it failed.  In text mode, it prints a line consisting solely of one
+ * of these instead.
+ */
+#define TSDFX_SCAN_DONE		"."
+#define TSDFX_SCAN_FAILED	"!"
+
+/* upper limit on the number of scanner worker threads */
+#define TSDFX_SCAN_MAX_THREADS	64
+
+#endif
@@ -0,0 +1,196 @@
+/*-
+ * Copyright (c) 2026 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <tsd/cred.h>
+#include <tsd/strutil.h>
+
+/*
+ * Users' credentials are kept in a hash table indexed by UID, so that
+ * we don't have to go to the name service, which may well be backed by
+ * a directory server, every time we create a task.  UIDs which do not
+ * correspond to any user are cached as well, but for a shorter time,
+ * since they are often those of files belonging to a user who has not
+ * been created yet.  Failures other than a missing user are assumed to
+ * be transient and are not cached.
+ */
+#define TSD_CRED_BUCKETS	256
+
+struct tsd_cred_entry {
+	uid_t			 uid;
+	int			 error;		/* 0 or ENOENT */
+	time_t			 expires;
+	struct tsd_cred		 cred;
+	struct tsd_cred_entry	*next;
+};
+
+static struct tsd_cred_entry *tsd_cred_table[TSD_CRED_BUCKETS];
+static time_t tsd_cred_ttl = 300;
+static time_t tsd_cred_negttl = 60;
+static unsigned long tsd_cred_hits;
+static unsigned long tsd_cred_misses;
+
+/*
+ * Look up a user's name and group list in the name service.
+ */
+static int
+tsd_cred_fetch(uid_t uid, struct tsd_cred *cred)
+{
+	struct passwd *pwd;
+
+	errno = 0;
+	if ((pwd = getpwuid(uid)) == NULL) {
+		/* see getpwuid(3) for why this is so complicated */
+		if (errno == 0 || errno == ESRCH || errno == EBADF ||
+		    errno == EPERM)
+			errno = ENOENT;
+		return (-1);
+	}
+	if (strlcpy(cred->user, pwd->pw_name, sizeof cred->user) >=
+	    sizeof cred->user) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	cred->uid = pwd->pw_uid;
+	cred->ngids = sizeof cred->gids / sizeof cred->gids[0];
+	if (getgrouplist(pwd->pw_name, pwd->pw_gid, cred->gids,
+	    &cred->ngids) < 0) {
+		errno = ERANGE;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Look up the credentials of the user with the given UID, preferably in
+ * the cache.  Returns 0 and fills in the credentials if the user
+ * exists, or -1 and sets errno to ENOENT if not.
+ */
+int
+tsd_cred_lookup(uid_t uid, struct tsd_cred *cred)
+{
+	struct tsd_cred_entry **bucket, *e;
+	struct tsd_cred tmp;
+	time_t now, ttl;
+	int error;
+
+	now = time(NULL);
+	bucket = &tsd_cred_table[uid % TSD_CRED_BUCKETS];
+	for (e = *bucket; e != NULL; e = e->next)
+		if (e->uid == uid)
+			break;
+	if (e != NULL && e->expires > now) {
+		tsd_cred_hits++;
+		if (e->error != 0) {
+			errno = e->error;
+			return (-1);
+		}
+		*cred = e->cred;
+		return (0);
+	}
+	tsd_cred_misses++;
+	memset(&tmp, 0, sizeof tmp);
+	error = tsd_cred_fetch(uid, &tmp) == 0 ? 0 : errno;
+	if (error != 0 && error != ENOENT)
+		return (-1);
+	ttl = error == 0 ? tsd_cred_ttl : tsd_cred_negttl;
+	if (e == NULL && ttl > 0 && (e = calloc(1, sizeof *e)) != NULL) {
+		e->uid = uid;
+		e->next = *bucket;
+		*bucket = e;
+	}
+	if (e != NULL) {
+		e->error = error;
+		e->expires = now + ttl;
+		e->cred = tmp;
+	}
+	if (error != 0) {
+		errno = error;
+		return (-1);
+	}
+	*cred = tmp;
+	return (0);
+}
+
+/*
+ * Forget everything we know.
+ */
+void
+tsd_cred_flush(void)
+{
+	struct tsd_cred_entry *e;
+	unsigned int i;
+
+	for (i = 0; i < TSD_CRED_BUCKETS; ++i) {
+		while ((e = tsd_cred_table[i]) != NULL) {
+			tsd_cred_table[i] = e->next;
+			free(e);
+		}
+	}
+}
+
+/*
+ * Set the time for which credentials are cached, and that for which the
+ * absence of a user is cached.  Zero disables caching.  Entries cached
+ * under the old settings are discarded.
+ */
+void
+tsd_cred_setttl(time_t ttl, time_t negttl)
+{
+
+	tsd_cred_flush();
+	tsd_cred_ttl = ttl;
+	tsd_cred_negttl = negttl;
+}
+
+/*
+ * Report the number of lookups which were and were not answered from
+ * the cache.
+ */
+void
+tsd_cred_stats(unsigned long *hits, unsigned long *misses)
+{
+
+	if (hits != NULL)
+		*hits = tsd_cred_hits;
+	if (misses != NULL)
+		*misses = tsd_cred_misses;
+}
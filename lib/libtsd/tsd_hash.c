@@ -97,3 +97,41 @@ tsd_strhash(const char *str)
 		h = T[h ^ (uint8_t)*str];
 	return (h);
 }
+
+/*
+ * 64-bit FNV-1a, with the MurmurHash3 finalizer to spread the entropy
+ * from the last few characters, which is where names tend to differ,
+ * across all the bits.  The hash of several strings strung together
+ * can be computed without actually stringing them together by feeding
+ * them to tsd_strhash64_update() one by one.
+ */
+uint64_t
+tsd_strhash64_update(uint64_t h, const char *str)
+{
+
+	for (; *str != '\0'; ++str) {
+		h ^= (uint8_t)*str;
+		h *= 0x100000001b3ULL;
+	}
+	return (h);
+}
+
+uint64_t
+tsd_strhash64_final(uint64_t h)
+{
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return (h);
+}
+
+uint64_t
+tsd_strhash64(const char *str)
+{
+
+	return (tsd_strhash64_final(tsd_strhash64_update(TSD_STRHASH64_INIT,
+	    str)));
+}
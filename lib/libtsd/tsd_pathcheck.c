@@ -0,0 +1,102 @@
+/*-
+ * Copyright (c) 2026 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stddef.h>
+
+#include <tsd/pathcheck.h>
+
+/*
+ * Paths are validated by a deterministic finite automaton equivalent to
+ * the regular expression
+ *
+ *   ^(/[0-9A-Za-z_-]([ 0-9A-Za-z._-]*[0-9A-Za-z._-])?)+/?$
+ *
+ * Each input byte is first mapped to a character class, then the class
+ * and the current state select the next state.  There is no
+ * backtracking, and we give up as soon as the input can no longer match.
+ */
+
+/* character classes */
+#define O	0		/* anything else */
+#define S	1		/* slash */
+#define F	2		/* may start a component: [0-9A-Za-z_-] */
+#define D	3		/* period */
+#define W	4		/* space */
+#define NCLASSES	5
+
+static const unsigned char tsd_pathcheck_class[256] = {
+	O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O,	/* 0x00 */
+	O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O,	/* 0x10 */
+	W, O, O, O, O, O, O, O, O, O, O, O, O, F, D, S,	/* 0x20 */
+	F, F, F, F, F, F, F, F, F, F, O, O, O, O, O, O,	/* 0x30 */
+	O, F, F, F, F, F, F, F, F, F, F, F, F, F, F, F,	/* 0x40 */
+	F, F, F, F, F, F, F, F, F, F, F, O, O, O, O, F,	/* 0x50 */
+	O, F, F, F, F, F, F, F, F, F, F, F, F, F, F, F,	/* 0x60 */
+	F, F, F, F, F, F, F, F, F, F, F, O, O, O, O, O,	/* 0x70 */
+	/* 0x80 - 0xff are all O */
+};
+
+/* states */
+enum {
+	START,			/* nothing yet */
+	ROOT,			/* leading slash */
+	NAME,			/* in a component which may end here */
+	SPACE,			/* in a component which may not end here */
+	SLASH,			/* slash following a component */
+	FAIL,			/* no match */
+	NSTATES
+};
+
+static const unsigned char tsd_pathcheck_next[NSTATES][NCLASSES] = {
+	/*		O	S	F	D	W */
+	[START] = {	FAIL,	ROOT,	FAIL,	FAIL,	FAIL	},
+	[ROOT]	= {	FAIL,	FAIL,	NAME,	FAIL,	FAIL	},
+	[NAME]	= {	FAIL,	SLASH,	NAME,	NAME,	SPACE	},
+	[SPACE] = {	FAIL,	FAIL,	NAME,	NAME,	SPACE	},
+	[SLASH] = {	FAIL,	FAIL,	NAME,	FAIL,	FAIL	},
+	[FAIL]	= {	FAIL,	FAIL,	FAIL,	FAIL,	FAIL	},
+};
+
+int
+tsd_pathcheck(const char *path, size_t len)
+{
+	const unsigned char *p, *end;
+	unsigned int state;
+
+	state = START;
+	for (p = (const unsigned char *)path, end = p + len; p < end; ++p)
+		if ((state = tsd_pathcheck_next[state]
+		    [tsd_pathcheck_class[*p]]) == FAIL)
+			return (0);
+	return (state == NAME || state == SLASH);
+}
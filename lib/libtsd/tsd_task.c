@@ -34,27 +34,42 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#if HAVE_SYS_PIDFD_H
+#include <sys/pidfd.h>
+#elif HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
 #include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
 #include <limits.h>
+#include <poll.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #if HAVE_BSD_UNISTD_H
 #include <bsd/unistd.h>
 #endif
 
+#include <tsd/cred.h>
 #include <tsd/hash.h>
 #include <tsd/log.h>
 #include <tsd/strutil.h>
 #include <tsd/task.h>
 
+/*
+ * How long to give a child to react to each signal we send it while
+ * stopping it, in milliseconds.
+ */
+#define TSD_TASK_STOP_WAIT	100
+
 /*
  * Clear task credentials.
  */
@@ -85,11 +100,12 @@ tsd_task_create(const char *name, tsd_task_func *func, void *ud)
 		errno = ENAMETOOLONG;
 		return (NULL);
 	}
-	t->h = tsd_strhash(t->name);
+	t->h = tsd_strhash64(t->name);
 	t->state = TASK_IDLE;
 	tsd_task_clearcred(t);
 	t->func = func;
 	t->pid = -1;
+	t->pidfd = -1;
 	t->pin = t->pout = t->perr = -1;
 	t->ud = ud;
 	VERBOSE("%s", name);
@@ -105,7 +121,7 @@ tsd_task_destroy(struct tsd_task *t)
 	if (t == NULL)
 		return;
 	VERBOSE("%s", t->name);
-	if (t->state == TASK_RUNNING)
+	if (t->state == TASK_RUNNING || t->state == TASK_STOPPING)
 		tsd_task_stop(t);
 	if (t->queue != NULL)
 		tsd_tqueue_remove(t->queue, t);
@@ -124,6 +140,9 @@ tsd_task_close(struct tsd_task *t, enum tsd_task_state nextstate)
 {
 
 	t->pid = -1;
+	if (t->pidfd >= 0)
+		close(t->pidfd);
+	t->pidfd = -1;
 	if (t->flags & TASK_STDIN)
 		close(t->pin);
 	if (t->flags & TASK_STDOUT)
@@ -175,6 +194,30 @@ fail:
 	return (-1);
 }
 
+/*
+ * Set the task credentials to those of the user with the given UID,
+ * which are looked up in the credential cache.
+ */
+int
+tsd_task_setuid(struct tsd_task *t, uid_t uid)
+{
+	struct tsd_cred cred;
+
+	if (t->state != TASK_IDLE) {
+		errno = EBUSY;
+		return (-1);
+	}
+	if (tsd_cred_lookup(uid, &cred) != 0) {
+		tsd_task_clearcred(t);
+		return (-1);
+	}
+	strlcpy(t->user, cred.user, sizeof t->user);
+	t->uid = cred.uid;
+	memcpy(t->gids, cred.gids, cred.ngids * sizeof *cred.gids);
+	t->ngids = cred.ngids;
+	return (0);
+}
+
 /*
  * Set the task credentials to the given UID and GID.
  */
@@ -233,6 +276,25 @@ tsd_task_setegid(struct tsd_task *t, gid_t gid)
 	return (-1);
 }
 
+/*
+ * Internal: obtain a file descriptor which becomes readable once the
+ * child has terminated, if the platform supports it.
+ */
+static int
+tsd_task_pidfd(pid_t pid)
+{
+
+#if HAVE_PIDFD_OPEN
+	return (pidfd_open(pid, 0));
+#elif defined(SYS_pidfd_open)
+	return ((int)syscall(SYS_pidfd_open, pid, 0));
+#else
+	(void)pid;
+	errno = ENOSYS;
+	return (-1);
+#endif
+}
+
 /*
  * Fork a child process and start a task inside it.
  *
@@ -244,6 +306,8 @@ tsd_task_start(struct tsd_task *t)
 	int pin[2] = { -1, -1 };
 	int pout[2] = { -1, -1 };
 	int perr[2] = { -1, -1 };
+	struct tsd_tqueue *tq;
+	sigset_t sigset;
 	int ret, serrno;
 #if !HAVE_CLOSEFROM
 	int fd, maxfd;
@@ -256,6 +320,11 @@ tsd_task_start(struct tsd_task *t)
 	if (t->state != TASK_IDLE)
 		return (-1);
 	t->state = TASK_STARTING;
+	if ((tq = t->queue) != NULL && t->qidle) {
+		/* move it to the queue's list of started tasks */
+		tsd_tqueue_remove(tq, t);
+		tsd_tqueue_insert(tq, t);
+	}
 
 	/* prepare file descriptors */
 	if (t->flags & TASK_STDIN_NULL) {
@@ -308,6 +377,15 @@ tsd_task_start(struct tsd_task *t)
 			close(fd);
 #endif
 
+		/*
+		 * The parent may have blocked signals it reads
+		 * synchronously and may be ignoring SIGPIPE; give the
+		 * child the defaults.
+		 */
+		sigemptyset(&sigset);
+		sigprocmask(SIG_SETMASK, &sigset, NULL);
+		signal(SIGPIPE, SIG_DFL);
+
 		/* set process title if possible */
 #if HAVE_SETPROCTITLE
 		setproctitle("%s", t->name);
@@ -336,6 +414,7 @@ tsd_task_start(struct tsd_task *t)
 	}
 
 	/* parent */
+	t->pidfd = tsd_task_pidfd(t->pid);
 	if (t->flags & TASK_STDIN)
 		close(pin[0]);
 	if (t->flags & TASK_STDOUT)
@@ -363,47 +442,114 @@ fail:
 }
 
 /*
- * Stop a task.  We make three attempts: first we check to see if the
- * child is already dead.  Then we wait 10 ms and check again; if it still
- * isn't dead, we send a SIGTERM, wait 10 ms, and check again.  If it
- * still isn't dead after the SIGTERM, we send a SIGKILL, wait 10 ms, and
- * try one last time.
+ * Internal: current time in milliseconds, for stop deadlines.
+ */
+static long long
+tsd_task_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/*
+ * Internal: send the next in a series of increasingly forceful signals
+ * to a task which is stopping, or give up if we have run out.  The
+ * first is SIGCONT, which gives a child that is already on its way
+ * out a chance to finish cleanly.
+ */
+static int
+tsd_task_escalate(struct tsd_task *t)
+{
+	static const int sig[] = { SIGCONT, SIGTERM, SIGKILL };
+	int serrno;
+
+	if (t->stopstep == sizeof sig / sizeof *sig) {
+		WARNING("gave up waiting for child %d", (int)t->pid);
+		tsd_task_close(t, TASK_DEAD);
+		/* XXX set errno? */
+		return (-1);
+	}
+	if (kill(t->pid, sig[t->stopstep]) != 0) {
+		serrno = errno;
+		WARNING("unable to signal child %d", (int)t->pid);
+		tsd_task_close(t, TASK_DEAD);
+		errno = serrno;
+		return (-1);
+	}
+	t->stopstep++;
+	t->stopat = tsd_task_now() + TSD_TASK_STOP_WAIT;
+	return (0);
+}
+
+/*
+ * Start stopping a task without waiting for it.  If the child is not
+ * already dead, it is sent SIGCONT, then SIGTERM and finally SIGKILL,
+ * one at a time, by subsequent calls to tsd_task_poll() which find it
+ * still running after a brief pause.
  */
 int
-tsd_task_stop(struct tsd_task *t)
+tsd_task_terminate(struct tsd_task *t)
 {
-	static const int sig[] = { SIGCONT, SIGTERM, SIGKILL, 0, -1 };
-	int i, serrno;
 
 	VERBOSE("%s", t->name);
 
-	/* check current state */
 	if (t->state != TASK_RUNNING)
 		return (-1);
 	t->state = TASK_STOPPING;
+	t->stopstep = 0;
+	t->stopat = 0;
+	if (tsd_task_poll(t) != 0)
+		return (-1);
+	return (0);
+}
 
-	/* reap the child */
-	for (i = 0; sig[i] >= 0; ++i) {
-		tsd_task_poll(t);
-		if (t->state != TASK_STOPPING)
-			break;
-		/* not dead yet; kill, wait 100 ms and retry */
-		if (kill(t->pid, sig[i]) != 0) {
-			serrno = errno;
-			WARNING("unable to signal child %d", (int)t->pid);
-			tsd_task_close(t, TASK_DEAD);
-			errno = serrno;
-			return (-1);
-		}
-		usleep(100000);
+/*
+ * Internal: wait until the child of a stopping task terminates or it is
+ * time to send the next signal, whichever comes first.  Without a
+ * pidfd, check back every few milliseconds.
+ */
+static void
+tsd_task_wait(const struct tsd_task *t)
+{
+	struct pollfd pfd;
+	long long ms;
+
+	if ((ms = t->stopat - tsd_task_now()) <= 0)
+		return;
+	if (t->pidfd >= 0) {
+		pfd.fd = t->pidfd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		(void)poll(&pfd, 1, (int)ms);
+	} else {
+		usleep((ms < 10 ? ms : 10) * 1000);
 	}
+}
 
-	/* either done or gave up */
-	if (sig[i] < 0) {
-		WARNING("gave up waiting for child %d", (int)t->pid);
-		tsd_task_close(t, TASK_DEAD);
-		/* XXX set errno? */
+/*
+ * Stop a task and wait for it.  This is tsd_task_terminate() followed
+ * by tsd_task_poll() until the child is gone, but returns as soon as
+ * the child terminates rather than sleeping a fixed amount of time
+ * after each signal.
+ */
+int
+tsd_task_stop(struct tsd_task *t)
+{
+
+	VERBOSE("%s", t->name);
+
+	/* check current state */
+	if (t->state == TASK_RUNNING)
+		tsd_task_terminate(t);
+	else if (t->state != TASK_STOPPING)
 		return (-1);
+
+	/* reap the child */
+	while (t->state == TASK_STOPPING) {
+		tsd_task_wait(t);
+		tsd_task_poll(t);
 	}
 
 	/* in summary... */
@@ -435,15 +581,21 @@ tsd_task_signal(const struct tsd_task *t, int sig)
 int
 tsd_task_reset(struct tsd_task *t)
 {
+	struct tsd_tqueue *tq;
 
 	VERBOSE("%s", t->name);
 
 	if (t->state == TASK_IDLE)
 		return (0);
-	if (t->state == TASK_RUNNING)
+	if (t->state == TASK_RUNNING || t->state == TASK_STOPPING)
 		tsd_task_stop(t);
 	t->status = 0;
 	t->state = TASK_IDLE;
+	if ((tq = t->queue) != NULL && !t->qidle) {
+		/* move it back to the queue's list of idle tasks */
+		tsd_tqueue_remove(tq, t);
+		tsd_tqueue_insert(tq, t);
+	}
 	return (0);
 }
 
@@ -471,7 +623,9 @@ tsd_task_poll(struct tsd_task *t)
 		errno = serrno;
 		/* fall through */
 	} else if (ret == 0) {
-		/* still running */
+		/* still running; if stopping, it may be time to insist */
+		if (t->state == TASK_STOPPING && tsd_task_now() >= t->stopat)
+			return (tsd_task_escalate(t));
 		return (0);
 	} else if (ret == t->pid) {
 		if (WIFEXITED(t->status) && WEXITSTATUS(t->status) == 0) {
@@ -35,10 +35,12 @@
 #include <sys/wait.h>
 
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <tsd/assert.h>
+#include <tsd/hash.h>
 #include <tsd/log.h>
 #include <tsd/strutil.h>
 #include <tsd/task.h>
@@ -70,10 +72,297 @@ tsd_tqueue_destroy(struct tsd_tqueue *tq)
 {
 
 	tsd_tqueue_drain(tq);
+	free(tq->flows);
 	memset(tq, 0, sizeof *tq);
 	free(tq);
 }
 
+/*
+ * Active flows are indexed in an open-addressing hash table with linear
+ * probing, by their key and that of their parent, so that finding the
+ * flow for an idle task does not take longer the more groups and owners
+ * there are.  Flows come and go all the time, so they are removed by
+ * shifting later entries back rather than by leaving markers behind.
+ * The table is kept between 1/8 and 1/2 full.
+ */
+#define TSD_TFLOW_MINSIZE	16
+
+/*
+ * Internal: hash a flow key, mixed with the hash of the parent flow.
+ */
+static uint64_t
+tsd_tflow_hash(const struct tsd_tflow *parent, unsigned long long key)
+{
+
+	return (tsd_strhash64_final(key + (parent != NULL ? parent->h : 0)));
+}
+
+/*
+ * Internal: rebuild the flow index at the given size.
+ */
+static int
+tsd_tflow_resize(struct tsd_tqueue *tq, unsigned int size)
+{
+	struct tsd_tflow **flows, *f;
+	unsigned int i, j, mask;
+
+	if ((flows = calloc(size, sizeof *flows)) == NULL)
+		return (-1);
+	mask = size - 1;
+	for (i = 0; i < tq->fsize; ++i) {
+		if ((f = tq->flows[i]) == NULL)
+			continue;
+		for (j = f->h & mask; flows[j] != NULL; j = (j + 1) & mask)
+			/* nothing */ ;
+		flows[j] = f;
+	}
+	free(tq->flows);
+	tq->flows = flows;
+	tq->fsize = size;
+	return (0);
+}
+
+/*
+ * Internal: find the active flow with the given key and parent.
+ */
+static struct tsd_tflow *
+tsd_tflow_find(const struct tsd_tqueue *tq, const struct tsd_tflow *parent,
+    unsigned long long key)
+{
+	struct tsd_tflow *f;
+	unsigned int i, mask;
+	uint64_t h;
+
+	if (tq->fsize == 0)
+		return (NULL);
+	h = tsd_tflow_hash(parent, key);
+	mask = tq->fsize - 1;
+	for (i = h & mask; (f = tq->flows[i]) != NULL; i = (i + 1) & mask)
+		if (f->h == h && f->key == key && f->parent == parent)
+			return (f);
+	return (NULL);
+}
+
+/*
+ * Internal: remove a flow from the index.  Each of the flows which
+ * follow it in the same run is moved into the hole if that is at or
+ * after its home slot, cyclically speaking, leaving a new hole behind.
+ */
+static void
+tsd_tflow_unindex(struct tsd_tqueue *tq, const struct tsd_tflow *f)
+{
+	struct tsd_tflow *g;
+	unsigned int i, j, home, mask;
+
+	mask = tq->fsize - 1;
+	for (i = f->h & mask; tq->flows[i] != f; i = (i + 1) & mask)
+		ASSERT(tq->flows[i] != NULL);
+	for (j = (i + 1) & mask; (g = tq->flows[j]) != NULL;
+	     j = (j + 1) & mask) {
+		home = g->h & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			tq->flows[i] = g;
+			i = j;
+		}
+	}
+	tq->flows[i] = NULL;
+	tq->nflows--;
+	/* failing to shrink is not fatal */
+	if (tq->fsize > TSD_TFLOW_MINSIZE && tq->nflows * 8 < tq->fsize)
+		(void)tsd_tflow_resize(tq, tq->fsize / 2);
+}
+
+/*
+ * Internal: find the active flow with the given key in a ring, or add
+ * a new one at the end of the ring.
+ */
+static struct tsd_tflow *
+tsd_tflow_get(struct tsd_tqueue *tq, struct tsd_tflow **ring,
+    struct tsd_tflow *parent, unsigned long long key, unsigned int weight)
+{
+	struct tsd_tflow *f;
+	unsigned int i, mask, size;
+
+	if ((f = tsd_tflow_find(tq, parent, key)) != NULL) {
+		f->weight = weight;
+		return (f);
+	}
+	if ((tq->nflows + 1) * 2 > tq->fsize) {
+		size = tq->fsize ? tq->fsize * 2 : TSD_TFLOW_MINSIZE;
+		if (tsd_tflow_resize(tq, size) != 0)
+			return (NULL);
+	}
+	if ((f = calloc(1, sizeof *f)) == NULL)
+		return (NULL);
+	f->key = key;
+	f->h = tsd_tflow_hash(parent, key);
+	f->weight = weight;
+	f->parent = parent;
+	mask = tq->fsize - 1;
+	for (i = f->h & mask; tq->flows[i] != NULL; i = (i + 1) & mask)
+		/* nothing */ ;
+	tq->flows[i] = f;
+	tq->nflows++;
+	if (*ring == NULL) {
+		f->prev = f->next = f;
+		*ring = f;
+	} else {
+		f->next = *ring;
+		f->prev = (*ring)->prev;
+		f->prev->next = f;
+		f->next->prev = f;
+	}
+	return (f);
+}
+
+/*
+ * Internal: remove an inactive flow from its ring and the index and
+ * free it.
+ */
+static void
+tsd_tflow_put(struct tsd_tqueue *tq, struct tsd_tflow **ring,
+    struct tsd_tflow *f)
+{
+
+	tsd_tflow_unindex(tq, f);
+	if (f->next == f) {
+		*ring = NULL;
+	} else {
+		f->prev->next = f->next;
+		f->next->prev = f->prev;
+		if (*ring == f)
+			*ring = f->next;
+	}
+	free(f);
+}
+
+/*
+ * Internal: return the flow whose turn it is in a ring.  The current
+ * flow keeps its turn for as long as it has a positive deficit; after
+ * that, the next flow is credited with its weight and gets a turn.
+ */
+static struct tsd_tflow *
+tsd_tflow_pick(struct tsd_tflow **ring)
+{
+	struct tsd_tflow *f;
+
+	if ((f = *ring) == NULL)
+		return (NULL);
+	while (f->deficit <= 0) {
+		f = f->next;
+		f->deficit += (int)f->weight;
+		*ring = f;
+	}
+	return (f);
+}
+
+/*
+ * Internal: append a task to the idle or the started list.  Idle tasks
+ * are also appended to the flow for their group and owner, which is
+ * created if necessary.
+ */
+static int
+tsd_tqueue_link(struct tsd_tqueue *tq, struct tsd_task *t, int idle)
+{
+	struct tsd_task **first, **last;
+	struct tsd_tflow *g, *f;
+
+	ASSERT(t->qprev == NULL && t->qnext == NULL);
+	if (idle) {
+		if ((f = tq->lastflow) == NULL || f->key != t->uid ||
+		    f->parent->key != t->qgroup) {
+			g = tsd_tflow_get(tq, &tq->cur, NULL, t->qgroup,
+			    t->qweight > 0 ? t->qweight : 1);
+			if (g == NULL)
+				return (-1);
+			f = tsd_tflow_get(tq, &g->cur, g, t->uid, 1);
+			if (f == NULL) {
+				if (g->cur == NULL)
+					tsd_tflow_put(tq, &tq->cur, g);
+				return (-1);
+			}
+			tq->lastflow = f;
+		}
+		ASSERT(t->fprev == NULL && t->fnext == NULL);
+		if (f->last != NULL) {
+			t->fprev = f->last;
+			f->last->fnext = t;
+		} else {
+			f->first = t;
+		}
+		f->last = t;
+		t->qflow = f;
+	}
+	first = idle ? &tq->first : &tq->rfirst;
+	last = idle ? &tq->last : &tq->rlast;
+	if (*first == NULL) {
+		ASSERT(*last == NULL);
+		*first = *last = t;
+	} else {
+		ASSERT(*last != NULL);
+		ASSERT((*last)->qnext == NULL);
+		t->qprev = *last;
+		(*last)->qnext = t;
+		*last = t;
+	}
+	t->qidle = idle;
+	if (idle)
+		tq->nidle++;
+	return (0);
+}
+
+/*
+ * Internal: remove a task from whichever list it is on.  An idle task
+ * taken from the flow whose turn it is counts against that flow's and
+ * its group's deficit, whether it is started, handed off or deleted.
+ */
+static void
+tsd_tqueue_unlink(struct tsd_tqueue *tq, struct tsd_task *t)
+{
+	struct tsd_task **first, **last;
+	struct tsd_tflow *g, *f;
+
+	if ((f = t->qflow) != NULL) {
+		g = f->parent;
+		if (t->fprev != NULL)
+			t->fprev->fnext = t->fnext;
+		else
+			f->first = t->fnext;
+		if (t->fnext != NULL)
+			t->fnext->fprev = t->fprev;
+		else
+			f->last = t->fprev;
+		t->fprev = t->fnext = NULL;
+		t->qflow = NULL;
+		if (g->cur == f) {
+			f->deficit--;
+			if (tq->cur == g)
+				g->deficit--;
+		}
+		if (f->first == NULL) {
+			if (tq->lastflow == f)
+				tq->lastflow = NULL;
+			tsd_tflow_put(tq, &g->cur, f);
+			if (g->cur == NULL)
+				tsd_tflow_put(tq, &tq->cur, g);
+		}
+	}
+	first = t->qidle ? &tq->first : &tq->rfirst;
+	last = t->qidle ? &tq->last : &tq->rlast;
+	if (t->qprev != NULL)
+		t->qprev->qnext = t->qnext;
+	if (t->qnext != NULL)
+		t->qnext->qprev = t->qprev;
+	if (*first == t)
+		*first = t->qnext;
+	if (*last == t)
+		*last = t->qprev;
+	t->qprev = t->qnext = NULL;
+	if (t->qidle)
+		tq->nidle--;
+	t->qidle = 0;
+}
+
 /*
  * Add a task to a queue
  */
@@ -85,17 +374,8 @@ tsd_tqueue_insert(struct tsd_tqueue *tq, struct tsd_task *t)
 		errno = EBUSY;
 		return (-1);
 	}
-	ASSERT(t->qprev == NULL && t->qnext == NULL);
-	if (tq->first == NULL) {
-		ASSERT(tq->last == NULL);
-		tq->first = tq->last = t;
-	} else {
-		ASSERT(tq->last != NULL);
-		ASSERT(tq->last->qnext == NULL);
-		t->qprev = tq->last;
-		tq->last->qnext = t;
-		tq->last = t;
-	}
+	if (tsd_tqueue_link(tq, t, t->state == TASK_IDLE) != 0)
+		return (-1);
 	if (t->state == TASK_RUNNING || t->state == TASK_STOPPING) {
 		/* why would you do that? */
 		tq->nrunning++;
@@ -116,41 +396,75 @@ tsd_tqueue_remove(struct tsd_tqueue *tq, struct tsd_task *t)
 		errno = ENOENT;
 		return (-1);
 	}
-	if (t->qprev != NULL)
-		t->qprev->qnext = t->qnext;
-	if (t->qnext != NULL)
-		t->qnext->qprev = t->qprev;
-	if (tq->first == t)
-		tq->first = t->qnext;
-	if (tq->last == t)
-		tq->last = t->qprev;
+	tsd_tqueue_unlink(tq, t);
 	if (t->state == TASK_RUNNING || t->state == TASK_STOPPING)
 		tq->nrunning--;
 	tq->ntasks--;
 	t->queue = NULL;
-	return (-1);
+	return (0);
 }
 
 /*
- * Start any runnable tasks if we have free slots.
+ * Return the idle task which is next in line to be started: the
+ * oldest task of the owner whose turn it is, within the group whose
+ * turn it is.  Groups get turns in proportion to their weight, and
+ * owners within a group get equal turns.
  */
-unsigned int
-tsd_tqueue_sched(struct tsd_tqueue *tq)
+struct tsd_task *
+tsd_tqueue_next(struct tsd_tqueue *tq)
+{
+	struct tsd_tflow *g, *f;
+
+	if ((g = tsd_tflow_pick(&tq->cur)) == NULL)
+		return (NULL);
+	f = tsd_tflow_pick(&g->cur);
+	ASSERT(f != NULL && f->first != NULL);
+	return (f->first);
+}
+
+/*
+ * Start the next idle task if we have a free slot.  Returns 0 if a
+ * task was started, or -1 if there was nothing to start or the task
+ * failed to start, in which case it is no longer idle.
+ */
+int
+tsd_tqueue_start(struct tsd_tqueue *tq)
 {
 	struct tsd_task *t;
+	int ret;
 
+	if (tq->nrunning >= tq->max_running ||
+	    (t = tsd_tqueue_next(tq)) == NULL) {
+		errno = EAGAIN;
+		return (-1);
+	}
 	/*
-	 * Scan the queue looking for runnable tasks and try to start them
-	 * if we are not already over the limit.  No housekeeping is done
-	 * here since tsd_task_start() will either increment our nrunning
-	 * or remove the task from the queue if it failed to start.
+	 * No housekeeping is done here since tsd_task_start() moves the
+	 * task to the started list and either increments our nrunning or
+	 * marks the task as dead if it failed to start.
 	 */
-	for (t = tq->first; t != NULL; t = t->qnext) {
-		if (tq->nrunning >= tq->max_running)
-			break;
-		if (t->state == TASK_IDLE)
-			tsd_task_start(t);
+	ret = -1;
+	if (t->state == TASK_IDLE)
+		ret = tsd_task_start(t);
+	if (t->queue == tq && t->qidle) {
+		/* not idle after all, or failed early */
+		tsd_tqueue_unlink(tq, t);
+		(void)tsd_tqueue_link(tq, t, 0);
 	}
+	return (ret);
+}
+
+/*
+ * Start idle tasks, in the order given by tsd_tqueue_next(), for as
+ * long as we have free slots.  Only active flows are examined, so the
+ * cost does not depend on how many tasks are running or finished.
+ */
+unsigned int
+tsd_tqueue_sched(struct tsd_tqueue *tq)
+{
+
+	while (tq->nrunning < tq->max_running && tq->first != NULL)
+		tsd_tqueue_start(tq);
 	return (tq->nrunning);
 }
 
@@ -162,11 +476,14 @@ tsd_tqueue_drain(struct tsd_tqueue *tq)
 {
 	struct tsd_task *t;
 
-	while ((t = tq->first) != NULL) {
+	/* ask them all to stop first so they can do so in parallel */
+	for (t = tq->rfirst; t != NULL; t = t->qnext)
+		if (t->state == TASK_RUNNING)
+			tsd_task_terminate(t);
+	while ((t = tq->rfirst) != NULL || (t = tq->first) != NULL) {
 		ASSERT(t->queue == tq);
 		tsd_task_stop(t);
-		tq->first = t->qnext;
-		t->qprev = t->qnext = NULL;
-		t->queue = NULL;
+		if (t->queue == tq)
+			tsd_tqueue_remove(tq, t);
 	}
 }
@@ -45,6 +45,20 @@
 #include <tsd/strutil.h>
 #include <tsd/task.h>
 
+/*
+ * Tasks are kept in an open-addressing hash table with linear probing,
+ * indexed by the 64-bit hash of their names, and on a list in the order
+ * in which they were inserted, which is what we iterate over.  Removed
+ * tasks leave a marker behind in the table so that other tasks don't
+ * have to move.  Once a quarter of the table is markers, or when it is
+ * full enough that a task can't be inserted, the table is rebuilt at
+ * whatever size suits the number of tasks left.
+ */
+#define TSD_TSET_MINSIZE	64
+
+static struct tsd_task tsd_tset_deleted;
+#define TSD_TSET_DELETED	(&tsd_tset_deleted)
+
 /*
  * Create a new task set.
  */
@@ -71,44 +85,97 @@ void
 tsd_tset_destroy(struct tsd_tset *ts)
 {
 	struct tsd_task *t;
-	unsigned int h;
-
-	for (h = 0; h < sizeof ts->tasks / sizeof *ts->tasks; ++h) {
-		while (ts->tasks[h] != NULL) {
-			t = ts->tasks[h];
-			ts->tasks[h] = t->snext;
-			t->set = NULL;
-			t->snext = NULL;
-		}
-	}
+
+	for (t = ts->first; t != NULL; t = t->snext)
+		t->set = NULL;
+	free(ts->tasks);
 	memset(ts, 0, sizeof *ts);
 	free(ts);
 }
 
+/*
+ * Internal: look up a task by name and hash.  Returns its slot, or -1
+ * if it is not in the set.
+ */
+static int
+tsd_tset_lookup(const struct tsd_tset *ts, const char *name, uint64_t h)
+{
+	struct tsd_task *t;
+	unsigned int i, mask;
+
+	if (ts->size == 0)
+		return (-1);
+	mask = ts->size - 1;
+	for (i = h & mask; (t = ts->tasks[i]) != NULL; i = (i + 1) & mask) {
+		if (t != TSD_TSET_DELETED && t->h == h &&
+		    strcmp(t->name, name) == 0)
+			return ((int)i);
+	}
+	return (-1);
+}
+
+/*
+ * Internal: rebuild the table at the smallest size which keeps it at
+ * most half full once another task has been added.
+ */
+static int
+tsd_tset_resize(struct tsd_tset *ts)
+{
+	struct tsd_task **tasks, *t;
+	unsigned int j, mask, size;
+
+	for (size = TSD_TSET_MINSIZE; size / 2 < ts->ntasks + 1; size *= 2)
+		/* nothing */ ;
+	if ((tasks = calloc(size, sizeof *tasks)) == NULL)
+		return (-1);
+	mask = size - 1;
+	for (t = ts->first; t != NULL; t = t->snext) {
+		for (j = t->h & mask; tasks[j] != NULL; j = (j + 1) & mask)
+			/* nothing */ ;
+		tasks[j] = t;
+		t->sidx = j;
+	}
+	free(ts->tasks);
+	ts->tasks = tasks;
+	ts->size = size;
+	ts->nused = ts->ntasks;
+	return (0);
+}
+
 /*
  * Add a task to a task set
  */
 int
 tsd_tset_insert(struct tsd_tset *ts, struct tsd_task *t)
 {
-	struct tsd_task **tpp;
+	unsigned int i, mask;
 
 	if (t->set != NULL) {
 		errno = EBUSY;
 		return (-1);
 	}
-	ASSERT(t->h < sizeof ts->tasks / sizeof *ts->tasks);
-	ASSERT(t->snext == NULL);
-	ASSERT(t->set == NULL);
-	for (tpp = &ts->tasks[t->h]; *tpp != NULL; tpp = &(*tpp)->snext) {
-		ASSERT((*tpp)->h ==  t->h);
-		if (strcmp((*tpp)->name, t->name) == 0) {
-			errno = EEXIST;
-			return (-1);
-		}
+	if (tsd_tset_lookup(ts, t->name, t->h) >= 0) {
+		errno = EEXIST;
+		return (-1);
 	}
-	*tpp = t;
+	/* keep the table, including removed tasks, at most 3/4 full */
+	if ((ts->nused + 1) * 4 > ts->size * 3 && tsd_tset_resize(ts) != 0)
+		return (-1);
+	mask = ts->size - 1;
+	for (i = t->h & mask; ts->tasks[i] != NULL &&
+	    ts->tasks[i] != TSD_TSET_DELETED; i = (i + 1) & mask)
+		/* nothing */ ;
+	if (ts->tasks[i] == NULL)
+		ts->nused++;
+	ts->tasks[i] = t;
+	t->sidx = i;
 	t->set = ts;
+	if ((t->sprev = ts->last) != NULL)
+		t->sprev->snext = t;
+	else
+		ts->first = t;
+	t->snext = NULL;
+	ts->last = t;
 	ts->ntasks++;
 	if (t->state == TASK_RUNNING)
 		ts->nrunning++;
@@ -121,28 +188,31 @@ tsd_tset_insert(struct tsd_tset *ts, struct tsd_task *t)
 int
 tsd_tset_remove(struct tsd_tset *ts, struct tsd_task *t)
 {
-	struct tsd_task **tpp;
 
 	if (t->set != ts) {
 		errno = ENOENT;
 		return (-1);
 	}
-	ASSERT(t->h < sizeof ts->tasks / sizeof *ts->tasks);
-	ASSERT(t->set == ts);
-	for (tpp = &ts->tasks[t->h]; *tpp != NULL; tpp = &(*tpp)->snext) {
-		ASSERT((*tpp)->h ==  t->h);
-		if (*tpp == t) {
-			*tpp = t->snext;
-			t->snext = NULL;
-			t->set = NULL;
-			ts->ntasks--;
-			if (t->state == TASK_RUNNING)
-				ts->nrunning--;
-			return (0);
-		}
-	}
-	errno = ENOENT;
-	return (-1);
+	ASSERT(t->sidx < ts->size && ts->tasks[t->sidx] == t);
+	ts->tasks[t->sidx] = TSD_TSET_DELETED;
+	/* leave t->snext alone so tsd_tset_next() still works */
+	if (t->sprev != NULL)
+		t->sprev->snext = t->snext;
+	else
+		ts->first = t->snext;
+	if (t->snext != NULL)
+		t->snext->sprev = t->sprev;
+	else
+		ts->last = t->sprev;
+	t->sprev = NULL;
+	t->set = NULL;
+	ts->ntasks--;
+	if (t->state == TASK_RUNNING)
+		ts->nrunning--;
+	/* failing to clean up is not fatal */
+	if ((ts->nused - ts->ntasks) * 4 > ts->size)
+		(void)tsd_tset_resize(ts);
+	return (0);
 }
 
 /*
@@ -151,17 +221,33 @@ tsd_tset_remove(struct tsd_tset *ts, struct tsd_task *t)
 struct tsd_task *
 tsd_tset_find(const struct tsd_tset *ts, const char *name)
 {
-	struct tsd_task *tp;
-	unsigned int h;
-
-	h = tsd_strhash(name);
-	ASSERT(h < sizeof ts->tasks / sizeof *ts->tasks);
-	for (tp = ts->tasks[h]; tp != NULL; tp = tp->snext) {
-		ASSERT(tp->h ==  h);
-		if (strcmp(tp->name, name) == 0)
-			return (tp);
+	int i;
+
+	if ((i = tsd_tset_lookup(ts, name, tsd_strhash64(name))) < 0) {
+		errno = ENOENT;
+		return (NULL);
 	}
-	errno = ENOENT;
+	return (ts->tasks[i]);
+}
+
+/*
+ * Find a task which was inserted under a hash of the caller's choosing
+ * rather than that of its name.  The callback is given each task with
+ * the right hash in turn and decides whether it is the one we want.
+ */
+struct tsd_task *
+tsd_tset_match(const struct tsd_tset *ts, uint64_t h,
+    int (*match)(const struct tsd_task *, const void *), const void *arg)
+{
+	struct tsd_task *t;
+	unsigned int i, mask;
+
+	if (ts->size == 0)
+		return (NULL);
+	mask = ts->size - 1;
+	for (i = h & mask; (t = ts->tasks[i]) != NULL; i = (i + 1) & mask)
+		if (t != TSD_TSET_DELETED && t->h == h && match(t, arg))
+			return (t);
 	return (NULL);
 }
 
@@ -171,41 +257,22 @@ tsd_tset_find(const struct tsd_tset *ts, const char *name)
 struct tsd_task *
 tsd_tset_first(const struct tsd_tset *ts)
 {
-	unsigned int h;
 
-	for (h = 0; h < sizeof ts->tasks / sizeof *ts->tasks; ++h) {
-		if (ts->tasks[h] != NULL) {
-			ASSERT(ts->tasks[h]->h == h);
-			return (ts->tasks[h]);
-		}
-	}
-	return (NULL);
+	return (ts->first);
 }
 
 /*
- * Iterate over a set: next task
+ * Iterate over a set: next task.  The task we're given may have been
+ * removed from the set since it was returned.
  */
 struct tsd_task *
 tsd_tset_next(const struct tsd_tset *ts, const struct tsd_task *t)
 {
-	unsigned int h;
 
 	if (t == NULL)
 		return (tsd_tset_first(ts));
-	ASSERT(t->h < sizeof ts->tasks / sizeof *ts->tasks);
-	ASSERT(t->set == ts);
-	if (t->snext != NULL) {
-		ASSERT(t->snext->set == ts);
-		return (t->snext);
-	}
-	for (h = t->h + 1; h < sizeof ts->tasks / sizeof *ts->tasks; ++h) {
-		if (ts->tasks[h] != NULL) {
-			ASSERT(ts->tasks[h]->h == h);
-			ASSERT(ts->tasks[h]->set == ts);
-			return (ts->tasks[h]);
-		}
-	}
-	return (NULL);
+	ASSERT(t->set == ts || t->set == NULL);
+	return (t->snext);
 }
 
 /*
@@ -494,7 +494,7 @@ tsdfx_copier(const char *srcfn, const char *dstfn, size_t maxsize)
 	off_t have, need;
 #endif
 	struct copyfile *src, *dst;
-	int serrno;
+	int outgrown, serrno;
 	time_t now;
 
 	/* check file names */
@@ -637,12 +637,18 @@ tsdfx_copier(const char *srcfn, const char *dstfn, size_t maxsize)
 		ERROR("digest differs after copy");
 		goto fail;
 	}
-	if (killed || (maxsize && (size_t)src->st.st_size > maxsize))
+	outgrown = maxsize && (size_t)src->st.st_size > maxsize;
+	if (killed || outgrown)
 		tsdfx_log_interrupted(src, dst);
 	else
 		tsdfx_log_complete(src, dst);
 	copyfile_close(src);
 	copyfile_close(dst);
+	if (outgrown && !killed) {
+		/* let our parent know it should try again */
+		errno = EFBIG;
+		return (-1);
+	}
 	return (0);
 
 fail:
@@ -657,11 +663,65 @@ fail:
 	return (-1);
 }
 
+/*
+ * Batch mode: read records of the form src <tab> dst <tab> maxsize from
+ * stdin, copy each in turn, and for each report a line of the form
+ * status <tab> src on stdout, where status is 0 on success and an errno
+ * value otherwise.  Stops at end of input or when killed.
+ */
+static int
+tsdfx_copier_batch(void)
+{
+	char *line, *src, *dst, *ms, *e;
+	size_t linesz;
+	ssize_t len;
+	uintmax_t maxsize;
+	int ret;
+
+	line = NULL;
+	linesz = 0;
+	ret = 0;
+	while (!killed && (len = getline(&line, &linesz, stdin)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		src = line;
+		if ((dst = strchr(src, '\t')) == NULL ||
+		    (ms = strchr(dst + 1, '\t')) == NULL) {
+			ERROR("invalid batch record");
+			ret = -1;
+			break;
+		}
+		*dst++ = '\0';
+		*ms++ = '\0';
+		maxsize = strtoumax(ms, &e, 10);
+		if (e == ms || *e != '\0' || maxsize > SIZE_MAX) {
+			ERROR("invalid batch record for %s", src);
+			ret = -1;
+			break;
+		}
+		errno = 0;
+		if (tsdfx_copier(src, dst, maxsize) != 0)
+			ret = errno ? errno : EIO;
+		else if (killed)
+			ret = EINTR;
+		else
+			ret = 0;
+		if (printf("%d\t%s\n", ret, src) < 0 || fflush(stdout) != 0) {
+			ret = -1;
+			break;
+		}
+		ret = 0;
+	}
+	free(line);
+	return (ret);
+}
+
 static void
 usage(void)
 {
 
-	fprintf(stderr, "usage: tsdfx-copier [-nv] [-m maxsize] [-l logname] src dst\n");
+	fprintf(stderr, "usage: tsdfx-copier [-nv] [-m maxsize] [-l logname] src dst\n"
+	    "       tsdfx-copier -b [-nv] [-l logname]\n");
 	exit(1);
 }
 
@@ -671,12 +731,16 @@ main(int argc, char *argv[])
 	const char *logfile, *userlog;
 	uintmax_t maxsize;
 	char *e;
-	int opt;
+	int batch, opt;
 
 	maxsize = 0;
 	logfile = userlog = NULL;
-	while ((opt = getopt(argc, argv, "fhl:nm:v")) != -1)
+	batch = 0;
+	while ((opt = getopt(argc, argv, "bfhl:nm:v")) != -1)
 		switch (opt) {
+		case 'b':
+			++batch;
+			break;
 		case 'f':
 			++tsdfx_force;
 			break;
@@ -704,7 +768,7 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (argc != 2)
+	if (argc != (batch ? 0 : 2))
 		usage();
 
 	tsd_log_init("tsdfx-copier", logfile);
@@ -715,8 +779,17 @@ main(int argc, char *argv[])
 
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
-	if (tsdfx_copier(argv[0], argv[1], maxsize) != 0)
-		exit(1);
+	/*
+	 * A batch copier reports on each file on stdout; if it fails as a
+	 * whole, errno is whatever the last call left behind and says
+	 * nothing about whether a file outgrew its size class.
+	 */
+	if (batch) {
+		if (tsdfx_copier_batch() != 0)
+			exit(1);
+	} else if (tsdfx_copier(argv[0], argv[1], maxsize) != 0) {
+		exit(errno == EFBIG ? 2 : 1);
+	}
 	signal(SIGTERM, SIG_DFL);
 	signal(SIGINT, SIG_DFL);
 	if (killed)
@@ -37,7 +37,10 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -51,216 +54,1238 @@
 #include <tsd/strutil.h>
 #include <tsd/percent.h>
 
+#include <tsdfx/scanrec.h>
+
 static long maxfiles = 80000;
 
+static unsigned int nthreads = 1;
+
+/* index file, and how often to ignore it */
+static const char *indexfile;
+static unsigned int fullwalk = 12;
+
+/* report metadata in binary records instead of printing names */
+static int records;
+
+/* read each directory in full, then look up its entries in inode order */
+static int inodeorder;
+
+/* stay around and scan again on request */
+static int persistent;
+
+struct scanpath;
+struct scan_worker;
+
+/*
+ * A directory entry read ahead of time so entries can be looked up in
+ * inode order.  The name is an offset into the worker's name buffer,
+ * which may move as it grows.
+ */
+struct scan_dirent {
+	uint64_t ino;
+	mode_t type;
+	size_t name;
+};
+
+/*
+ * Worklist entries and the paths they carry are carved out of large
+ * chunks belonging to the worker that queued them.  A chunk is reused
+ * as soon as every entry in it has been processed, so memory use is
+ * bounded by how much of the tree is queued at any one time, not by how
+ * many directories we have seen, and there are no calls to malloc() or
+ * free() per directory.
+ */
+#define SCAN_CHUNK_SIZE		(64 * 1024)
+#define SCAN_ALIGN(n)		(((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+struct scan_chunk {
+	struct scan_worker *owner;
+	size_t size;		/* total size */
+	size_t used;		/* bytes handed out, including this header */
+	unsigned long live;	/* entries not yet freed */
+};
+
+/*
+ * Each directory is opened relative to its parent, so the kernel only
+ * has to look up one component and a directory which is renamed or
+ * replaced with a symlink while we are scanning cannot lead us outside
+ * the tree.  An entry therefore holds on to its parent, which keeps its
+ * descriptor open until all its subdirectories have been processed.  To
+ * stay within the descriptor limit on wide trees, only so many are held
+ * at any one time; subdirectories of the rest are opened by full path.
+ */
+#define SCAN_MAX_HELD		256
+
 struct scan_entry {
-	struct sbuf *path;
-	struct scan_entry *next;
+	struct scan_chunk *chunk;
+	struct scan_entry *prev, *next;
+	struct scan_entry *parent;	/* directory we found this in */
+	unsigned int refs;		/* this entry plus queued children */
+	int fd;				/* held open for children, or -1 */
+	const char *name;		/* last component of path */
+	char path[];
+};
+
+/*
+ * A directory as recorded in the index: its identity and timestamps,
+ * and the files and subdirectories we found in it.
+ */
+struct scan_index_dir {
+	const char *path;
+	uintmax_t dev, ino;
+	struct timespec mtim, ctim;
+	char **entries;
+	size_t nentries;
+};
+
+/*
+ * The index.  The old index is loaded at startup and is read-only
+ * thereafter, while the new one is built up by the workers as they go.
+ */
+struct scan_index {
+	const char *fn;
+	unsigned int cycle;
+	time_t start;
+
+	/* what we loaded */
+	char *buf;
+	struct scan_index_dir *dirs;
+	size_t ndirs;
+
+	/* what we will save, protected by the lock */
+	pthread_mutex_t lock;
+	struct sbuf *out;
+	size_t nout;
+	long nreplayed;
+};
+
+/*
+ * Per-thread state.  Each worker has its own worklist, which is a deque:
+ * the owner takes entries from the head, so a single worker walks the
+ * tree breadth-first, while idle workers steal from the tail.
+ */
+struct scan_worker {
+	struct scanpath *sp;
+	unsigned int id;
+	pthread_t thr;
+	pthread_mutex_t lock;
+	struct scan_entry *head, *tail;
+	struct scan_chunk *chunk;	/* where new entries come from */
+	struct scan_chunk *spare;	/* an empty chunk, ready for reuse */
+
+	/* directory read-ahead buffers, reused from one directory to the next */
+	struct scan_dirent *dents;
+	size_t dentsz;
+	char *names;
+	size_t namesz;
 };
 
 struct scanpath {
 	/*
-	 * Worklist
+	 * Workers and their worklists
 	 */
-	struct scan_entry *todo, *tail;
+	struct scan_worker *workers;
+	unsigned int nworkers;
+
+	/*
+	 * Shared state, protected by the lock.  The condition variable is
+	 * signaled whenever an entry is queued or the scan completes.
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	long queued;		/* entries sitting on a worklist */
+	long pending;		/* entries queued or being processed */
+	int failed;		/* a worker hit a hard error */
+	unsigned int nheld;	/* directory descriptors held open */
 
 	/*
 	 * Track number of entries found and when to stop.
 	 */
 	long processed;
+
+	/*
+	 * Index of directories seen in the previous scan, or NULL.
+	 */
+	struct scan_index *index;
 };
 
 /*
- * Free a worklist entry.  Save and restore errno to facilitate use in
- * error handling code.
+ * Allocate a worklist entry from a worker's current chunk, moving on to
+ * a new one if it is full.  The worker's lock must be held.
+ */
+static struct scan_entry *
+tsdfx_scan_alloc(struct scan_worker *sw, const char *path)
+{
+	struct scan_chunk *sc;
+	struct scan_entry *se;
+	size_t hdr, len, need, size;
+
+	hdr = SCAN_ALIGN(sizeof *sc);
+	len = strlen(path);
+	need = SCAN_ALIGN(sizeof *se + len + 1);
+	if ((sc = sw->chunk) == NULL || sc->used + need > sc->size) {
+		/*
+		 * Retire the current chunk; the last entry out will
+		 * recycle it.  An unused one is simply freed.  There is
+		 * no point in reusing it, since tsdfx_scan_free() resets
+		 * a chunk as soon as it is empty, so if this entry does
+		 * not fit, it never will.
+		 */
+		size = hdr + need > SCAN_CHUNK_SIZE ?
+		    hdr + need : SCAN_CHUNK_SIZE;
+		if (sw->spare != NULL && size == SCAN_CHUNK_SIZE) {
+			sc = sw->spare;
+			sw->spare = NULL;
+		} else if ((sc = malloc(size)) != NULL) {
+			sc->size = size;
+		} else {
+			return (NULL);
+		}
+		if (sw->chunk != NULL && sw->chunk->live == 0)
+			free(sw->chunk);
+		sc->owner = sw;
+		sc->used = hdr;
+		sc->live = 0;
+		sw->chunk = sc;
+	}
+	se = (struct scan_entry *)(void *)((char *)sc + sc->used);
+	sc->used += need;
+	sc->live++;
+	se->chunk = sc;
+	se->prev = se->next = NULL;
+	se->parent = NULL;
+	se->refs = 1;
+	se->fd = -1;
+	memcpy(se->path, path, len + 1);
+	if ((se->name = strrchr(se->path, '/')) != NULL && se->name[1] != '\0')
+		se->name++;
+	else
+		se->name = se->path;
+	return (se);
+}
+
+/*
+ * Drop a reference to a worklist entry.  When the last one goes, close
+ * its descriptor, if it has one, and release its parent.  If it was the
+ * last entry in its chunk, the chunk is either reset, if its owner is
+ * still allocating from it, or kept as a spare.  Save and restore errno
+ * to facilitate use in error handling code.
  */
 static void
-tsdfx_scan_free(struct scan_entry *se)
+tsdfx_scan_free(struct scanpath *sp, struct scan_entry *se)
 {
+	struct scan_entry *parent;
+	struct scan_chunk *sc;
+	struct scan_worker *sw;
 	int serrno;
 
-	if (se != NULL) {
-		serrno = errno;
-		if (se->path != NULL)
-			sbuf_delete(se->path);
-		free(se);
-		errno = serrno;
+	serrno = errno;
+	for (; se != NULL; se = parent) {
+		sc = se->chunk;
+		sw = sc->owner;
+		pthread_mutex_lock(&sw->lock);
+		if (--se->refs > 0) {
+			pthread_mutex_unlock(&sw->lock);
+			break;
+		}
+		parent = se->parent;
+		if (se->fd >= 0) {
+			close(se->fd);
+			pthread_mutex_lock(&sp->lock);
+			sp->nheld--;
+			pthread_mutex_unlock(&sp->lock);
+		}
+		if (--sc->live == 0) {
+			if (sc == sw->chunk) {
+				sc->used = SCAN_ALIGN(sizeof *sc);
+			} else if (sw->spare == NULL &&
+			    sc->size == SCAN_CHUNK_SIZE) {
+				sw->spare = sc;
+			} else {
+				free(sc);
+			}
+		}
+		pthread_mutex_unlock(&sw->lock);
+	}
+	errno = serrno;
+}
+
+/*
+ * Keep a directory's descriptor open for the benefit of its
+ * subdirectories, if we are not already holding too many.  This is only
+ * ever called by the worker processing the directory, before any of its
+ * subdirectories are queued.
+ */
+static void
+tsdfx_scan_hold(struct scanpath *sp, struct scan_entry *se, int dd)
+{
+	int hold;
+
+	pthread_mutex_lock(&sp->lock);
+	if ((hold = sp->nheld < SCAN_MAX_HELD))
+		sp->nheld++;
+	pthread_mutex_unlock(&sp->lock);
+	if (hold && (se->fd = fcntl(dd, F_DUPFD_CLOEXEC, 0)) < 0) {
+		pthread_mutex_lock(&sp->lock);
+		sp->nheld--;
+		pthread_mutex_unlock(&sp->lock);
 	}
 }
 
 /*
- * Append a directory to the worklist.
+ * Append a directory to a worker's worklist.  The parent, if there is
+ * one, is the entry being processed, and is kept until the new entry is
+ * released.
  */
 static struct scan_entry *
-tsdfx_scan_append(struct scanpath *sp, const struct sbuf *path)
+tsdfx_scan_append(struct scan_worker *sw, struct scan_entry *parent,
+    const char *path)
 {
+	struct scanpath *sp = sw->sp;
 	struct scan_entry *se;
 
-	if ((se = calloc(1, sizeof *se)) == NULL)
+	if (parent != NULL) {
+		pthread_mutex_lock(&parent->chunk->owner->lock);
+		parent->refs++;
+		pthread_mutex_unlock(&parent->chunk->owner->lock);
+	}
+	pthread_mutex_lock(&sw->lock);
+	if ((se = tsdfx_scan_alloc(sw, path)) == NULL) {
+		pthread_mutex_unlock(&sw->lock);
+		tsdfx_scan_free(sp, parent);
 		return (NULL);
-	if ((se->path = sbuf_new_auto()) == NULL ||
-	    sbuf_cpy(se->path, sbuf_data(path)) == -1 ||
-	    sbuf_finish(se->path) == -1)
-		goto fail;
-	if (sp->todo == NULL)
-		sp->todo = sp->tail = se;
-	else
-		sp->tail = sp->tail->next = se;
+	}
+	se->parent = parent;
+	if (sw->head == NULL) {
+		sw->head = sw->tail = se;
+	} else {
+		se->prev = sw->tail;
+		sw->tail = sw->tail->next = se;
+	}
+	pthread_mutex_unlock(&sw->lock);
+	pthread_mutex_lock(&sp->lock);
+	sp->queued++;
+	sp->pending++;
+	pthread_cond_signal(&sp->cond);
+	pthread_mutex_unlock(&sp->lock);
 	return (se);
-fail:
-	tsdfx_scan_free(se);
-	return (NULL);
 }
 
 /*
- * Remove and return the next entry from the worklist.
+ * Remove and return the entry at the head of a worker's worklist.
  */
 static struct scan_entry *
-tsdfx_scan_next(struct scanpath *sp)
+tsdfx_scan_pop(struct scan_worker *sw)
 {
 	struct scan_entry *se;
 
-	if ((se = sp->todo) != NULL) {
-		if ((sp->todo = se->next) == NULL) {
-			ASSERT(sp->tail == se);
-			sp->tail = NULL;
+	pthread_mutex_lock(&sw->lock);
+	if ((se = sw->head) != NULL) {
+		if ((sw->head = se->next) == NULL) {
+			ASSERT(sw->tail == se);
+			sw->tail = NULL;
+		} else {
+			sw->head->prev = NULL;
 		}
+		se->next = NULL;
 	}
+	pthread_mutex_unlock(&sw->lock);
 	return (se);
 }
 
 /*
- * Initialize the worklist and file list.
+ * Remove and return the entry at the tail of another worker's worklist.
  */
-static struct scanpath *
-tsdfx_scan_init(const char *root)
+static struct scan_entry *
+tsdfx_scan_steal(struct scan_worker *sw)
 {
 	struct scan_entry *se;
+
+	pthread_mutex_lock(&sw->lock);
+	if ((se = sw->tail) != NULL) {
+		if ((sw->tail = se->prev) == NULL) {
+			ASSERT(sw->head == se);
+			sw->head = NULL;
+		} else {
+			sw->tail->next = NULL;
+		}
+		se->prev = NULL;
+	}
+	pthread_mutex_unlock(&sw->lock);
+	return (se);
+}
+
+/*
+ * Return the next entry for a worker to process: first from its own
+ * worklist, then from the others'.  If there is nothing to steal but
+ * other workers are still busy, wait for them to either queue more work
+ * or finish.  Returns NULL when the scan is complete or has failed.
+ */
+static struct scan_entry *
+tsdfx_scan_next(struct scan_worker *sw)
+{
+	struct scanpath *sp = sw->sp;
+	struct scan_entry *se;
+	unsigned int i;
+
+	for (;;) {
+		se = tsdfx_scan_pop(sw);
+		for (i = 1; se == NULL && i < sp->nworkers; ++i)
+			se = tsdfx_scan_steal(&sp->workers[(sw->id + i) %
+			    sp->nworkers]);
+		pthread_mutex_lock(&sp->lock);
+		if (se != NULL) {
+			sp->queued--;
+			pthread_mutex_unlock(&sp->lock);
+			return (se);
+		}
+		while (!sp->failed && sp->pending > 0 && sp->queued == 0)
+			pthread_cond_wait(&sp->cond, &sp->lock);
+		if (sp->failed || sp->pending == 0) {
+			pthread_mutex_unlock(&sp->lock);
+			return (NULL);
+		}
+		pthread_mutex_unlock(&sp->lock);
+	}
+}
+
+/*
+ * Mark a worklist entry as processed.  If it was the last one, or the
+ * worker failed, wake everybody up so they can leave.
+ */
+static void
+tsdfx_scan_done(struct scan_worker *sw, int failed)
+{
+	struct scanpath *sp = sw->sp;
+
+	pthread_mutex_lock(&sp->lock);
+	if (failed)
+		sp->failed = 1;
+	if (--sp->pending == 0 || sp->failed)
+		pthread_cond_broadcast(&sp->cond);
+	pthread_mutex_unlock(&sp->lock);
+}
+
+/*
+ * Check whether any worker has failed.
+ */
+static int
+tsdfx_scan_failed(struct scanpath *sp)
+{
+	int failed;
+
+	pthread_mutex_lock(&sp->lock);
+	failed = sp->failed;
+	pthread_mutex_unlock(&sp->lock);
+	return (failed);
+}
+
+/*
+ * Count a directory entry against the limit.
+ */
+static int
+tsdfx_scan_count(struct scanpath *sp)
+{
+	int ret;
+
+	ret = 0;
+	pthread_mutex_lock(&sp->lock);
+	sp->processed++;
+	if (0 != maxfiles && sp->processed >= maxfiles)
+		ret = -1;
+	pthread_mutex_unlock(&sp->lock);
+	return (ret);
+}
+
+/*
+ * Compare two index entries by path.
+ */
+static int
+tsdfx_index_compare(const void *a, const void *b)
+{
+	const struct scan_index_dir *da = a;
+	const struct scan_index_dir *db = b;
+
+	return (strcmp(da->path, db->path));
+}
+
+/*
+ * Parse a line consisting of a one-letter tag, a space and a name which
+ * must not contain a slash.  Returns the name, or NULL if the line is
+ * not of the expected form.
+ */
+static char *
+tsdfx_index_name(char *line, int *tag)
+{
+
+	if ((line[0] != 'f' && line[0] != 's') || line[1] != ' ' ||
+	    line[2] == '\0' || strchr(line + 2, '/') != NULL)
+		return (NULL);
+	*tag = line[0];
+	return (line + 2);
+}
+
+/*
+ * Discard everything we loaded from the index file.
+ */
+static void
+tsdfx_index_unload(struct scan_index *si)
+{
+	size_t i;
+
+	for (i = 0; i < si->ndirs; ++i)
+		free(si->dirs[i].entries);
+	free(si->dirs);
+	si->dirs = NULL;
+	si->ndirs = 0;
+	free(si->buf);
+	si->buf = NULL;
+}
+
+/*
+ * Load the index file.  The format is line-oriented:
+ *
+ *   tsdfx-scanner-index 1 <cycle>
+ *   d <dev> <ino> <mtime> <mtime ns> <ctime> <ctime ns> <n> <path>
+ *   f <name of a file in path>
+ *   s <name of a subdirectory of path>
+ *   ...
+ *   end <number of directories>
+ *
+ * where each d line is followed by exactly n f or s lines.  Anything
+ * we do not understand invalidates the entire index, which just means
+ * that we fall back to a full walk.
+ */
+static void
+tsdfx_index_parse(struct scan_index *si)
+{
+	struct scan_index_dir *sid, *dirs;
+	char *line, *next, *name;
+	uintmax_t nent;
+	intmax_t msec, csec;
+	size_t i, sz;
+	int n, tag;
+
+	sz = 0;
+	for (line = si->buf; *line != '\0'; line = next) {
+		if ((next = strchr(line, '\n')) == NULL)
+			goto invalid;
+		*next++ = '\0';
+		if (line == si->buf) {
+			n = 0;
+			if (sscanf(line, "tsdfx-scanner-index 1 %u%n",
+			    &si->cycle, &n) != 1 || line[n] != '\0')
+				goto invalid;
+			continue;
+		}
+		if (strncmp(line, "end ", 4) == 0) {
+			if (strtoumax(line + 4, &name, 10) != si->ndirs ||
+			    *name != '\0' || *next != '\0')
+				goto invalid;
+			if (si->ndirs > 0)
+				qsort(si->dirs, si->ndirs, sizeof *si->dirs,
+				    tsdfx_index_compare);
+			return;
+		}
+		if (si->ndirs == sz) {
+			sz = sz ? sz * 2 : 256;
+			if ((dirs = realloc(si->dirs, sz * sizeof *dirs)) == NULL)
+				goto invalid;
+			si->dirs = dirs;
+		}
+		sid = &si->dirs[si->ndirs];
+		memset(sid, 0, sizeof *sid);
+		n = 0;
+		if (sscanf(line, "d %ju %ju %jd %ld %jd %ld %ju %n",
+		    &sid->dev, &sid->ino, &msec, &sid->mtim.tv_nsec,
+		    &csec, &sid->ctim.tv_nsec, &nent, &n) != 7 || n == 0 ||
+		    line[n] == '\0' || nent > SIZE_MAX / sizeof(char *))
+			goto invalid;
+		sid->mtim.tv_sec = msec;
+		sid->ctim.tv_sec = csec;
+		sid->path = line + n;
+		si->ndirs++;
+		if (nent > 0 &&
+		    (sid->entries = calloc(nent, sizeof(char *))) == NULL)
+			goto invalid;
+		for (i = 0; i < nent; ++i) {
+			line = next;
+			if ((next = strchr(line, '\n')) == NULL)
+				goto invalid;
+			*next++ = '\0';
+			if (tsdfx_index_name(line, &tag) == NULL)
+				goto invalid;
+			sid->entries[sid->nentries++] = line;
+		}
+	}
+invalid:
+	WARNING("ignoring invalid index %s", indexfile);
+	tsdfx_index_unload(si);
+}
+
+/*
+ * Read the index file into memory and parse it.  A missing index is
+ * not an error; we just have to read everything this time.
+ */
+static int
+tsdfx_index_load(struct scan_index *si)
+{
+	struct stat st;
+	ssize_t rlen;
+	size_t sz;
+	int fd;
+
+	if ((fd = open(si->fn, O_RDONLY|O_NOFOLLOW)) < 0)
+		return (errno == ENOENT ? 0 : -1);
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+		goto done;
+	if ((si->buf = malloc(st.st_size + 1)) == NULL)
+		goto done;
+	for (sz = 0; sz < (size_t)st.st_size; sz += rlen) {
+		if ((rlen = pread(fd, si->buf + sz, st.st_size - sz,
+		    sz)) <= 0) {
+			WARNING("ignoring unreadable index %s", indexfile);
+			tsdfx_index_unload(si);
+			goto done;
+		}
+	}
+	si->buf[sz] = '\0';
+	tsdfx_index_parse(si);
+done:
+	close(fd);
+	return (0);
+}
+
+/*
+ * Prepare for a new scan: start building a new index, and decide
+ * whether to consult the old one or do a full walk.
+ */
+static void
+tsdfx_index_begin(struct scan_index *si)
+{
+
+	time(&si->start);
+	sbuf_clear(si->out);
+	si->nout = 0;
+	si->nreplayed = 0;
+	if (si->ndirs == 0) {
+		si->cycle = 0;
+	} else if (fullwalk > 0 && si->cycle + 1 >= fullwalk) {
+		VERBOSE("ignoring index after %u incremental scans",
+		    si->cycle);
+		tsdfx_index_unload(si);
+		si->cycle = 0;
+	} else {
+		VERBOSE("loaded %zu directories from index", si->ndirs);
+		si->cycle++;
+	}
+}
+
+/*
+ * Open the index file and load its contents, unless it is time for a
+ * full walk.
+ */
+static struct scan_index *
+tsdfx_index_open(const char *fn)
+{
+	struct scan_index *si;
+
+	if ((si = calloc(1, sizeof *si)) == NULL)
+		return (NULL);
+	si->fn = fn;
+	if (tsdfx_index_load(si) != 0) {
+		ERROR("%s: %s", fn, strerror(errno));
+		free(si);
+		return (NULL);
+	}
+	if ((si->out = sbuf_new_auto()) == NULL) {
+		tsdfx_index_unload(si);
+		free(si);
+		return (NULL);
+	}
+	pthread_mutex_init(&si->lock, NULL);
+	return (si);
+}
+
+/*
+ * Look up a directory in the index.  Returns the entry if and only if
+ * the directory is the same one we recorded and has not changed since.
+ */
+static const struct scan_index_dir *
+tsdfx_index_find(const struct scan_index *si, const char *path,
+    const struct stat *st)
+{
+	struct scan_index_dir key;
+	const struct scan_index_dir *sid;
+
+	if (si->ndirs == 0)
+		return (NULL);
+	key.path = path;
+	sid = bsearch(&key, si->dirs, si->ndirs, sizeof *si->dirs,
+	    tsdfx_index_compare);
+	if (sid == NULL ||
+	    sid->dev != (uintmax_t)st->st_dev ||
+	    sid->ino != (uintmax_t)st->st_ino ||
+	    sid->mtim.tv_sec != st->st_mtim.tv_sec ||
+	    sid->mtim.tv_nsec != st->st_mtim.tv_nsec ||
+	    sid->ctim.tv_sec != st->st_ctim.tv_sec ||
+	    sid->ctim.tv_nsec != st->st_ctim.tv_nsec)
+		return (NULL);
+	return (sid);
+}
+
+/*
+ * Add a directory to the new index.  The entries are passed in the same
+ * line-oriented format they are stored in.
+ *
+ * A directory which was modified at or after the time the scan started
+ * may have changed again after we read it, within the resolution of its
+ * timestamps, so we leave it out and read it again next time.
+ */
+static int
+tsdfx_index_add(struct scan_index *si, const char *path,
+    const struct stat *st, size_t nentries, const char *entries, size_t len)
+{
+	int ret;
+
+	if (st->st_mtim.tv_sec >= si->start || st->st_ctim.tv_sec >= si->start)
+		return (0);
+	pthread_mutex_lock(&si->lock);
+	ret = sbuf_printf(si->out, "d %ju %ju %jd %ld %jd %ld %zu %s\n",
+	    (uintmax_t)st->st_dev, (uintmax_t)st->st_ino,
+	    (intmax_t)st->st_mtim.tv_sec, (long)st->st_mtim.tv_nsec,
+	    (intmax_t)st->st_ctim.tv_sec, (long)st->st_ctim.tv_nsec,
+	    nentries, path);
+	if (ret == 0)
+		ret = sbuf_bcat(si->out, entries, len);
+	if (ret == 0)
+		si->nout++;
+	pthread_mutex_unlock(&si->lock);
+	return (ret);
+}
+
+/*
+ * Replace the index file with the new index.  It is written to a
+ * temporary file next to the old one, which is only replaced once the
+ * new one is safely on disk, so that a scanner which dies or runs out
+ * of space halfway through leaves the old index intact.  If we are
+ * going to scan again, the new index also replaces the old one in
+ * memory.
+ */
+static int
+tsdfx_index_save(struct scan_index *si)
+{
+	char tmpfn[PATH_MAX];
+	struct sbuf *sb;
+	const char *p;
+	ssize_t len, wlen;
+	off_t off;
+	int fd, ret, serrno;
+
+	if (snprintf(tmpfn, sizeof tmpfn, "%s.new", si->fn) >=
+	    (int)sizeof tmpfn) {
+		ERROR("failed to save index: %s", strerror(ENAMETOOLONG));
+		return (-1);
+	}
+	if ((sb = sbuf_new_auto()) == NULL)
+		return (-1);
+	if (sbuf_finish(si->out) != 0 ||
+	    sbuf_printf(sb, "tsdfx-scanner-index 1 %u\n", si->cycle) != 0 ||
+	    sbuf_bcat(sb, sbuf_data(si->out), sbuf_len(si->out)) != 0 ||
+	    sbuf_printf(sb, "end %zu\n", si->nout) != 0 ||
+	    sbuf_finish(sb) != 0) {
+		sbuf_delete(sb);
+		return (-1);
+	}
+	ret = -1;
+	p = sbuf_data(sb);
+	len = sbuf_len(sb);
+	/* whatever is left over from last time may not even be ours */
+	(void)unlink(tmpfn);
+	if ((fd = open(tmpfn, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, 0600)) < 0)
+		goto done;
+	for (off = 0; off < len; off += wlen)
+		if ((wlen = pwrite(fd, p + off, len - off, off)) < 0)
+			break;
+	if (off == len && fsync(fd) == 0 && close(fd) == 0) {
+		fd = -1;
+		if (rename(tmpfn, si->fn) == 0)
+			ret = 0;
+	}
+	if (ret != 0) {
+		serrno = errno;
+		if (fd >= 0)
+			close(fd);
+		(void)unlink(tmpfn);
+		errno = serrno;
+	}
+done:
+	if (ret != 0)
+		ERROR("failed to save index: %s", strerror(errno));
+	else
+		VERBOSE("saved %zu directories to index (%ld replayed)",
+		    si->nout, si->nreplayed);
+	if (ret == 0 && persistent) {
+		tsdfx_index_unload(si);
+		if ((si->buf = malloc(len + 1)) != NULL) {
+			memcpy(si->buf, p, len + 1);
+			tsdfx_index_parse(si);
+		}
+	}
+	sbuf_delete(sb);
+	return (ret);
+}
+
+/*
+ * Close the index file and free everything.
+ */
+static void
+tsdfx_index_close(struct scan_index *si)
+{
+
+	if (si == NULL)
+		return;
+	tsdfx_index_unload(si);
+	sbuf_delete(si->out);
+	pthread_mutex_destroy(&si->lock);
+	free(si);
+}
+
+/*
+ * Initialize the workers and their worklists.
+ */
+static struct scanpath *
+tsdfx_scan_init(unsigned int nworkers)
+{
 	struct scanpath *sp;
+	unsigned int i;
 
+	ASSERT(nworkers > 0);
 	if ((sp = calloc(1, sizeof *sp)) == NULL)
 		return (NULL);
-	if ((se = calloc(1, sizeof *se)) == NULL)
-		goto fail;
-	if ((se->path = sbuf_new_auto()) == NULL ||
-	    sbuf_cpy(se->path, root) != 0 ||
-	    sbuf_finish(se->path) != 0)
-		goto fail;
-	sp->todo = sp->tail = se;
+	if ((sp->workers = calloc(nworkers, sizeof *sp->workers)) == NULL) {
+		free(sp);
+		return (NULL);
+	}
+	sp->nworkers = nworkers;
+	pthread_mutex_init(&sp->lock, NULL);
+	pthread_cond_init(&sp->cond, NULL);
+	for (i = 0; i < nworkers; ++i) {
+		sp->workers[i].sp = sp;
+		sp->workers[i].id = i;
+		pthread_mutex_init(&sp->workers[i].lock, NULL);
+	}
 	sp->processed = 0;
+	if (indexfile != NULL &&
+	    (sp->index = tsdfx_index_open(indexfile)) == NULL)
+		goto fail;
 	return (sp);
 fail:
-	tsdfx_scan_free(se);
-	se = NULL;
+	tsdfx_index_close(sp->index);
+	for (i = 0; i < nworkers; ++i)
+		pthread_mutex_destroy(&sp->workers[i].lock);
+	pthread_cond_destroy(&sp->cond);
+	pthread_mutex_destroy(&sp->lock);
+	free(sp->workers);
 	free(sp);
-	sp = NULL;
 	return (NULL);
 }
 
 /*
- * Empty the worklist and file list.
+ * Empty the worklists and free everything.
  */
 static void
 tsdfx_scan_cleanup(struct scanpath *sp)
 {
-	struct scan_entry *se;
+	unsigned int i;
 
-	while ((se = tsdfx_scan_next(sp)) != NULL)
-		tsdfx_scan_free(se);
+	for (i = 0; i < sp->nworkers; ++i) {
+		free(sp->workers[i].chunk);
+		free(sp->workers[i].spare);
+		free(sp->workers[i].dents);
+		free(sp->workers[i].names);
+		pthread_mutex_destroy(&sp->workers[i].lock);
+	}
+	tsdfx_index_close(sp->index);
+	pthread_cond_destroy(&sp->cond);
+	pthread_mutex_destroy(&sp->lock);
+	free(sp->workers);
 	free(sp);
 	sp = NULL;
 }
 
 /*
- * Process a directory entry.
+ * Learn what we need to know about a directory entry without following
+ * symlinks.  Normally, that is only its type, which the caller may
+ * already know from d_type or from the index; otherwise, ask for the
+ * type and nothing else.  The type of an inode never changes, so there
+ * is no need for a network file system to revalidate its cached
+ * attributes.  If we are producing records, we need everything.
  */
 static int
-tsdfx_process_dirent(struct scanpath *sp, const struct sbuf *parent,
-		     int dd, const struct dirent *de)
+tsdfx_scan_stat(int dd, const char *name, mode_t type, struct stat *st)
 {
-	const char *p;
-	struct sbuf *path;
-	struct stat st;
-	int ret, serrno;
+#if HAVE_STATX
+	struct statx stx;
+#endif
 
-	/* validate file name */
-	for (p = de->d_name; *p; ++p) {
-		if (!is_pfcs(*p) && *p != ' ') { /* XXX allow spaces for now */
-			/* soft error */
-			size_t len = strlen(de->d_name);
-			size_t olen = percent_enclen(len);
-			char *encpath = calloc(1, olen);
-			if (0 == percent_encode(de->d_name, len, encpath, &olen)) {
-				USERERROR("invalid character in file '%s/%s' [inode %lu]",
-				       sbuf_data(parent), encpath,
-				       (unsigned long)de->d_ino);
-			} else {
-				USERERROR("invalid character in file '%s/[inode %lu]'",
-				       sbuf_data(parent), (unsigned long)de->d_ino);
-			}
-			free(encpath);
-			return (0);
-		}
+	if (records)
+		return (fstatat(dd, name, st, AT_SYMLINK_NOFOLLOW));
+	memset(st, 0, sizeof *st);
+	if (type != 0) {
+		st->st_mode = type;
+		return (0);
 	}
-	/*
-	 * XXX insufficient, the master process will reject names that
-	 * start or end with a space
-	 */
-
-	/* check file type */
-	if (fstatat(dd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
-		if (errno == EACCES || errno == EPERM) {
-			USERERROR("%s/%s inaccessible", sbuf_data(parent),
-			    de->d_name);
-			return (0);
-		} else if (errno == ENOENT) {
-			VERBOSE("%s/%s disappeared", sbuf_data(parent),
-			    de->d_name);
-			return (0);
-		}
-		/* hard error */
-		ERROR("fstat(%s/%s): %s", sbuf_data(parent), de->d_name,
-		    strerror(errno));
+#if HAVE_STATX
+	if (statx(dd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+	    STATX_TYPE, &stx) == 0) {
+		st->st_mode = stx.stx_mode & S_IFMT;
+		return (0);
+	}
+	if (errno != ENOSYS)
 		return (-1);
+#endif
+	return (fstatat(dd, name, st, AT_SYMLINK_NOFOLLOW));
+}
+
+/*
+ * Look up a directory entry, reporting any errors.  Returns 0 on
+ * success, 1 if the entry should be skipped and -1 on error.
+ */
+static int
+tsdfx_scan_lookup(const char *parent, int dd, const char *name,
+    mode_t type, struct stat *st)
+{
+
+	if (tsdfx_scan_stat(dd, name, type, st) == 0)
+		return (0);
+	if (errno == EACCES || errno == EPERM) {
+		USERERROR("%s/%s inaccessible", parent, name);
+		return (1);
+	} else if (errno == ENOENT) {
+		VERBOSE("%s/%s disappeared", parent, name);
+		return (1);
 	}
+	/* hard error */
+	ERROR("fstat(%s/%s): %s", parent, name, strerror(errno));
+	return (-1);
+}
+
+/*
+ * Write a record describing a file or directory to stdout.  Other
+ * threads may be doing the same, so hold the lock for the duration.
+ */
+static int
+tsdfx_scan_record(const char *p, const char *suffix, const struct stat *st)
+{
+	struct tsdfx_scanrec sr;
+	size_t len, slen;
+	int ret;
+
+	len = strlen(p);
+	slen = strlen(suffix);
+	memset(&sr, 0, sizeof sr);
+	sr.len = sizeof sr + len + slen;
+	sr.mode = st->st_mode;
+	sr.size = st->st_size;
+	sr.mtime = st->st_mtim.tv_sec;
+	sr.mtime_nsec = st->st_mtim.tv_nsec;
+	sr.atime = st->st_atim.tv_sec;
+	sr.atime_nsec = st->st_atim.tv_nsec;
+	sr.ino = st->st_ino;
+	sr.dev = st->st_dev;
+	flockfile(stdout);
+	ret = fwrite(&sr, sizeof sr, 1, stdout) == 1 &&
+	    fwrite(p, 1, len, stdout) == len &&
+	    fwrite(suffix, 1, slen, stdout) == slen ? 0 : -1;
+	funlockfile(stdout);
+	return (ret);
+}
+
+/*
+ * Print a file or directory we found and, if it is a directory, add it
+ * to the worklist.  If we are building an index, also record it there.
+ * Returns 0 if the entry was reported, 1 if it was skipped and -1 on
+ * error.
+ */
+static int
+tsdfx_scan_emit(struct scan_worker *sw, struct scan_entry *parent, int dd,
+    const char *name, const struct stat *st, struct sbuf *rec)
+{
+	char path[PATH_MAX];
+	const char *p;
+	mode_t type;
+	int ret;
 
 	/* full path */
-	if ((path = sbuf_new_auto()) == NULL ||
-	    sbuf_printf(path, "%s/%s", sbuf_data(parent), de->d_name) != 0 ||
-	    sbuf_finish(path) != 0) {
-		serrno = errno;
-		sbuf_delete(path);
-		errno = serrno;
-		return (-1);
+	if (snprintf(path, sizeof path, "%s/%s", parent->path, name) >=
+	    (int)sizeof path) {
+		/* soft error */
+		USERERROR("%s/%s: path too long", parent->path, name);
+		return (1);
 	}
 
 	ret = 0;
-	p = sbuf_data(path);
+	p = path;
 	if ((p[0] == '.' || p[0] == '/') && p[1] == '/')
 		++p;
-	switch (st.st_mode & S_IFMT) {
+	type = st->st_mode & S_IFMT;
+	switch (type) {
 	case S_IFDIR:
-		printf("%s/\n", p);
-		if (tsdfx_scan_append(sp, path) == NULL) {
+		if (records)
+			ret = tsdfx_scan_record(p, "/", st);
+		else
+			printf("%s/\n", p);
+		if (ret == 0 && parent->fd < 0)
+			tsdfx_scan_hold(sw->sp, parent, dd);
+		if (ret == 0 && tsdfx_scan_append(sw, parent, path) == NULL) {
 			/* hard error */
 			ERROR("failed to append %s to scan list", p);
 			ret = -1;
 		}
 		break;
 	case S_IFREG:
-		printf("%s\n", p);
+		if (records)
+			ret = tsdfx_scan_record(p, "", st);
+		else
+			printf("%s\n", p);
 		break;
 	case S_IFLNK:
 		/* soft error */
 		USERERROR("ignoring symlink %s", p);
+		ret = 1;
 		break;
 	default:
 		/* soft error */
-		USERERROR("found strange file: %s (%#o)", p,
-		    st.st_mode & S_IFMT);
+		USERERROR("found strange file: %s (%#o)", p, type);
+		ret = 1;
 		break;
 	}
-	sbuf_delete(path);
+	if (ret == 0 && rec != NULL &&
+	    sbuf_printf(rec, "%c %s\n", type == S_IFDIR ? 's' : 'f', name) != 0)
+		ret = -1;
+	return (ret);
+}
+
+/*
+ * Process a directory entry.  The type, if not zero, is what the
+ * directory told us.  Returns 0 if the entry was reported, 1 if it was
+ * skipped and -1 on error.
+ */
+static int
+tsdfx_process_dirent(struct scan_worker *sw, struct scan_entry *parent,
+		     int dd, const char *name, uint64_t ino, mode_t type,
+		     struct sbuf *rec)
+{
+	const char *p;
+	struct stat st;
+	int ret;
+
+	/* validate file name */
+	for (p = name; *p; ++p) {
+		if (!is_pfcs(*p) && *p != ' ') { /* XXX allow spaces for now */
+			/* soft error */
+			size_t len = strlen(name);
+			size_t olen = percent_enclen(len);
+			char *encpath = calloc(1, olen);
+			if (0 == percent_encode(name, len, encpath, &olen)) {
+				USERERROR("invalid character in file '%s/%s' [inode %lu]",
+				       parent->path, encpath,
+				       (unsigned long)ino);
+			} else {
+				USERERROR("invalid character in file '%s/[inode %lu]'",
+				       parent->path, (unsigned long)ino);
+			}
+			free(encpath);
+			return (1);
+		}
+	}
+	/*
+	 * XXX insufficient, the master process will reject names that
+	 * start or end with a space
+	 */
+
+	if ((ret = tsdfx_scan_lookup(parent->path, dd, name, type, &st)) != 0)
+		return (ret);
+
+	return (tsdfx_scan_emit(sw, parent, dd, name, &st, rec));
+}
+
+/*
+ * Check whether a directory entry should be ignored because its name
+ * starts with a period.  Returns 1, after telling the user, if it should.
+ */
+static int
+tsdfx_scan_dotfile(const char *path, const struct dirent *de)
+{
+	size_t len, olen;
+	char *encpath;
+
+	if (de->d_name[0] != '.')
+		return (0);
+	len = strlen(de->d_name);
+	olen = percent_enclen(len);
+	encpath = calloc(1, olen);
+	if (0 == percent_encode(de->d_name, len, encpath, &olen)) {
+		USERERROR("ignoring dot file '%s/%s' [inode %lu]",
+		    path, encpath,
+		       (unsigned long)de->d_ino);
+	} else {
+		USERERROR("ignoring dot file '%s/[inode %lu]'",
+		       path, (unsigned long)de->d_ino);
+	}
+	free(encpath);
+	return (1);
+}
+
+/*
+ * Return the type of a directory entry as reported by the directory,
+ * or zero if unknown or if we shouldn't trust it.
+ */
+static mode_t
+tsdfx_scan_dtype(const struct dirent *de, int usedtype)
+{
+
+#if HAVE_STRUCT_DIRENT_D_TYPE
+	if (usedtype && de->d_type != DT_UNKNOWN)
+		return (DTTOIF(de->d_type));
+#else
+	(void)de;
+	(void)usedtype;
+#endif
+	return (0);
+}
+
+/*
+ * Compare two read-ahead directory entries by inode number.
+ */
+static int
+tsdfx_scan_dirent_compare(const void *a, const void *b)
+{
+	const struct scan_dirent *da = a;
+	const struct scan_dirent *db = b;
+
+	return (da->ino < db->ino ? -1 : da->ino > db->ino ? 1 : 0);
+}
+
+/*
+ * Read the rest of a directory into the worker's read-ahead buffers and
+ * sort the entries by inode number, so that looking them up hits the
+ * inode table in order instead of jumping around it.  If we know the
+ * type of every entry and aren't producing records, we won't be looking
+ * any of them up, so don't bother sorting.  Returns the number of
+ * entries, or -1 on error.
+ */
+static long
+tsdfx_scan_readahead(struct scan_worker *sw, DIR *dir, const char *path,
+    int usedtype, int *skipped)
+{
+	struct scan_dirent *dents;
+	struct dirent *de;
+	size_t len, n, namelen, nstat, sz;
+	char *names;
+
+	n = namelen = nstat = 0;
+	while ((de = readdir(dir)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+		/* ignore all entries that start with a period */
+		if (tsdfx_scan_dotfile(path, de)) {
+			*skipped = 1;
+			continue;
+		}
+		if (n == sw->dentsz) {
+			sz = sw->dentsz ? sw->dentsz * 2 : 256;
+			if ((dents = realloc(sw->dents, sz * sizeof *dents)) == NULL)
+				return (-1);
+			sw->dents = dents;
+			sw->dentsz = sz;
+		}
+		len = strlen(de->d_name) + 1;
+		if (namelen + len > sw->namesz) {
+			for (sz = sw->namesz ? sw->namesz : 4096;
+			     namelen + len > sz; sz *= 2)
+				/* nothing */ ;
+			if ((names = realloc(sw->names, sz)) == NULL)
+				return (-1);
+			sw->names = names;
+			sw->namesz = sz;
+		}
+		memcpy(sw->names + namelen, de->d_name, len);
+		sw->dents[n].ino = de->d_ino;
+		sw->dents[n].type = tsdfx_scan_dtype(de, usedtype);
+		sw->dents[n].name = namelen;
+		if (sw->dents[n].type == 0)
+			nstat++;
+		namelen += len;
+		n++;
+	}
+	if (n > 0 && (records || nstat > 0))
+		qsort(sw->dents, n, sizeof *sw->dents,
+		    tsdfx_scan_dirent_compare);
+	return ((long)n);
+}
+
+/*
+ * Report the contents of a directory which has not changed since it was
+ * recorded in the index, and carry it over into the new index.  The
+ * contents of the files it contains may well have changed, so if we are
+ * producing records, we still need to stat them.
+ */
+static int
+tsdfx_scan_replay(struct scan_worker *sw, struct scan_entry *se, int dd,
+    const struct stat *st, const struct scan_index_dir *sid)
+{
+	struct scanpath *sp = sw->sp;
+	struct stat est;
+	struct sbuf *rec;
+	const char *e;
+	size_t i;
+	int ret, skipped;
+
+	if ((rec = sbuf_new_auto()) == NULL)
+		return (-1);
+	ret = skipped = 0;
+	for (i = 0; ret == 0 && !tsdfx_scan_failed(sp) &&
+	    i < sid->nentries; ++i) {
+		e = sid->entries[i];
+		switch (tsdfx_scan_lookup(se->path, dd, e + 2,
+		    e[0] == 's' ? S_IFDIR : S_IFREG, &est)) {
+		case 0:
+			break;
+		case 1:
+			skipped = 1;
+			continue;
+		default:
+			ret = -1;
+			continue;
+		}
+		switch (tsdfx_scan_emit(sw, se, dd, e + 2, &est, rec)) {
+		case 0:
+			break;
+		case 1:
+			skipped = 1;
+			continue;
+		default:
+			ret = -1;
+			continue;
+		}
+		if (tsdfx_scan_count(sp) != 0) {
+			USERERROR("too many files in source, please reduce file count using zip/tar.");
+			ret = -1;
+		}
+	}
+	if (ret == 0 && !skipped && (sbuf_finish(rec) != 0 ||
+	    tsdfx_index_add(sp->index, se->path, st, sid->nentries,
+	    sbuf_data(rec), sbuf_len(rec)) != 0))
+		ret = -1;
+	if (ret == 0) {
+		pthread_mutex_lock(&sp->index->lock);
+		sp->index->nreplayed++;
+		pthread_mutex_unlock(&sp->index->lock);
+	}
+	sbuf_delete(rec);
 	return (ret);
 }
 
@@ -268,64 +1293,252 @@ tsdfx_process_dirent(struct scanpath *sp, const struct sbuf *parent,
  * Process a single worklist entry (directory).
  */
 static int
-tsdfx_scan_process_directory(struct scanpath *sp, const struct sbuf *path)
+tsdfx_scan_process_directory(struct scan_worker *sw, struct scan_entry *se)
 {
+	struct scanpath *sp = sw->sp;
+	const char *path = se->path;
+	const struct scan_index_dir *sid;
+	struct sbuf *rec;
+	struct stat st;
 	DIR *dir;
 	struct dirent *de;
-	int dd, ret, serrno;
+	const char *name;
+	uint64_t ino;
+	mode_t type;
+	size_t nentries;
+	long i, nahead;
+	int dd, ret, serrno, skipped, usedtype;
 
 	ret = 0;
-	if ((dd = open(sbuf_data(path), O_RDONLY)) < 0) {
+	if (se->parent == NULL)
+		dd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	else if (se->parent->fd >= 0)
+		dd = openat(se->parent->fd, se->name,
+		    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	else
+		dd = open(path,
+		    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (dd < 0) {
 		if (errno == ENOENT) {
-			VERBOSE("%s disappeared", sbuf_data(path));
+			VERBOSE("%s disappeared", path);
 			return (0);
 		} else if (errno == EACCES || errno == EPERM) {
-			USERERROR("%s inaccessible", sbuf_data(path));
+			USERERROR("%s inaccessible", path);
+			return (0);
+		} else if (se->parent != NULL &&
+		    (errno == ELOOP || errno == ENOTDIR)) {
+			/* replaced since we saw it */
+			VERBOSE("%s is no longer a directory", path);
 			return (0);
 		}
-		ERROR("%s: %s", sbuf_data(path), strerror(errno));
+		ERROR("%s: %s", path, strerror(errno));
 		return (-1);
 	}
+	/*
+	 * If the directory is in the index and has not changed, we
+	 * already know what's in it.  Otherwise, read it and record what
+	 * we find so we don't have to next time.
+	 */
+	rec = NULL;
+	if (sp->index != NULL && fstat(dd, &st) == 0) {
+		sid = tsdfx_index_find(sp->index, path, &st);
+		if (sid != NULL) {
+			ret = tsdfx_scan_replay(sw, se, dd, &st, sid);
+			close(dd);
+			return (ret);
+		}
+		if ((rec = sbuf_new_auto()) == NULL) {
+			close(dd);
+			return (-1);
+		}
+	}
 	if ((dir = fdopendir(dd)) == NULL) {
-		ERROR("%s: %s", sbuf_data(path), strerror(errno));
+		ERROR("%s: %s", path, strerror(errno));
+		close(dd);
+		if (rec != NULL)
+			sbuf_delete(rec);
 		return (-1);
 	}
-	while (ret == 0 && (de = readdir(dir)) != NULL) {
-		if (strcmp(de->d_name, ".") == 0 ||
-		    strcmp(de->d_name, "..") == 0)
-			continue;
-		/* ignore all entries that start with a period */
-		if (de->d_name[0] == '.') {
-			size_t len = strlen(de->d_name);
-			size_t olen = percent_enclen(len);
-			char *encpath = calloc(1, olen);
-			if (0 == percent_encode(de->d_name, len, encpath, &olen)) {
-				USERERROR("ignoring dot file '%s/%s' [inode %lu]",
-				    sbuf_data(path), encpath,
-				       (unsigned long)de->d_ino);
-			} else {
-				USERERROR("ignoring dot file '%s/[inode %lu]'",
-				       sbuf_data(path), (unsigned long)de->d_ino);
+	/*
+	 * If we can read the directory but not search it, we can learn
+	 * the names and types of its entries but not access them.  Skip
+	 * the d_type shortcut so each of them is reported as inaccessible.
+	 */
+	usedtype = faccessat(dd, ".", X_OK, 0) == 0;
+	nentries = 0;
+	skipped = 0;
+	nahead = -1;
+	if (inodeorder &&
+	    (nahead = tsdfx_scan_readahead(sw, dir, path, usedtype,
+	    &skipped)) < 0) {
+		ERROR("%s: %s", path, strerror(errno));
+		ret = -1;
+	}
+	for (i = 0; ret == 0 && !tsdfx_scan_failed(sp); ++i) {
+		if (nahead >= 0) {
+			if (i >= nahead)
+				break;
+			name = sw->names + sw->dents[i].name;
+			ino = sw->dents[i].ino;
+			type = sw->dents[i].type;
+		} else {
+			if ((de = readdir(dir)) == NULL)
+				break;
+			if (strcmp(de->d_name, ".") == 0 ||
+			    strcmp(de->d_name, "..") == 0)
+				continue;
+			/* ignore all entries that start with a period */
+			if (tsdfx_scan_dotfile(path, de)) {
+				skipped = 1;
+				continue;
 			}
-			free(encpath);
+			name = de->d_name;
+			ino = de->d_ino;
+			type = tsdfx_scan_dtype(de, usedtype);
+		}
+		switch (tsdfx_process_dirent(sw, se, dd, name, ino, type,
+		    rec)) {
+		case 0:
+			nentries++;
+			break;
+		case 1:
+			skipped = 1;
+			break;
+		default:
+			ret = -1;
 			continue;
 		}
-		if (tsdfx_process_dirent(sp, path, dd, de) != 0)
+		if (tsdfx_scan_count(sp) != 0) {
+			USERERROR("too many files in source, please reduce file count using zip/tar.");
 			ret = -1;
-		else {
-			sp->processed++;
-			if (0 != maxfiles && sp->processed >= maxfiles) {
-				USERERROR("too many files in source, please reduce file count using zip/tar.");
-				ret = -1;
-			}
 		}
 	}
 	serrno = errno;
 	closedir(dir);
+	/*
+	 * Directories in which we skipped something are left out of the
+	 * index so the user keeps getting told about it.
+	 */
+	if (ret == 0 && rec != NULL && !skipped && !tsdfx_scan_failed(sp) &&
+	    (sbuf_finish(rec) != 0 ||
+	    tsdfx_index_add(sp->index, path, &st, nentries,
+	    sbuf_data(rec), sbuf_len(rec)) != 0))
+		ret = -1;
+	if (rec != NULL)
+		sbuf_delete(rec);
 	errno = serrno;
 	return (ret);
 }
 
+/*
+ * Worker thread: process worklist entries until there are none left
+ * anywhere or one of the workers fails.
+ */
+static void *
+tsdfx_scan_worker(void *arg)
+{
+	struct scan_worker *sw = arg;
+	struct scan_entry *se;
+	int ret;
+
+	while ((se = tsdfx_scan_next(sw)) != NULL) {
+		ret = tsdfx_scan_process_directory(sw, se);
+		if (ret != 0)
+			VERBOSE("FAILED scanning directory '%s'", se->path);
+		tsdfx_scan_free(sw->sp, se);
+		tsdfx_scan_done(sw, ret != 0);
+	}
+	return (NULL);
+}
+
+/*
+ * Discard whatever is left on the worklists after a failed scan.
+ */
+static void
+tsdfx_scan_drain(struct scanpath *sp)
+{
+	struct scan_entry *se;
+	unsigned int i;
+
+	for (i = 0; i < sp->nworkers; ++i)
+		while ((se = tsdfx_scan_pop(&sp->workers[i])) != NULL)
+			tsdfx_scan_free(sp, se);
+	sp->queued = sp->pending = 0;
+}
+
+/*
+ * Scan the specified directory and all its subdirectories once.
+ */
+static int
+tsdfx_scan_run(struct scanpath *sp, const char *path)
+{
+	unsigned int i, nworkers;
+	int ret;
+	struct timespec timer_end, timer_start;
+
+	sp->failed = 0;
+	sp->processed = 0;
+	if (sp->index != NULL)
+		tsdfx_index_begin(sp->index);
+	if (tsdfx_scan_append(&sp->workers[0], NULL, path) == NULL)
+		return (-1);
+
+#define ELAPSED(start, end) ((double)(end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec)/(double)1e9))
+	clock_gettime(CLOCK_MONOTONIC, &timer_start);
+
+	/* the main thread is worker 0 */
+	for (nworkers = 1; nworkers < sp->nworkers; ++nworkers) {
+		if ((errno = pthread_create(&sp->workers[nworkers].thr, NULL,
+		    tsdfx_scan_worker, &sp->workers[nworkers])) != 0) {
+			WARNING("unable to start worker thread: %s",
+			    strerror(errno));
+			break;
+		}
+	}
+	tsdfx_scan_worker(&sp->workers[0]);
+	for (i = 1; i < nworkers; ++i)
+		pthread_join(sp->workers[i].thr, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &timer_end);
+	if (sp->failed) {
+		VERBOSE("FAILED scanning '%s', measured time: %.3lf s",
+		    path, ELAPSED(timer_start, timer_end));
+		tsdfx_scan_drain(sp);
+		ret = -1;
+	} else {
+		ASSERT(sp->pending == 0 && sp->queued == 0);
+		VERBOSE("found %li dir entries in %u threads, measured time: %.3lf s",
+		    sp->processed, nworkers, ELAPSED(timer_start, timer_end));
+		ret = 0;
+		if (sp->index != NULL)
+			tsdfx_index_save(sp->index);
+	}
+	return (ret);
+}
+
+/*
+ * Tell a persistent scanner's master that a scan is complete.
+ */
+static int
+tsdfx_scan_marker(int failed)
+{
+	struct tsdfx_scanrec sr;
+	int ret;
+
+	if (records) {
+		memset(&sr, 0, sizeof sr);
+		sr.len = sizeof sr;
+		sr.mode = failed ? 1 : 0;
+		ret = fwrite(&sr, sizeof sr, 1, stdout) == 1 ? 0 : -1;
+	} else {
+		ret = printf("%s\n", failed ? TSDFX_SCAN_FAILED :
+		    TSDFX_SCAN_DONE) < 0 ? -1 : 0;
+	}
+	if (fflush(stdout) != 0)
+		ret = -1;
+	return (ret);
+}
+
 /*
  * Entry point for the directory scanner child process.
  *
@@ -333,46 +1546,57 @@ tsdfx_scan_process_directory(struct scanpath *sp, const struct sbuf *path)
  * subdirectories and prints the name of every regular file it finds.  It
  * ignores symlinks and files or directories whose names contain
  * characters outside the POSIX portable filename character set.
+ *
+ * If more than one thread was requested, the directories are spread
+ * across that many worker threads.  Each line of output is printed with
+ * a single call to printf(), so lines from different workers are never
+ * interleaved.
+ *
+ * In persistent mode, the scanner waits for a "rescan" command on stdin
+ * before each scan, marks the end of each scan in its output, and keeps
+ * its worklists and index from one scan to the next.  It exits when
+ * stdin is closed.
  */
 int
 tsdfx_scanner(const char *path)
 {
-	struct scan_entry *se;
 	struct scanpath *sp;
-	int serrno;
-	struct timespec timer_end, timer_start;
+	char cmd[64];
+	size_t len;
+	int ret;
 
-	if ((sp = tsdfx_scan_init(path)) == NULL)
+	if ((sp = tsdfx_scan_init(nthreads)) == NULL)
 		return (-1);
-
-#define ELAPSED(start, end) ((double)(end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec)/(double)1e9))
-	clock_gettime(CLOCK_MONOTONIC, &timer_start);
-
-	while ((se = tsdfx_scan_next(sp)) != NULL) {
-		if (tsdfx_scan_process_directory(sp, se->path) != 0) {
-			serrno = errno;
-			tsdfx_scan_free(se);
-			tsdfx_scan_cleanup(sp);
-			errno = serrno;
-			clock_gettime(CLOCK_MONOTONIC, &timer_end);
-			VERBOSE("FAILED scanning directory '%s', measured time: %.3lf s", se->path, ELAPSED(timer_start, timer_end));
-			return (-1);
+	if (!persistent) {
+		ret = tsdfx_scan_run(sp, path);
+	} else {
+		ret = 0;
+		while (fgets(cmd, sizeof cmd, stdin) != NULL) {
+			len = strlen(cmd);
+			if (len > 0 && cmd[len - 1] == '\n')
+				cmd[--len] = '\0';
+			if (strcmp(cmd, "rescan") != 0) {
+				WARNING("unrecognized command: %s", cmd);
+				continue;
+			}
+			if (tsdfx_scan_marker(tsdfx_scan_run(sp, path) != 0) != 0) {
+				ERROR("failed to write to master: %s",
+				    strerror(errno));
+				ret = -1;
+				break;
+			}
 		}
 	}
-	clock_gettime(CLOCK_MONOTONIC, &timer_end);
-	ASSERT(sp->todo == NULL && sp->tail == NULL);
-	VERBOSE("found %li dir entries, measured time: %.3lf s",
-	       sp->processed, path, ELAPSED(timer_start, timer_end));
 	tsdfx_scan_cleanup(sp);
 	sp = NULL;
-	return (0);
+	return (ret);
 }
 
 static void
 usage(void)
 {
 
-	fprintf(stderr, "usage: tsdfx-scanner [-v] [-l logname] [-M maxfiles] path\n");
+	fprintf(stderr, "usage: tsdfx-scanner [-bpsv] [-F fullwalk] [-i index] [-j threads] [-l logname] [-M maxfiles] path\n");
 	exit(1);
 }
 
@@ -381,11 +1605,35 @@ main(int argc, char *argv[])
 {
 	char *end;
 	const char *logfile, *userlog;
+	unsigned long n;
 	int opt;
 
 	logfile = userlog = NULL;
-	while ((opt = getopt(argc, argv, "hl:M:v")) != -1)
+	while ((opt = getopt(argc, argv, "bF:hi:j:l:M:psv")) != -1)
 		switch (opt) {
+		case 'b':
+			++records;
+			break;
+		case 'F':
+			n = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || n > UINT_MAX) {
+				fprintf(stderr, "unable to parse full walk interval");
+				usage();
+			}
+			fullwalk = n;
+			break;
+		case 'i':
+			indexfile = optarg;
+			break;
+		case 'j':
+			n = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || n < 1 ||
+			    n > TSDFX_SCAN_MAX_THREADS) {
+				fprintf(stderr, "unable to parse thread count");
+				usage();
+			}
+			nthreads = n;
+			break;
 		case 'l':
 			if (strncmp(optarg, ":user=", 6) == 0)
 				userlog = optarg + 6;
@@ -399,6 +1647,12 @@ main(int argc, char *argv[])
 				usage();
 			}
 			break;
+		case 'p':
+			++persistent;
+			break;
+		case 's':
+			++inodeorder;
+			break;
 		case 'v':
 			++tsd_log_verbose;
 			break;
@@ -0,0 +1,99 @@
+/*-
+ * Copyright (c) 2026 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Test for the credential cache: repeated lookups of the same user, or
+ * of a user who does not exist, must only go to the name service once,
+ * until the cache is flushed or disabled.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <tsd/cred.h>
+
+#include "testsuite.h"
+
+/* a UID which is unlikely to belong to anyone */
+#define NOUSER ((uid_t)1999999999)
+
+static unsigned long hits, misses;
+
+/*
+ * Look up a user and check the outcome and the effect on the counters.
+ */
+static void
+check(const char *what, uid_t uid, int exists, int hit)
+{
+	struct tsd_cred cred;
+	unsigned long h, m;
+	int ret;
+
+	ret = tsd_cred_lookup(uid, &cred);
+	if (exists && ret != 0)
+		FAIL("%s: lookup failed: %s\n", what, strerror(errno));
+	else if (!exists && (ret == 0 || errno != ENOENT))
+		FAIL("%s: lookup did not fail with ENOENT\n", what);
+	else if (exists && (cred.uid != uid || cred.ngids < 1))
+		FAIL("%s: incorrect credentials\n", what);
+	tsd_cred_stats(&h, &m);
+	if (h != hits + !!hit || m != misses + !hit)
+		FAIL("%s: expected a %s\n", what, hit ? "hit" : "miss");
+	hits = h;
+	misses = m;
+}
+
+int
+main(void)
+{
+
+	check("first lookup", 0, 1, 0);
+	check("second lookup", 0, 1, 1);
+	if (getpwuid(NOUSER) == NULL) {
+		check("missing user", NOUSER, 0, 0);
+		check("missing user again", NOUSER, 0, 1);
+	}
+	tsd_cred_flush();
+	check("after flush", 0, 1, 0);
+	tsd_cred_setttl(0, 0);
+	check("uncached", 0, 1, 0);
+	check("uncached again", 0, 1, 0);
+	tsd_cred_flush();
+	test_exit();
+}
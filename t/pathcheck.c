@@ -0,0 +1,212 @@
+/*-
+ * Copyright (c) 2026 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Differential test and microbenchmark for tsd_pathcheck().  The
+ * reference is the regular expression it replaced, which it must agree
+ * with on every input.
+ *
+ * usage: pathcheck [-b iterations]
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <regex.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tsd/pathcheck.h>
+
+#include "testsuite.h"
+
+#define PATH_REGEX \
+	"^(/[0-9A-Za-z_-]([ 0-9A-Za-z._-]*[0-9A-Za-z._-])?)+/?$"
+static regex_t path_regex;
+
+/* interesting characters, and a few uninteresting ones */
+static const char alphabet[] = "/a.Z 0_-~\t\xe5";
+#define NALPHA (sizeof alphabet - 1)
+
+static unsigned long ntests;
+
+static void
+check(const char *path, size_t len)
+{
+	int expect, got;
+
+	expect = regexec(&path_regex, path, 0, NULL, 0) == 0;
+	got = tsd_pathcheck(path, len) != 0;
+	ntests++;
+	if (got != expect)
+		FAIL("mismatch: \"%.*s\": expected %d, got %d\n",
+		    (int)len, path, expect, got);
+}
+
+/*
+ * Check every string over the alphabet up to the given length.
+ */
+static void
+exhaustive(size_t maxlen)
+{
+	char buf[16];
+	size_t idx[16];
+	size_t i, len;
+
+	for (len = 0; len <= maxlen; ++len) {
+		memset(idx, 0, sizeof idx);
+		for (;;) {
+			for (i = 0; i < len; ++i)
+				buf[i] = alphabet[idx[i]];
+			buf[len] = '\0';
+			check(buf, len);
+			for (i = 0; i < len && ++idx[i] == NALPHA; ++i)
+				idx[i] = 0;
+			if (i == len)
+				break;
+		}
+	}
+}
+
+/*
+ * Check longer strings which mostly look like paths.
+ */
+static void
+random_paths(unsigned long n)
+{
+	static const char pfcs[] = "abcXYZ019_-";
+	char buf[256];
+	uint32_t x;
+	size_t i, len;
+
+	x = 1;
+	while (n-- > 0) {
+		len = 0;
+		while (len < sizeof buf - 1) {
+			x = x * 1103515245 + 12345;
+			if ((x >> 16) % 16 == 0)
+				break;
+			switch ((x >> 20) % 8) {
+			case 0:
+				buf[len++] = '/';
+				break;
+			case 1:
+				buf[len++] = alphabet[(x >> 24) % NALPHA];
+				break;
+			default:
+				buf[len++] = pfcs[(x >> 24) % (sizeof pfcs - 1)];
+				break;
+			}
+		}
+		buf[len] = '\0';
+		if (len > 0 && (x >> 8) % 2 == 0)
+			buf[0] = '/';
+		check(buf, len);
+		/* also check every prefix, which hits the end states */
+		for (i = 1; i < len; i += 7) {
+			char c = buf[i];
+			buf[i] = '\0';
+			check(buf, i);
+			buf[i] = c;
+		}
+	}
+}
+
+static double
+elapsed(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return ((end.tv_sec - start->tv_sec) +
+	    (end.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+/*
+ * Compare the cost of validating a typical path both ways.
+ */
+static void
+benchmark(unsigned long n)
+{
+	static const char path[] =
+	    "/project/p11/data/raw/2016-02-02/subject 0042/scan_001.dcm";
+	struct timespec start;
+	unsigned long i, ok;
+	double t;
+
+	ok = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; ++i)
+		ok += regexec(&path_regex, path, 0, NULL, 0) == 0;
+	t = elapsed(&start);
+	printf("regexec:       %8.1f ns/path\n", t * 1e9 / n);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; ++i)
+		ok += tsd_pathcheck(path, sizeof path - 1);
+	t = elapsed(&start);
+	printf("tsd_pathcheck: %8.1f ns/path\n", t * 1e9 / n);
+	if (ok != 2 * n)
+		printf("benchmark path rejected\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long iterations;
+	int opt;
+
+	iterations = 0;
+	while ((opt = getopt(argc, argv, "b:")) != -1)
+		switch (opt) {
+		case 'b':
+			iterations = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: pathcheck [-b iterations]\n");
+			exit(1);
+		}
+	if (regcomp(&path_regex, PATH_REGEX, REG_EXTENDED|REG_NOSUB) != 0) {
+		fprintf(stderr, "failed to compile regex\n");
+		exit(1);
+	}
+	if (iterations > 0) {
+		benchmark(iterations);
+		exit(0);
+	}
+	exhaustive(5);
+	random_paths(100000);
+	regfree(&path_regex);
+	printf("%lu tests\n", ntests);
+	test_exit();
+}
@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Check that batch copiers copy many files and directories correctly.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+nfiles=40
+
+for d in a b "c d" ; do
+	mkdir "${srcdir}/${d}"
+	i=0
+	while [ $i -lt ${nfiles} ] ; do
+		echo "${d} ${i}" >"${srcdir}/${d}/file${i}"
+		i=$((i+1))
+	done
+done
+dd bs=1k count=2000 if=/dev/urandom of="${srcdir}/b/large" >/dev/null 2>&1
+
+run_daemon -1 -B 16
+
+for d in a b "c d" ; do
+	i=0
+	while [ $i -lt ${nfiles} ] ; do
+		f="${d}/file${i}"
+		if [ ! -e "${dstdir}/${f}" ] ; then
+			fail_test "missing: ${dstdir}/${f}"
+		elif ! cmp -s "${srcdir}/${f}" "${dstdir}/${f}" ; then
+			fail_test "incorrect: ${dstdir}/${f}"
+		fi
+		i=$((i+1))
+	done
+done
+if ! cmp -s "${srcdir}/b/large" "${dstdir}/b/large" ; then
+	fail_test "incorrect: ${dstdir}/b/large"
+fi
+
+if ! egrep -q "copier batch [0-9]+: ([2-9]|1[0-6]) files" "${logfile}" ; then
+	fail_test "no batch copier was used"
+fi
+if egrep -q "copy task failed" "${logfile}" ; then
+	fail_test "some copy tasks failed"
+fi
+
+cleanup_test
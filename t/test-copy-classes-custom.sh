@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Check that files are assigned to user-defined size classes, and that
+# all of them are copied when the total number of copiers is limited.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+size_max=18446744073709551615
+casefile="${tstdir}/file-class-cases"
+
+cat >>"${casefile}" <<EOF
+tiny-1 100 4096
+tiny-2 4096 4096
+tiny-3 4000 4096
+medium-1 4097 65536
+medium-2 65536 65536
+large-1 65537 ${size_max}
+large-2 200000 ${size_max}
+EOF
+
+while read name size class ; do
+	dd bs="${size}" count=1 \
+	    if=/dev/urandom \
+	    of="${srcdir}/${name}" > /dev/null 2>&1
+done < "${casefile}"
+
+run_daemon -1 -c 4k:2,64k:2:1,:1 -t 2
+
+while read name size class ; do
+	if [ ! -e "${dstdir}/${name}" ] ; then
+		fail_test "missing: ${dstdir}/${name}"
+	elif ! cmp -s "${srcdir}/${name}" "${dstdir}/${name}" ; then
+		fail_test "incorrect: ${dstdir}/${name}"
+	fi
+	if egrep -q "Assigning .*/${name} .* <= ${class}\$" "${logfile}" ; then
+		notice "${name} was assigned to the correct copier"
+	elif egrep -q "Assigning .*/${name} .* <= [0-9]+" "${logfile}" ; then
+		fail_test "${name} was assigned to the wrong copier"
+	else
+		fail_test "unable to find copier assignment for ${name}"
+	fi
+done < "${casefile}"
+
+# the last class must have no upper limit
+if "${tsdfx}" -1 -l "${logfile}" -m "${mapfile}" -c 1M:8,2M:4 ; then
+	fail_test "accepted size classes without an unlimited class"
+fi
+
+cleanup_test
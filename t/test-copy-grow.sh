@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# Check that a file which grows beyond its size class while it is being
+# copied is moved to a larger class and copied in full.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+size_max=18446744073709551615
+
+dd bs=3000 count=1 if=/dev/urandom of="${srcdir}/growing" >/dev/null 2>&1
+sleep 1
+
+# the copier waits for a recently modified file to settle, which gives
+# us time to make it grow
+run_daemon -1 -c 4k:1,:1 &
+sleep 2
+dd bs=100k count=1 if=/dev/urandom >>"${srcdir}/growing" 2>/dev/null
+wait $!
+
+if [ ! -e "${dstdir}/growing" ] ; then
+	fail_test "missing: ${dstdir}/growing"
+elif ! cmp -s "${srcdir}/growing" "${dstdir}/growing" ; then
+	fail_test "incorrect: ${dstdir}/growing"
+fi
+if ! egrep -q "Assigning .*/growing .* <= 4096\$" "${logfile}" ; then
+	fail_test "growing was not first assigned to the small copier"
+fi
+if ! egrep -q "growing grew to [0-9]+ bytes" "${logfile}" ; then
+	fail_test "growing was not moved to a larger size class"
+fi
+if ! egrep -q "Assigning .*/growing .* <= ${size_max}\$" "${logfile}" ; then
+	fail_test "growing was not assigned to the large copier"
+fi
+if egrep -q "copy task failed" "${logfile}" ; then
+	fail_test "some copy tasks failed"
+fi
+
+cleanup_test
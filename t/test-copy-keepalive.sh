@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# Check that idle copiers are reused for files with the same owner.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+nfiles=20
+
+for d in a b ; do
+	mkdir "${srcdir}/${d}"
+	i=0
+	while [ $i -lt ${nfiles} ] ; do
+		echo "${d} ${i}" >"${srcdir}/${d}/file${i}"
+		i=$((i+1))
+	done
+done
+
+run_daemon -1 -k 60 -B 4
+
+for d in a b ; do
+	i=0
+	while [ $i -lt ${nfiles} ] ; do
+		f="${d}/file${i}"
+		if [ ! -e "${dstdir}/${f}" ] ; then
+			fail_test "missing: ${dstdir}/${f}"
+		elif ! cmp -s "${srcdir}/${f}" "${dstdir}/${f}" ; then
+			fail_test "incorrect: ${dstdir}/${f}"
+		fi
+		i=$((i+1))
+	done
+done
+
+if ! egrep -q "copier batch [0-9]+: reused for [1-4] files" "${logfile}" ; then
+	fail_test "no idle copier was reused"
+fi
+if egrep -q "copy task failed" "${logfile}" ; then
+	fail_test "some copy tasks failed"
+fi
+
+cleanup_test
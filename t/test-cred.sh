@@ -0,0 +1,9 @@
+#!/bin/sh
+#
+# Verify that the credential cache answers repeated lookups, including
+# lookups of users who do not exist, without going to the name service.
+#
+
+. $(dirname $0)/testsuite-common.sh
+
+run_program "${cred}"
@@ -0,0 +1,9 @@
+#!/bin/sh
+#
+# Verify that the path validator accepts exactly the same paths as the
+# regular expression it replaced.
+#
+
+. $(dirname $0)/testsuite-common.sh
+
+run_program "${pathcheck}"
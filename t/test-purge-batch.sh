@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# Check that old source files are purged in batches by a purge worker.
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+nfiles=50
+
+mkdir "${srcdir}/sub"
+i=0
+while [ $i -lt ${nfiles} ] ; do
+	echo "${i}" >"${srcdir}/sub/file${i}"
+	i=$((i+1))
+done
+
+# copy everything, then make the source files look old
+run_daemon -1
+touch -a -d "2 days ago" "${srcdir}"/sub/file*
+
+run_daemon -1 -d 86400
+
+i=0
+while [ $i -lt ${nfiles} ] ; do
+	f="sub/file${i}"
+	if [ -e "${srcdir}/${f}" ] ; then
+		fail_test "not purged: ${srcdir}/${f}"
+	elif [ ! -e "${dstdir}/${f}" ] ; then
+		fail_test "missing: ${dstdir}/${f}"
+	fi
+	i=$((i+1))
+done
+
+if ! egrep -q "purger batch [0-9]+: ([2-9]|[1-9][0-9]+) files" "${logfile}" ; then
+	fail_test "no purge worker was used"
+fi
+if egrep -q "failed to purge .*/file" "${logfile}" ; then
+	fail_test "some files could not be purged"
+fi
+
+cleanup_test
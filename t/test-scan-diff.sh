@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Verify that comparing complete listings of the source and destination
+# copies what needs copying and nothing else.
+#
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+mkdir -p "${srcdir}/a/b"
+echo test1 > "${srcdir}/test1"
+echo test2 > "${srcdir}/a/test2"
+echo test3 > "${srcdir}/a/b/test3"
+
+# Directories are created one level per run
+for n in 1 2 3 ; do
+	run_daemon -1 -D
+done
+
+for fn in test1 a/test2 a/b/test3 ; do
+	cmp -s "${srcdir}/${fn}" "${dstdir}/${fn}" ||
+		fail_test "missing or incorrect: ${fn}"
+done
+
+# Nothing has changed, so nothing should be copied
+mv "${logfile}" "${logfile}.old"
+run_daemon -1 -D
+grep -q "test: 0 new, 0 changed, 5 in sync, 0 to purge" "${logfile}" ||
+	fail_test "unexpected comparison result"
+
+# Same size, different contents and mtime, and something new
+sleep 1
+echo TEST2 > "${srcdir}/a/test2"
+echo test4 > "${srcdir}/a/b/test4"
+mv "${logfile}" "${logfile}.old"
+run_daemon -1 -D
+grep -q "test: 1 new, 1 changed, 4 in sync, 0 to purge" "${logfile}" ||
+	fail_test "unexpected comparison result"
+for fn in a/test2 a/b/test4 ; do
+	cmp -s "${srcdir}/${fn}" "${dstdir}/${fn}" ||
+		fail_test "missing or incorrect: ${fn}"
+done
+
+cleanup_test
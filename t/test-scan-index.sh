@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# Verify that a scanner which reuses its index reports the same entries
+# as a full walk, and notices changes made since the previous scan.
+#
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+index=${tstdir}/scan-index
+for a in $(seq 1 4) ; do
+	for b in $(seq 1 4) ; do
+		mkdir -p "${srcdir}/a${a}/b${b}"
+		for n in $(seq 1 4) ; do
+			echo "${a}${b}${n}" >"${srcdir}/a${a}/b${b}/f${n}"
+		done
+	done
+done
+
+# Directories modified during the same second as the scan are not indexed
+sleep 2
+
+"${scanner}" "${srcdir}" | sort >"${tstdir}/scan-full" ||
+	fail_test "scanner failed"
+"${scanner}" -v -i "${index}" "${srcdir}" 2>/dev/null |
+	sort >"${tstdir}/scan-first" ||
+	fail_test "scanner failed"
+cmp -s "${tstdir}/scan-full" "${tstdir}/scan-first" ||
+	fail_test "first indexed scan differs from full walk"
+
+"${scanner}" -v -i "${index}" "${srcdir}" 2>"${tstdir}/scan-log" |
+	sort >"${tstdir}/scan-second" ||
+	fail_test "scanner failed"
+cmp -s "${tstdir}/scan-full" "${tstdir}/scan-second" ||
+	fail_test "second indexed scan differs from full walk"
+grep -q "21 replayed" "${tstdir}/scan-log" ||
+	fail_test "scanner did not reuse its index"
+
+echo "new" >"${srcdir}/a2/b3/new"
+"${scanner}" -i "${index}" "${srcdir}" >"${tstdir}/scan-third" ||
+	fail_test "scanner failed"
+grep -q "/a2/b3/new$" "${tstdir}/scan-third" ||
+	fail_test "scanner did not notice new file"
+
+# The daemon creates the index files on behalf of the scanners
+mkdir "${tstdir}/index"
+run_daemon -1 -x "${tstdir}/index"
+run_daemon -1 -x "${tstdir}/index"
+run_daemon -1 -x "${tstdir}/index"
+ls "${tstdir}"/index/*.idx/index >/dev/null 2>&1 ||
+	fail_test "no index was created"
+! ls "${tstdir}"/index/*.idx/index.new >/dev/null 2>&1 ||
+	fail_test "temporary index was left behind"
+cmp -s "${srcdir}/a2/b3/new" "${dstdir}/a2/b3/new" ||
+	fail_test "missing or incorrect: /a2/b3/new"
+
+cleanup_test
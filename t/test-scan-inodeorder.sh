@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# Verify that the scanner reports the same files whether or not it looks
+# up directory entries in inode order, and that the map option is
+# honored.
+#
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+mkdir -p "${srcdir}/a/b"
+for n in $(seq 1 50) ; do
+	echo "${n}" > "${srcdir}/f${n}"
+	echo "${n}" > "${srcdir}/a/f${n}"
+	echo "${n}" > "${srcdir}/a/b/f${n}"
+done
+
+"${scanner}" "${srcdir}" | sort > "${tstdir}/scan-readdir" ||
+	fail_test "scanner failed"
+"${scanner}" -s "${srcdir}" | sort > "${tstdir}/scan-inode" ||
+	fail_test "scanner failed with -s"
+cmp -s "${tstdir}/scan-readdir" "${tstdir}/scan-inode" ||
+	fail_test "scanner reported different entries with -s"
+
+cat >"${mapfile}" <<EOT
+test: ${srcdir} => ${dstdir} statorder=inode
+EOT
+
+# Directories are created one level per run
+for n in 1 2 3 ; do
+	run_daemon -1
+done
+
+for fn in f1 a/f25 a/b/f50 ; do
+	cmp -s "${srcdir}/${fn}" "${dstdir}/${fn}" ||
+		fail_test "missing or incorrect: ${fn}"
+done
+
+cat >"${mapfile}" <<EOT
+test: ${srcdir} => ${dstdir} statorder=sideways
+EOT
+if "${tsdfx}" -1 -l "${logfile}" -m "${mapfile}" ; then
+	fail_test "accepted an invalid map option"
+fi
+
+cleanup_test
@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Verify that a persistent scanner picks up new files on each rescan,
+# and that the same scanner process performs every scan.
+#
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+mkdir "${srcdir}/subdir"
+echo test1 > "${srcdir}/test1"
+
+run_daemon -P -i 1 -x "${tstdir}"
+
+# Timeout for various operations
+timeout=10
+
+wait_for() {
+	local elapsed=0
+	while ! cmp -s "${srcdir}/$1" "${dstdir}/$1" ; do
+		[ $((elapsed+=1)) -le "${timeout}" ] ||
+		    fail_test "timed out waiting for $1"
+		sleep 1
+	done
+}
+
+wait_for test1
+
+echo test2 > "${srcdir}/test2"
+wait_for test2
+
+echo test3 > "${srcdir}/subdir/test3"
+wait_for subdir/test3
+
+scans=$(grep -c "tsdfx_scan_run() found" "${logfile}")
+pids=$(grep "tsdfx_scan_run() found" "${logfile}" |
+	sed -e 's/^[^[]*\[\([0-9]*\)\].*/\1/' | sort -u | wc -l)
+notice "${scans} scans by ${pids} scanners"
+[ "${scans}" -ge 3 ] ||
+	fail_test "expected at least 3 scans, saw ${scans}"
+[ "${pids}" -eq 1 ] ||
+	fail_test "expected a single scanner, saw ${pids}"
+
+cleanup_test
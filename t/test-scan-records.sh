@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Verify that files are copied correctly when the scanner reports their
+# metadata, that files which are already in sync are left alone, and
+# that files which have changed are copied again.
+#
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+mkdir -p "${srcdir}/a/b"
+echo test1 > "${srcdir}/test1"
+echo test2 > "${srcdir}/a/test2"
+echo test3 > "${srcdir}/a/b/test3"
+
+# Directories are created one level per run
+for n in 1 2 3 ; do
+	run_daemon -1 -b
+done
+
+for fn in test1 a/test2 a/b/test3 ; do
+	cmp -s "${srcdir}/${fn}" "${dstdir}/${fn}" ||
+		fail_test "missing or incorrect: ${fn}"
+done
+
+# Nothing has changed, so nothing should be copied
+mv "${logfile}" "${logfile}.old"
+run_daemon -1 -b
+if grep -q "Assigning" "${logfile}" ; then
+	fail_test "copied files which were already in sync"
+fi
+
+# Same size, different contents and mtime
+sleep 1
+echo TEST2 > "${srcdir}/a/test2"
+run_daemon -1 -b
+cmp -s "${srcdir}/a/test2" "${dstdir}/a/test2" ||
+	fail_test "modified file was not copied"
+
+cleanup_test
@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Verify that a multi-threaded scanner finds every file in a tree that
+# is both wide and deep.
+#
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+list=${tstdir}/scan-threads-files
+for a in $(seq 1 8) ; do
+	for b in $(seq 1 8) ; do
+		mkdir -p "${srcdir}/a${a}/b${b}/c"
+		for n in $(seq 1 4) ; do
+			echo "/a${a}/b${b}/f${n}"
+			echo "/a${a}/b${b}/c/f${n}"
+		done
+	done
+done > ${list}
+
+while read fn ; do
+	echo "${fn}" >"${srcdir}${fn}"
+done < ${list}
+
+"${scanner}" -j 4 "${srcdir}" > "${tstdir}/scan-threads-output" ||
+	fail_test "scanner failed"
+nlines=$(wc -l < "${tstdir}/scan-threads-output")
+nexpected=$(( $(wc -l < ${list}) + 8 + 8 * 8 * 2 ))
+if [ "${nlines}" -ne "${nexpected}" ] ; then
+	fail_test "scanner reported ${nlines} entries, expected ${nexpected}"
+fi
+
+# Directories are created one level per run
+for n in 1 2 3 4 ; do
+	run_daemon -1 -j 4
+done
+
+missing=0
+while read fn ; do
+	if ! cmp -s "${srcdir}${fn}" "${dstdir}${fn}" ; then
+		notice "missing or incorrect: ${fn}"
+		: $((missing++))
+	fi
+done < ${list}
+
+if [ $missing -gt 0 ] ; then
+	fail_test "$missing missing or incorrect"
+fi
+
+cleanup_test
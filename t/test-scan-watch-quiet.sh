@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# Verify that when watching for changes, a tree which does not change
+# while it is being scanned is only scanned once after startup, even
+# though every directory in it gets a new watch.
+#
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+for d in a b c a/d a/d/e ; do
+	mkdir "${srcdir}/${d}"
+	echo "${d}" > "${srcdir}/${d}/file"
+done
+
+# let the tree settle into the past
+sleep 2
+
+run_daemon -i 3600 -w 3600
+
+# Timeout for various operations
+timeout=10
+
+wait_for() {
+	local elapsed=0
+	while ! cmp -s "${srcdir}/$1" "${dstdir}/$1" ; do
+		[ $((elapsed+=1)) -le "${timeout}" ] ||
+		    fail_test "timed out waiting for $1"
+		sleep 1
+	done
+}
+
+wait_for a/d/e/file
+
+# give a second scan, if there is one, time to happen
+sleep 3
+
+scans=$(grep -c "tsdfx_scan_finished() in ${srcdir} found" "${logfile}")
+notice "${scans} scans"
+[ "${scans}" -eq 1 ] ||
+	fail_test "expected a single scan, saw ${scans}"
+
+cleanup_test
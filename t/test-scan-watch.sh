@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Verify that files which appear after the first scan are picked up
+# right away when watching for changes, even though the next scan is
+# not due for an hour.
+#
+
+. $(dirname $0)/testsuite-common.sh
+
+setup_test
+
+mkdir "${srcdir}/subdir"
+echo test1 > "${srcdir}/test1"
+
+run_daemon -i 3600 -w 3600
+
+# Timeout for various operations
+timeout=10
+
+wait_for() {
+	local elapsed=0
+	while ! cmp -s "${srcdir}/$1" "${dstdir}/$1" ; do
+		[ $((elapsed+=1)) -le "${timeout}" ] ||
+		    fail_test "timed out waiting for $1"
+		sleep 1
+	done
+}
+
+wait_for test1
+
+echo test2 > "${srcdir}/test2"
+wait_for test2
+
+echo test3 > "${srcdir}/subdir/test3"
+wait_for subdir/test3
+
+mkdir "${srcdir}/newdir"
+echo test4 > "${srcdir}/newdir/test4"
+wait_for newdir/test4
+
+cleanup_test
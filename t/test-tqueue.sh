@@ -0,0 +1,9 @@
+#!/bin/sh
+#
+# Verify that task queues serve groups in proportion to their weight
+# and owners within each group in turn.
+#
+
+. $(dirname $0)/testsuite-common.sh
+
+run_program "${tqueue}"
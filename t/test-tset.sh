@@ -0,0 +1,9 @@
+#!/bin/sh
+#
+# Verify that task sets find every task and that iteration survives
+# removal of the current task.
+#
+
+. $(dirname $0)/testsuite-common.sh
+
+run_program "${tset}"
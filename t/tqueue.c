@@ -0,0 +1,206 @@
+/*-
+ * Copyright (c) 2026 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Test for fair queuing in task queues: a group with a large backlog
+ * must not hold up other groups, groups must be served in proportion
+ * to their weight, and owners within a group must take turns.  Tasks
+ * with the same group and owner must end up in the same flow however
+ * many flows there are, and flows must go away when they run dry.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tsd/task.h>
+
+#include "testsuite.h"
+
+#define NGROUPS 3
+
+/* group, owner, weight and number of tasks */
+static const struct {
+	unsigned int group, owner, weight, n;
+} spec[] = {
+	{ 0, 0, 2, 1000 },
+	{ 0, 1, 2, 10 },
+	{ 1, 0, 1, 10 },
+	{ 2, 1, 1, 10 },
+};
+#define NSPECS (sizeof spec / sizeof spec[0])
+
+static void
+add(struct tsd_tqueue *tq, unsigned int s, unsigned int i)
+{
+	struct tsd_task *t;
+	char name[64];
+
+	snprintf(name, sizeof name, "task%u-%u", s, i);
+	if ((t = tsd_task_create(name, NULL, NULL)) == NULL) {
+		perror("tsd_task_create");
+		exit(1);
+	}
+	t->uid = spec[s].owner;
+	t->qgroup = spec[s].group;
+	t->qweight = spec[s].weight;
+	t->ud = (void *)(uintptr_t)s;
+	if (tsd_tqueue_insert(tq, t) != 0)
+		FAIL("failed to insert %s\n", name);
+}
+
+/*
+ * Queue two tasks for each of many groups and owners, interleaved so
+ * that the flow index grows, shrinks and is probed past removed flows,
+ * and check that each pair shares a flow.
+ */
+#define MANY_GROUPS 37
+#define MANY_OWNERS 29
+
+static void
+manyflows(void)
+{
+	static struct tsd_task *tasks[2][MANY_GROUPS][MANY_OWNERS];
+	struct tsd_tqueue *tq;
+	struct tsd_task *t;
+	char name[64];
+	unsigned int g, i, o, n, left;
+
+	if ((tq = tsd_tqueue_create("many", 1)) == NULL) {
+		perror("tsd_tqueue_create");
+		exit(1);
+	}
+	for (i = 0; i < 2; ++i) {
+		for (g = 0; g < MANY_GROUPS; ++g) {
+			for (o = 0; o < MANY_OWNERS; ++o) {
+				snprintf(name, sizeof name, "many%u-%u-%u",
+				    i, g, o);
+				t = tsd_task_create(name, NULL, NULL);
+				if (t == NULL) {
+					perror("tsd_task_create");
+					exit(1);
+				}
+				t->uid = o;
+				t->qgroup = g;
+				t->qweight = 1;
+				if (tsd_tqueue_insert(tq, t) != 0)
+					FAIL("failed to insert %s\n", name);
+				tasks[i][g][o] = t;
+			}
+		}
+	}
+	if (tq->nflows != MANY_GROUPS * (MANY_OWNERS + 1))
+		FAIL("%u flows, expected %u\n", tq->nflows,
+		    MANY_GROUPS * (MANY_OWNERS + 1));
+	for (g = 0; g < MANY_GROUPS; ++g)
+		for (o = 0; o < MANY_OWNERS; ++o)
+			if (tasks[0][g][o]->qflow != tasks[1][g][o]->qflow)
+				FAIL("%s and %s are in different flows\n",
+				    tasks[0][g][o]->name, tasks[1][g][o]->name);
+	/* empty every other flow, then all of them */
+	left = 2 * MANY_GROUPS * MANY_OWNERS;
+	for (g = 0; g < MANY_GROUPS; ++g) {
+		for (o = g % 2; o < MANY_OWNERS; o += 2) {
+			for (i = 0; i < 2; ++i)
+				tsd_task_destroy(tasks[i][g][o]);
+			left -= 2;
+		}
+	}
+	for (n = 0; (t = tsd_tqueue_next(tq)) != NULL; ++n)
+		tsd_task_destroy(t);
+	if (n != left)
+		FAIL("%u tasks dequeued, expected %u\n", n, left);
+	if (tq->nflows != 0 || tq->cur != NULL)
+		FAIL("%u flows left over\n", tq->nflows);
+	tsd_tqueue_destroy(tq);
+}
+
+int
+main(void)
+{
+	unsigned int count[NSPECS], gcount[NGROUPS];
+	struct tsd_tqueue *tq;
+	struct tsd_task *t;
+	char name[64];
+	unsigned int i, j, n, s;
+
+	if ((tq = tsd_tqueue_create("test", 1)) == NULL) {
+		perror("tsd_tqueue_create");
+		exit(1);
+	}
+
+	/* the big backlog is queued first */
+	for (s = 0; s < NSPECS; ++s)
+		for (i = 0; i < spec[s].n; ++i)
+			add(tq, s, i);
+	if (tq->nidle != 1030)
+		FAIL("%u idle tasks, expected 1030\n", tq->nidle);
+
+	/* take tasks off the queue in the order in which they would run */
+	memset(count, 0, sizeof count);
+	memset(gcount, 0, sizeof gcount);
+	for (n = 0; (t = tsd_tqueue_next(tq)) != NULL; ++n) {
+		s = (unsigned int)(uintptr_t)t->ud;
+		snprintf(name, sizeof name, "task%u-%u", s, count[s]);
+		if (strcmp(t->name, name) != 0)
+			FAIL("%s out of order within its flow\n", t->name);
+		count[s]++;
+		gcount[spec[s].group]++;
+		/* while all groups are busy, shares follow the weights */
+		if (n == 39) {
+			if (gcount[0] != 20 || gcount[1] != 10 ||
+			    gcount[2] != 10)
+				FAIL("after %u tasks: %u/%u/%u by group\n",
+				    n + 1, gcount[0], gcount[1], gcount[2]);
+			/* owners within the first group take turns */
+			if (count[0] != 10 || count[1] != 10)
+				FAIL("after %u tasks: %u/%u by owner\n",
+				    n + 1, count[0], count[1]);
+		}
+		tsd_task_destroy(t);
+	}
+	if (n != 1030)
+		FAIL("%u tasks dequeued, expected 1030\n", n);
+	for (j = 0; j < NSPECS; ++j)
+		if (count[j] != spec[j].n)
+			FAIL("%u of %u tasks for flow %u\n", count[j],
+			    spec[j].n, j);
+	if (tq->nidle != 0 || tq->ntasks != 0 || tq->cur != NULL)
+		FAIL("queue not empty\n");
+	tsd_tqueue_destroy(tq);
+	manyflows();
+	test_exit();
+}
@@ -0,0 +1,228 @@
+/*-
+ * Copyright (c) 2026 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Test and microbenchmark for task sets: every task must be found, and
+ * iteration must visit every task exactly once even when the current
+ * task is removed along the way.
+ *
+ * usage: tset [-b ntasks]
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tsd/task.h>
+
+#include "testsuite.h"
+
+static struct tsd_task **
+create(unsigned long n)
+{
+	struct tsd_task **tasks;
+	char name[64];
+	unsigned long i;
+
+	if ((tasks = calloc(n, sizeof *tasks)) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < n; ++i) {
+		snprintf(name, sizeof name, "task%lu", i);
+		if ((tasks[i] = tsd_task_create(name, NULL, NULL)) == NULL) {
+			perror("tsd_task_create");
+			exit(1);
+		}
+	}
+	return (tasks);
+}
+
+static void
+insert(struct tsd_tset *ts, struct tsd_task **tasks, unsigned long n,
+    unsigned long step)
+{
+	unsigned long i;
+
+	for (i = 0; i < n; i += step)
+		if (tsd_tset_insert(ts, tasks[i]) != 0)
+			FAIL("failed to insert %s\n", tasks[i]->name);
+}
+
+static int
+same_name(const struct tsd_task *t, const void *name)
+{
+
+	return (strcmp(t->name, name) == 0);
+}
+
+static void
+find(const struct tsd_tset *ts, struct tsd_task **tasks, unsigned long n)
+{
+	unsigned long i;
+
+	for (i = 0; i < n; ++i) {
+		if (tsd_tset_find(ts, tasks[i]->name) != tasks[i])
+			FAIL("failed to find %s\n", tasks[i]->name);
+		if (tsd_tset_match(ts, tasks[i]->h, same_name,
+		    tasks[i]->name) != tasks[i])
+			FAIL("failed to match %s\n", tasks[i]->name);
+	}
+	if (tsd_tset_find(ts, "no such task") != NULL)
+		FAIL("found a task which does not exist\n");
+}
+
+/*
+ * Walk the set, removing every other task as we go, alternating
+ * between looking ahead before removing and asking for the next task
+ * after removing.
+ */
+static void
+walk(struct tsd_tset *ts, struct tsd_task **tasks, unsigned long n)
+{
+	struct tsd_task *t, *tn;
+	unsigned char *seen;
+	unsigned long i, nseen;
+
+	if ((seen = calloc(n, 1)) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	nseen = 0;
+	for (t = tsd_tset_first(ts); t != NULL; t = tn) {
+		i = strtoul(t->name + 4, NULL, 10);
+		if (i >= n || tasks[i] != t || seen[i]++) {
+			FAIL("unexpected %s\n", t->name);
+			break;
+		}
+		nseen++;
+		if (i % 4 == 0) {
+			tn = tsd_tset_next(ts, t);
+			tsd_tset_remove(ts, t);
+		} else if (i % 4 == 2) {
+			tsd_tset_remove(ts, t);
+			tn = tsd_tset_next(ts, t);
+		} else {
+			tn = tsd_tset_next(ts, t);
+		}
+	}
+	if (nseen != n)
+		FAIL("visited %lu of %lu tasks\n", nseen, n);
+	if (ts->ntasks != n / 2)
+		FAIL("%u tasks left, expected %lu\n", ts->ntasks, n / 2);
+	if ((ts->nused - ts->ntasks) * 4 > ts->size)
+		FAIL("%u removed tasks left in a table of %u\n",
+		    ts->nused - ts->ntasks, ts->size);
+	free(seen);
+}
+
+static double
+elapsed(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec +
+	    (end.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+static void
+benchmark(unsigned long n)
+{
+	struct tsd_task **tasks;
+	struct tsd_tset *ts;
+	struct timespec start;
+
+	tasks = create(n);
+	ts = tsd_tset_create("benchmark");
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	insert(ts, tasks, n, 1);
+	printf("insert: %.0f ns per task\n", elapsed(&start) * 1e9 / n);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	find(ts, tasks, n);
+	printf("find: %.0f ns per task\n", elapsed(&start) * 1e9 / n);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct tsd_task **tasks;
+	struct tsd_tset *ts;
+	unsigned long i, n;
+	int opt;
+
+	n = 0;
+	while ((opt = getopt(argc, argv, "b:")) != -1)
+		switch (opt) {
+		case 'b':
+			n = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: tset [-b ntasks]\n");
+			exit(1);
+		}
+	if (n > 0) {
+		benchmark(n);
+		exit(nfailed > 0);
+	}
+
+	n = 100000;
+	tasks = create(n);
+	if ((ts = tsd_tset_create("test")) == NULL) {
+		perror("tsd_tset_create");
+		exit(1);
+	}
+	insert(ts, tasks, n, 1);
+	if (ts->ntasks != n)
+		FAIL("%u tasks in set, expected %lu\n", ts->ntasks, n);
+	if (tsd_tset_insert(ts, tasks[0]) == 0)
+		FAIL("inserted %s twice\n", tasks[0]->name);
+	find(ts, tasks, n);
+	walk(ts, tasks, n);
+	insert(ts, tasks, n, 2);
+	find(ts, tasks, n);
+	for (i = 0; i < n; ++i)
+		tsd_task_destroy(tasks[i]);
+	if (ts->ntasks != 0 || tsd_tset_first(ts) != NULL)
+		FAIL("set not empty after destroying all tasks\n");
+	if (ts->size > 64)
+		FAIL("empty set still has %u slots\n", ts->size);
+	tsd_tset_destroy(ts);
+	free(tasks);
+	test_exit();
+}